@@ -0,0 +1,64 @@
+// Throughput of the base64 and quoted-printable codec per implementation.
+//
+//   codec_bench [MiB]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+
+#include "codec.h"
+
+using namespace remote_agent;
+
+namespace {
+    // Best of a few rounds in MiB/s of input.
+    double measure(std::size_t bytes, const std::function<std::size_t()>& work) {
+        double best = 0;
+        std::size_t sink = 0;
+        for (int round = 0; round < 5; round++) {
+            auto start = std::chrono::steady_clock::now();
+            sink += work();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::max(best, bytes / elapsed.count() / (1024 * 1024));
+        }
+        if (sink == 0)
+            std::puts("");
+        return best;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    std::size_t size = mib * 1024 * 1024;
+
+    std::mt19937 rng(42);
+    std::string binary(size, '\0');
+    for (auto& c : binary)
+        c = static_cast<char>(rng());
+    // mostly ASCII with line breaks, like task output
+    std::string text(size, '\0');
+    for (std::size_t i = 0; i < size; i++) {
+        unsigned value = rng() % 100;
+        text[i] = value == 0 ? '\n' : value < 15 ? ' ' : value < 16 ? '=' : static_cast<char>('!' + value % 90);
+    }
+
+    std::printf("%-8s %14s %14s %14s %14s\n", "impl", "b64 enc MiB/s", "b64 dec MiB/s", "qp enc MiB/s",
+                "qp dec MiB/s");
+    for (const char* name : {"scalar", "sse4.1", "avx2"}) {
+        if (!codec::selectImplementation(name)) {
+            std::printf("%-8s not supported by this CPU\n", name);
+            continue;
+        }
+        std::string base64 = codec::encodeBase64(binary, 76);
+        std::string qp = codec::encodeQuotedPrintable(text);
+        double b64_enc = measure(size, [&]() { return codec::encodeBase64(binary, 76).size(); });
+        double b64_dec = measure(base64.size(), [&]() { return codec::decodeBase64(base64).size(); });
+        double qp_enc = measure(size, [&]() { return codec::encodeQuotedPrintable(text).size(); });
+        double qp_dec = measure(qp.size(), [&]() { return codec::decodeQuotedPrintable(qp).size(); });
+        std::printf("%-8s %14.0f %14.0f %14.0f %14.0f\n", name, b64_enc, b64_dec, qp_enc, qp_dec);
+    }
+    return 0;
+}
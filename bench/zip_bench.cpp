@@ -0,0 +1,119 @@
+// Ratio and throughput of the result archive compression methods on task
+// output; synthetic log lines unless a real log file is given.
+//
+//   zip_bench [MiB | log file]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#include "file_utils.h"
+
+using namespace remote_agent;
+
+namespace {
+    struct Setting {
+        const char* method;
+        int16_t level;
+        int threads;
+    };
+
+    // Best of a few rounds in seconds; setup runs before each round, untimed.
+    double measure(const std::function<void()>& setup, const std::function<bool()>& work) {
+        double best = 0;
+        for (int round = 0; round < 3; round++) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            if (!work())
+                return -1;
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (round == 0 || elapsed.count() < best)
+                best = elapsed.count();
+        }
+        return best;
+    }
+
+    // Timestamps, levels, counters and paths, the shape of a runner log.
+    void writeLog(const std::filesystem::path& path, std::size_t size) {
+        static const char* LEVELS[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+        static const char* WORDS[] = {"build", "install", "fetch", "compile", "link", "test", "upload", "cleanup"};
+        std::mt19937 engine(42);
+        auto rng = [&engine]() { return static_cast<unsigned>(engine()); };
+        std::ofstream out(path, std::ios::binary);
+        std::size_t written = 0;
+        long millis = 0;
+        char line[256];
+        while (written < size) {
+            millis += rng() % 500;
+            int length = std::snprintf(line, sizeof(line),
+                                       "2026-10-17T%02ld:%02ld:%02ld.%03ld [%s] step %u %s: /var/lib/remote_agent/"
+                                       "work/%08x/%s.o exit=%u elapsed=%ums\n",
+                                       millis / 3600000 % 24, millis / 60000 % 60, millis / 1000 % 60,
+                                       millis % 1000, LEVELS[rng() % 6], rng() % 40, WORDS[rng() % 8],
+                                       rng(), WORDS[rng() % 8], rng() % 3, rng() % 10000);
+            out.write(line, length);
+            written += length;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    auto dir = std::filesystem::temp_directory_path() / ("zip_bench." + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+    std::filesystem::path input = dir / "task.log";
+    if (argc > 1 && std::filesystem::is_regular_file(argv[1])) {
+        std::filesystem::copy_file(argv[1], input);
+    } else {
+        std::size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+        writeLog(input, mib * 1024 * 1024);
+    }
+    const double size = static_cast<double>(std::filesystem::file_size(input));
+    const auto archive = dir / "task.zip";
+    const auto extracted = dir / "out";
+
+    const Setting settings[] = {
+        {"store", MZ_COMPRESS_LEVEL_DEFAULT, 1},
+        {"deflate", 1, 1},
+        {"deflate", 6, 1},
+        {"deflate", 9, 1},
+        {"deflate", 6, 4},
+        {"bzip2", 9, 1},
+        {"lzma", 6, 1},
+        {"xz", 9, 1},
+        {"zstd", 1, 1},
+        {"zstd", 3, 1},
+        {"zstd", 19, 1},
+    };
+    std::printf("%-8s %5s %7s %8s %14s %14s\n", "method", "level", "threads", "ratio", "compress MiB/s",
+                "extract MiB/s");
+    for (const auto& setting : settings) {
+        Zip zip;
+        zip.setThreads(setting.threads);
+        zip.setCompressMethod(Zip::compressMethod(setting.method).value());
+        zip.setCompressLevel(setting.level);
+        double compress = measure([&]() { std::filesystem::remove(archive); },
+                                  [&]() { return !zip.compress({input.string()}, archive.string()).has_value(); });
+        double extract = measure([&]() { std::filesystem::remove_all(extracted); },
+                                 [&]() { return !zip.extract(archive.string(), extracted.string()).has_value(); });
+        // compress() only logs entries it could not add, e.g. a method
+        // minizip was built without
+        std::error_code ec;
+        if (compress < 0 || extract < 0 ||
+            std::filesystem::file_size(extracted / input.filename(), ec) != static_cast<uintmax_t>(size)) {
+            std::printf("%-8s %5d %7d not supported by this minizip build\n", setting.method, setting.level,
+                        setting.threads);
+            continue;
+        }
+        double ratio = size / std::filesystem::file_size(archive);
+        std::printf("%-8s %5d %7d %8.2f %14.0f %14.0f\n", setting.method, setting.level, setting.threads, ratio,
+                    size / compress / (1024 * 1024), size / extract / (1024 * 1024));
+    }
+    std::filesystem::remove_all(dir);
+    return 0;
+}
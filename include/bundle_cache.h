@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+namespace remote_agent {
+
+    // Extracted task bundles under <work_dir>/.bundles, keyed by the SHA-256
+    // of the archive: <digest>/tree holds the inflated entries and
+    // <digest>/size their total size. Runs get the entries they need as
+    // reflinks or copies they may change freely, so mailing the same archive
+    // again costs a hash instead of an inflate. The least recently used bundles are
+    // dropped once the cache outgrows max_bytes.
+    class BundleCache {
+        public:
+            static BundleCache& getInstance();
+
+            // Hex SHA-256 of the archive file.
+            static std::optional<std::string> archiveDigest(const std::string& zip_file);
+
+            bool enabled() const;
+            // Makes the named entries of zip_file, whose digest is given,
+            // available below destination_dir; the archive is inflated only
+            // when it is not cached yet.
+            std::optional<Error> materialize(const std::string& zip_file, const std::string& digest,
+                                             const std::vector<std::string>& entries,
+                                             const std::string& destination_dir);
+
+        private:
+            BundleCache();
+            BundleCache(const BundleCache&) = delete;
+            BundleCache& operator=(const BundleCache&) = delete;
+
+            std::optional<Error> populate(const std::string& zip_file, const std::string& digest);
+            std::optional<Error> link(const std::filesystem::path& source, const std::filesystem::path& target);
+            // Drops least recently used bundles other than keep until the
+            // cache fits its budget.
+            void evict(const std::string& keep);
+            static uint64_t bundleSize(const std::filesystem::path& bundle);
+
+            const BundleCacheConfig _config;
+            const std::filesystem::path _root;
+            std::mutex _mutex;
+    };
+};
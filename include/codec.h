@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace remote_agent::codec {
+
+    // Encodes data as base64. With a line_length, e.g. 76 for MIME, every
+    // line of that many characters ends in CRLF, the last one included;
+    // without, there are no line breaks.
+    std::string encodeBase64(const std::string& input, std::size_t line_length = 0);
+    // Decodes base64 text; line breaks and other whitespace are skipped.
+    std::string decodeBase64(const std::string& input);
+    // Encodes text as quoted-printable with CRLF line breaks, soft breaks
+    // keep lines within 76 characters.
+    std::string encodeQuotedPrintable(const std::string& input);
+    // Decodes quoted-printable text including soft line breaks.
+    std::string decodeQuotedPrintable(const std::string& input);
+    // Base64 decoder for input that arrives in pieces split anywhere, e.g.
+    // line by line while a message is still being received.
+    class Base64Decoder {
+        public:
+            // Appends the octets decoded from data to output.
+            void decode(const char* data, std::size_t size, std::string& output);
+
+        private:
+            uint32_t _buffer = 0;
+            int _bits = 0;
+            bool _done = false;
+    };
+
+    // Decodes RFC 2047 encoded words in a header value, e.g.
+    // =?UTF-8?B?...?=; the charset is not converted.
+    std::string decodeEncodedWords(const std::string& text);
+    // Decodes a MIME body according to its Content-Transfer-Encoding; 7bit,
+    // 8bit and binary bodies are returned unchanged.
+    std::string decodeTransfer(const std::string& input, const std::string& encoding);
+
+    // The encoders and decoders use AVX2 or SSE4.1 kernels when the CPU has
+    // them. Name of the kernels in use: "avx2", "sse4.1" or "scalar".
+    const char* implementation();
+    // Switches to the named kernels, e.g. to compare them in a benchmark;
+    // false when the CPU lacks them.
+    bool selectImplementation(const std::string& name);
+};
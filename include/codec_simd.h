@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Vector kernels behind the codec functions. Each one only handles whole
+// blocks and leaves the tail to the scalar code in codec.cpp, which also
+// picks the kernels at runtime from the CPU features.
+namespace remote_agent::codec::simd {
+
+    // Encodes whole 3 octet groups of the first `count` octets of in while
+    // the loads stay inside `readable` octets; returns the octets consumed,
+    // 4/3 of that many characters are written to out.
+    using EncodeBase64 = std::size_t (*)(const uint8_t* in, std::size_t count, std::size_t readable, char* out);
+    // Decodes one block of base64 characters without whitespace or padding
+    // (16 for SSE, 32 for AVX2) into 3/4 as many octets. Up to a full block
+    // is stored to out. Returns false, with out unspecified, when the block
+    // holds anything but base64 characters.
+    using DecodeBase64 = bool (*)(const char* in, uint8_t* out);
+    // Length of the leading run of octets quoted-printable can send as they
+    // are: printable ASCII except '=', plus space and tab.
+    using QpLiteralRun = std::size_t (*)(const char* in, std::size_t size);
+    // Offset of the first c in in, size when there is none.
+    using FindByte = std::size_t (*)(const char* in, std::size_t size, char c);
+
+    struct Kernels {
+        const char* name;
+        EncodeBase64 encode_base64;
+        DecodeBase64 decode_base64;
+        std::size_t decode_block;       // characters per decode_base64 call
+        QpLiteralRun qp_literal_run;
+        FindByte find_byte;
+    };
+
+    // Null when the platform or the CPU lacks the instruction set.
+    const Kernels* sse41();
+    const Kernels* avx2();
+};
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <list>
+#include <memory>
 #include <optional>
 #include <utility>
 
@@ -10,14 +12,91 @@
 #include <mailio/imap.hpp>
 #include <mailio/mailboxes.hpp>
 
+#include "mail_rules.h"
+
 namespace remote_agent {
 
+struct SessionPoolConfig {
+    int max_per_account;        // Upper bound of open sessions per account and protocol
+    int idle_timeout_sec;       // Idle sessions older than this are logged out
+    int keepalive_interval_sec; // NOOP period for idle sessions
+};
+
+struct TlsConfig {
+    bool shared_context;        // One TLS context and session cache per host
+    bool verify_peer;           // Verify server certificates and host names
+};
+
+// Polling speeds up to min_interval_ms after a hit and backs off by
+// backoff_factor on empty polls and errors, up to max_interval_ms.
+struct PollScheduleConfig {
+    int min_interval_ms;
+    int max_interval_ms;
+    double backoff_factor;
+    double jitter;              // Random spread of each delay, 0.2 = +/-20%
+};
+
+struct SpoolConfig {
+    int workers;                // Background sender threads
+    int max_per_account;        // Mails submitted concurrently through one account
+    int retry_base_sec;         // First retry delay, doubled after every failure
+    int retry_max_sec;          // Upper bound of the retry delay
+    int max_attempts;           // Give up after this many failures, 0 = never
+    unsigned long segment_size; // Rotate the spool segment above this many bytes
+};
+
+struct ResultArchiveConfig {
+    unsigned long compress_threshold;   // Zip task outputs larger than this many bytes
+    unsigned long max_attachment_size;  // Split archives into parts of this size, 0 = never
+    uint16_t compress_method;           // MZ_COMPRESS_METHOD_*, from store/deflate/bzip2/lzma/xz/zstd
+    int16_t compress_level;             // Method specific, -1 = method default
+};
+
+struct ZipConfig {
+    int threads;                // Entries inflated/deflated in parallel, 1 = on the calling thread
+    unsigned long memory_limit; // Compressed entries held in memory while waiting for their turn
+    // Caps of one extraction, 0 = unlimited
+    unsigned long max_extract_bytes;  // Inflated bytes over all entries
+    unsigned long max_entries;
+    unsigned long max_ratio;    // Inflated to compressed size of an entry past 1 MiB
+    int extract_timeout_sec;
+};
+
+struct BundleCacheConfig {
+    bool enabled;               // Reuse extracted bundles of identical archives
+    unsigned long max_bytes;    // Least recently used bundles are dropped above this
+};
+
+struct DigestConfig {
+    bool enabled;               // Coalesce task results into digest mails
+    int window_sec;             // Send a digest this long after its first result
+    int max_results;            // ... or as soon as it holds this many results
+};
+
+struct DedupConfig {
+    bool enabled;
+    int retention_days;         // Entries older than this are dropped on compaction
+    unsigned long max_entries;  // Newest entries kept; also sizes the Bloom filter
+    double false_positive_rate; // Bloom filter target, lower costs more memory
+};
+
 struct GlobalConfig {
     int default_timeout;
     std::string log_level;
     std::string work_dir;
     std::string zeromq_endpoint;
     int check_mail_interval_ms;
+    int mail_workers;           // Accounts polled concurrently
+    int mail_processors;        // Fetched messages extracted concurrently
+    SessionPoolConfig session_pool;
+    TlsConfig tls;
+    PollScheduleConfig poll_schedule;
+    SpoolConfig spool;
+    DigestConfig digest;
+    ResultArchiveConfig result_archive;
+    ZipConfig zip;
+    BundleCacheConfig bundle_cache;
+    DedupConfig dedup;
 };
 
 struct ProtocolConfig {
@@ -25,6 +104,14 @@ struct ProtocolConfig {
     int port;
     std::string security;
     std::string auth_method;
+    bool compress;              // IMAP COMPRESS=DEFLATE (RFC 4978) when offered
+};
+
+struct AttachmentFilterConfig {
+    bool selective;                      // Fetch BODYSTRUCTURE first, then only matching parts
+    std::list<std::string> extensions;   // Lower case with leading dot, e.g. ".zip"
+    std::list<std::string> mime_types;   // Lower case "type/subtype"
+    unsigned long max_size;              // Encoded part size limit in octets, 0 = unlimited
 };
 
 struct ImapFilterConfig {
@@ -32,6 +119,14 @@ struct ImapFilterConfig {
     std::list<std::string> folders;  // Array of folders to search in
     bool read_only;
     std::list<mailio::imap::search_condition_t> conditions;
+    AttachmentFilterConfig attachments;
+    int fetch_batch_size;            // UIDs requested per pipelined FETCH
+    std::shared_ptr<const mail::MailRules> rules;  // Checked on the header before the body is fetched, null = none
+};
+
+struct ImapIdleConfig {
+    bool enabled;
+    int refresh_interval_sec;  // Re-issue IDLE before the server drops it (RFC 2177: < 29 min)
 };
 
 struct SmtpConfig {
@@ -43,11 +138,14 @@ struct SmtpConfig {
 
 struct AccountConfig {
     std::string name;
+    int check_mail_interval_ms;  // Defaults to global.check_mail_interval_ms
+    PollScheduleConfig poll_schedule;
 
     ProtocolConfig smtp;
     ProtocolConfig imap;
 
     ImapFilterConfig imap_filter;
+    ImapIdleConfig imap_idle;
     std::optional<SmtpConfig> smtp_details;
     
     struct Credentials {
@@ -68,6 +166,7 @@ enum class ErrorCode {
     FILE_CREATE_FAILED,
     FILE_CLOSE_FAILED,
     UNARCHIVE_FAILED,
+    ARCHIVE_LIMIT_EXCEEDED,
     NO_NEW_MAIL,
     UNKNOWN
 };
@@ -90,6 +189,19 @@ class Config {
         std::string trim(const std::string& str);
         mailio::imap::search_condition_t parseCondition(const YAML::Node& condition_node);
         std::optional<ImapFilterConfig> parseImapFilter(const YAML::Node& imap_node);
+        SessionPoolConfig parseSessionPool(const YAML::Node& global_node);
+        TlsConfig parseTls(const YAML::Node& global_node);
+        DedupConfig parseDedup(const YAML::Node& global_node);
+        SpoolConfig parseSpool(const YAML::Node& global_node);
+        DigestConfig parseDigest(const YAML::Node& global_node);
+        ResultArchiveConfig parseResultArchive(const YAML::Node& global_node);
+        ZipConfig parseZip(const YAML::Node& global_node);
+        BundleCacheConfig parseBundleCache(const YAML::Node& global_node);
+        PollScheduleConfig parsePollSchedule(const YAML::Node& node, int interval_ms,
+                                             const PollScheduleConfig& defaults);
+        AttachmentFilterConfig parseAttachmentFilter(const YAML::Node& filter_node);
+        std::shared_ptr<const mail::MailRules> parseMailRules(const YAML::Node& filter_node);
+        ImapIdleConfig parseImapIdle(const YAML::Node& imap_node);
         std::optional<SmtpConfig> parseSmtpConfig(const YAML::Node& smtp_node);
         mailio::mailboxes parseMailboxes(const YAML::Node& mail_node);
         
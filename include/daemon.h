@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
 #include <mutex>
@@ -13,9 +14,14 @@
 
 #include <zmqpp/message.hpp>
 
+#include "config.h"
+#include "imap_idle.h"
 #include "ipc.h"
+#include "mail_digest.h"
+#include "mail_spool.h"
 #include "publisher.h"
 #include "subscriber.h"
+#include "thread_pool.h"
 #include "timer.h"
 #include "mail_to.pb.h"
 
@@ -45,6 +51,20 @@ template <typename Msg> struct ServiceContext : public ServiceContextBase {
       : type(type), publisher(publisher) {}
 };
 
+enum class PollOutcome { HIT, EMPTY, FAILURE };
+
+// Guards one account against overlapping polls and tracks its own interval.
+// next_poll and interval are only written by the worker that holds in_flight.
+struct AccountPollState {
+  std::atomic_bool in_flight;
+  std::chrono::steady_clock::time_point next_poll;
+  std::chrono::milliseconds interval;
+
+  explicit AccountPollState(std::chrono::milliseconds interval)
+      : in_flight(false), next_poll(std::chrono::steady_clock::now()),
+        interval(interval) {}
+};
+
 constexpr char TOPIC_MAIL_RECV[] = "mail_recv";
 constexpr char TOPIC_TASK_RECV[] = "task_recv";
 constexpr char TOPIC_MAIL_SEND[] = "mail_send";
@@ -60,6 +80,10 @@ public:
 private:
   void run();
   void startMailService();
+  PollOutcome pollAccount(const AccountConfig &account);
+  std::chrono::milliseconds nextPollDelay(const PollScheduleConfig &schedule,
+                                          AccountPollState &state,
+                                          PollOutcome outcome);
   void initServices();
   void initSubscribers();
   template <typename Msg> void startPublishService();
@@ -67,9 +91,13 @@ private:
   const std::string getSubscriberEndpoint(const std::string &endpoint);
   void processMail(const std::string &mail_dir);
   void sendMail(const MailTo& info);
+  bool spoolMail(const MailTo& info);
+  std::optional<Error> deliverMail(const MailTo& info);
   template <typename Msg>
   void publish(const Msg &msg, const std::string &topic);
   void processTask(const std::string &task_file);
+  std::vector<std::pair<std::string, std::string>>
+  packOutput(const std::string &output_file);
 
   bool _mail_enabled;
   std::string _endpoint;
@@ -78,7 +106,16 @@ private:
   std::unordered_map<std::string, std::unique_ptr<ServiceContextBase>>
       _services;
   std::unordered_map<std::string, std::unique_ptr<IPC>> _subscribers;
-  std::mutex _mail_checker_mutex;
+  std::unordered_map<std::string, std::unique_ptr<mail::ImapIdleWatcher>>
+      _idle_watchers;
+  std::unordered_map<std::string, std::unique_ptr<AccountPollState>>
+      _poll_states;
+  std::unique_ptr<ThreadPool> _mail_workers;
+  // Every message lives in its own directory, so extraction runs in
+  // parallel. Tasks stay serialized since Runner changes the environment.
+  std::unique_ptr<ThreadPool> _mail_processors;
+  std::unique_ptr<MailSpool> _mail_spool;
+  std::unique_ptr<MailDigest> _mail_digest;
 };
 
 template <typename Msg> void Daemon::startPublishService() {
@@ -117,7 +154,7 @@ template <typename Msg> void Daemon::startSubscribeService() {
     mail_recv_subscriber->subscribe([this](const Msg &msg) {
       if constexpr (std::is_same_v<Msg, std::string>) {
         std::cout << "Mail recv: " << msg << std::endl;
-        processMail(msg);
+        _mail_processors->submit([this, msg]() { processMail(msg); });
       }
     });
   }
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "config.h"
+
+namespace remote_agent {
+
+    // Fixed size in-memory membership filter; false positives are possible,
+    // false negatives are not.
+    class BloomFilter {
+        public:
+            BloomFilter(unsigned long capacity, double false_positive_rate);
+
+            void add(uint64_t key);
+            bool mayContain(uint64_t key) const;
+            void clear();
+
+        private:
+            std::vector<uint64_t> _bits;
+            uint64_t _bit_count;
+            unsigned int _hashes;
+    };
+
+    // Message keys of already processed mails, kept under <work_dir>/.dedup:
+    // index.bin holds records sorted by key, journal.bin the ones added since
+    // the last compaction. Lookups are answered by the Bloom filter and only
+    // touch the disk when it reports a possible hit.
+    class DedupIndex {
+        public:
+            static DedupIndex& getInstance();
+
+            // 64 bit key of the mail stored in mail_dir: its Message-ID, or a
+            // hash of mail.txt when the header is missing.
+            static std::optional<uint64_t> messageKey(const std::string& mail_dir);
+
+            // Claims key for one caller while its mail is processed; false
+            // when it was recorded within the retention window or another
+            // caller holds it. Every true has to be followed by release().
+            bool reserve(uint64_t key);
+            // Drops the claim and records key when the mail was processed,
+            // so a failed one is taken again when it shows up next time.
+            void release(uint64_t key, bool processed);
+            // Records key and returns true, or returns false when it was seen
+            // within the retention window.
+            bool insert(uint64_t key);
+            std::optional<Error> compact();
+
+        private:
+            struct Record {
+                uint64_t key;
+                int64_t seen_at;    // unix time in seconds
+            };
+
+            DedupIndex();
+            ~DedupIndex();
+            DedupIndex(const DedupIndex&) = delete;
+            DedupIndex& operator=(const DedupIndex&) = delete;
+
+            void load();
+            std::optional<Error> compactLocked();
+            std::optional<Record> find(uint64_t key) const;
+            // Both expect _mutex held.
+            bool seen(uint64_t key, std::time_t now) const;
+            void append(uint64_t key, std::time_t now);
+            std::optional<Record> findOnDisk(uint64_t key) const;
+            bool expired(const Record& record, std::time_t now) const;
+            void closeIndex();
+
+            const DedupConfig _config;
+            mutable std::mutex _mutex;
+            std::string _index_path;
+            std::string _journal_path;
+            int _index_fd;
+            uint64_t _index_records;
+            std::unordered_map<uint64_t, int64_t> _journal;
+            std::unordered_set<uint64_t> _reserved;    // keys of mails being processed
+            BloomFilter _filter;
+    };
+};
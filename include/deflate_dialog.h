@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <mailio/dialog.hpp>
+#include <zlib.h>
+
+#include "tls_context.h"
+
+namespace remote_agent::mail {
+
+    // RFC 4978 COMPRESS=DEFLATE: raw deflate in both directions on top of a
+    // plain connection or a TlsDialog. Each sent line is flushed with
+    // Z_SYNC_FLUSH so the server never waits for the rest of a command.
+    class DeflateDialog : public mailio::dialog {
+        public:
+            // Octets before (plain) and after (wire) compression, summed over
+            // every compressed connection of the process.
+            struct Counters {
+                unsigned long long plain_in;
+                unsigned long long wire_in;
+                unsigned long long plain_out;
+                unsigned long long wire_out;
+            };
+
+            // tls is the dialog being replaced when the connection uses TLS.
+            DeflateDialog(const mailio::dialog& other, std::shared_ptr<TlsDialog> tls);
+            // Logs the counters of this connection.
+            ~DeflateDialog() override;
+            DeflateDialog(const DeflateDialog&) = delete;
+            DeflateDialog& operator=(const DeflateDialog&) = delete;
+
+            void send(const std::string& line) override;
+            std::string receive(bool raw = false) override;
+            // Input already read off the socket, compressed or not.
+            bool buffered() const;
+
+            static Counters totals();
+            // Logs totals() when they moved since the last call; pooled
+            // connections may live for the whole process.
+            static void logTotals();
+
+        private:
+            void writeWire(const char* data, std::size_t size);
+            std::size_t readWire(char* data, std::size_t size);
+            void waitReadable();
+            // Inflates wire octets into _plain until it holds a line feed.
+            void fill();
+
+            std::shared_ptr<TlsDialog> _tls;
+            z_stream _deflate;
+            z_stream _inflate;
+            std::vector<char> _in;          // wire octets for _inflate
+            std::vector<char> _out;         // output of _deflate
+            std::string _plain;             // inflated, returned from _pos on
+            std::size_t _pos;
+            bool _inflate_pending;          // last inflate filled its output, more may follow
+            Counters _counters;
+
+            static std::atomic<unsigned long long> _total_plain_in;
+            static std::atomic<unsigned long long> _total_wire_in;
+            static std::atomic<unsigned long long> _total_plain_out;
+            static std::atomic<unsigned long long> _total_wire_out;
+    };
+};
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <filesystem>
 #include <string>
 #include <vector>
 
@@ -16,11 +18,34 @@
 #include "config.h"
 
 namespace remote_agent {
+  // One archive member as listed in the central directory.
+  struct ZipEntry {
+    std::string name;
+    uint64_t size;              // Uncompressed octets
+    uint64_t compressed_size;
+    bool directory;
+  };
+
+  // Entry names come from the sender; false for names that are empty,
+  // absolute or climb out of the destination.
+  bool isSafeEntryName(const std::string& name);
+
+  // True when path, with the symlinks that exist resolved, stays below dir.
+  bool isWithinDirectory(const std::filesystem::path& path, const std::filesystem::path& dir);
+
   class Zip {
     public:
       Zip();
+      explicit Zip(const ZipConfig& config);
       std::optional<Error> compress(const std::vector<std::string>& file_list, const std::string& destination_file);
       std::optional<Error> extract(const std::string& zip_file, const std::string& destination_dir);
+      // Extracts only the named entries below destination_dir.
+      std::optional<Error> extract(const std::string& zip_file, const std::vector<std::string>& entries,
+                                   const std::string& destination_dir);
+      // Lists the central directory, nothing is inflated.
+      std::optional<Error> entries(const std::string& zip_file, std::vector<ZipEntry>& entries);
+      // Inflates a single entry into memory.
+      std::optional<Error> read(const std::string& zip_file, const std::string& entry, std::string& content);
       void setSegmentSize(uint64_t segment_size);
       void enableAppend();
       void disableAppend();
@@ -28,13 +53,52 @@ namespace remote_agent {
       void disableIncludePath();
       void enableRecursive();
       void disableRecursive();
+      // Entries processed in parallel; 1 keeps everything on the calling thread.
+      void setThreads(int threads);
+      // Upper bound of compressed entries a parallel compress buffers.
+      void setMemoryLimit(uint64_t memory_limit);
+      // One of MZ_COMPRESS_METHOD_*, deflate by default. Only deflate is
+      // compressed in parallel, other methods are written by minizip.
+      void setCompressMethod(uint16_t method);
+      // Method specific, e.g. 0-9 for deflate or 1-22 for zstd;
+      // MZ_COMPRESS_LEVEL_DEFAULT leaves it to the method.
+      void setCompressLevel(int16_t level);
+      // MZ_COMPRESS_METHOD_* for "store", "deflate", "bzip2", "lzma", "xz"
+      // or "zstd".
+      static std::optional<uint16_t> compressMethod(const std::string& name);
+      // Files of a split archive in disk order, <name>.z01, <name>.z02, ...
+      // and <name>.zip last; just zip_file when it was not split.
+      static std::vector<std::string> segments(const std::string& zip_file);
+      // Caps of one extract(), 0 = unlimited. The central directory is
+      // checked up front and the inflated data again while it is written;
+      // an extraction going over any of them stops and removes what it wrote.
+      void setMaxExtractBytes(uint64_t max_bytes);
+      void setMaxEntries(uint64_t max_entries);
+      // Inflated to compressed size of an entry; entries up to 1 MiB pass.
+      void setMaxRatio(uint64_t max_ratio);
+      void setExtractTimeout(std::chrono::seconds timeout);
     
     private:
-      
+      std::optional<Error> compressParallel(const std::vector<std::string>& file_list, void *writer);
+      std::optional<Error> checkLimits(const std::string& zip_file, const std::vector<ZipEntry>& entries) const;
+      // Extracts the entries at the given central directory positions,
+      // which have to be ascending, within the limits; on failure the
+      // files it wrote are removed.
+      std::optional<Error> extractPositions(const std::string& zip_file,
+                                            const std::vector<std::pair<std::size_t, std::string>>& entries,
+                                            const std::string& destination_dir);
     
       uint64_t _segment_size;
       uint8_t _append;
       uint8_t _include_path;
       uint8_t _recursive;
+      int _threads;
+      uint64_t _memory_limit;
+      uint16_t _compress_method;
+      int16_t _compress_level;
+      uint64_t _max_extract_bytes;
+      uint64_t _max_entries;
+      uint64_t _max_ratio;
+      std::chrono::seconds _extract_timeout;
   };
 };
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "config.h"
+
+namespace remote_agent::mail {
+
+    // Keeps one authenticated IMAP session per account and runs the fetch
+    // pipeline only when the server pushes EXISTS/RECENT.
+    class ImapIdleWatcher {
+        public:
+            using MailCallback = std::function<void(const std::string& mail_dir)>;
+
+            ImapIdleWatcher(const AccountConfig& config, MailCallback callback);
+            ~ImapIdleWatcher();
+
+            void start();
+            void stop();
+            // True while an IDLE session is established; the poll loop covers
+            // the account otherwise.
+            bool isIdling() const;
+            // False once the server turned out not to advertise IDLE.
+            bool isSupported() const;
+
+        private:
+            void run();
+
+            const AccountConfig& _config;
+            MailCallback _callback;
+            std::atomic_bool _running;
+            std::atomic_bool _idling;
+            std::atomic_bool _supported;
+            std::thread _thread;
+    };
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace remote_agent::mail {
+
+    // One node of an IMAP response: NIL, atom/number, quoted or literal
+    // string, or a parenthesized list.
+    struct ImapValue {
+        enum class Type { NIL, ATOM, STRING, LIST };
+
+        Type type;
+        std::string text;
+        std::vector<ImapValue> items;
+
+        bool isNil() const { return type == Type::NIL; }
+        bool isList() const { return type == Type::LIST; }
+    };
+
+    // Leaf of a BODYSTRUCTURE tree.
+    struct BodyPart {
+        std::string section;        // e.g. "2" or "1.3", usable in BODY[<section>]
+        std::string type;           // lower case media type
+        std::string subtype;        // lower case media subtype
+        std::string encoding;       // lower case content transfer encoding
+        std::string disposition;    // lower case, empty when not given
+        std::string filename;       // disposition filename or type name parameter, RFC 2047 decoded
+        unsigned long size;         // encoded size in octets
+    };
+
+    ImapValue parseImapValue(const std::string& data, std::size_t& pos);
+    // Maps the upper-cased item names of a `* n FETCH (...)` line to their values.
+    std::map<std::string, ImapValue> parseFetchResponse(const std::string& response);
+    std::vector<BodyPart> parseBodyStructure(const ImapValue& body);
+};
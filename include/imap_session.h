@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <set>
+#include <sstream>
+#include <string>
+#include <poll.h>
+
+#include <mailio/imap.hpp>
+
+#include "deflate_dialog.h"
+#include "tls_context.h"
+
+namespace remote_agent::mail {
+
+    enum class IdleEvent {
+        NEW_MAIL,   // server reported EXISTS/RECENT
+        REFRESH,    // refresh interval elapsed, IDLE has to be re-issued
+        STOPPED     // caller asked to stop waiting
+    };
+
+    // Protocol extensions on top of an authenticated mailio IMAP connection.
+    class ImapSession {
+        public:
+            virtual ~ImapSession() = default;
+
+            virtual mailio::imap& connection() = 0;
+            virtual const std::set<std::string>& capabilities() = 0;
+            virtual bool hasCapability(const std::string& capability) = 0;
+            virtual void noop() = 0;
+            // RFC 4978 COMPRESS=DEFLATE once authenticated; false when the
+            // server or the transport does not support it.
+            virtual bool compress() = 0;
+            // `UID FETCH <uid_set> <items>`; returns the untagged FETCH responses
+            // with literals inlined as `{n}\r\n<n octets>`.
+            virtual std::list<std::string> uidFetch(const std::string& uid_set, const std::string& items) = 0;
+            // Same as above, but hands every response over as soon as it has been read.
+            virtual void uidFetch(const std::string& uid_set, const std::string& items,
+                                  const std::function<void(std::string&&)>& on_response) = 0;
+            // Hands literal octets to on_literal piece by piece as they are read
+            // instead of inlining them, for messages too large to hold in
+            // memory; in the response passed to on_response afterwards every
+            // literal reads "".
+            virtual void uidFetch(const std::string& uid_set, const std::string& items,
+                                  const std::function<void(const char*, std::size_t)>& on_literal,
+                                  const std::function<void(std::string&&)>& on_response) = 0;
+            virtual void markSeen(const std::string& uid_set) = 0;
+            virtual IdleEvent idle(std::chrono::seconds refresh, const std::atomic_bool& running) = 0;
+    };
+
+    // Base is either mailio::imap or mailio::imaps; both keep the dialog and
+    // the tag counter protected, which is what the raw commands below need.
+    template <typename Base> class ImapClient : public Base, public ImapSession {
+        public:
+            ImapClient(const std::string& hostname, unsigned port, std::chrono::milliseconds timeout)
+                : Base(hostname, port, timeout), _capabilities_loaded{false} {}
+
+            mailio::imap& connection() override {
+                return *this;
+            }
+
+            // Implicit TLS on a fresh connection; authenticate() follows as on
+            // a plain one and reads the greeting through TLS.
+            void secure(std::shared_ptr<TlsContext> context) {
+                this->dialog_ = std::make_shared<TlsDialog>(*this->dialog_, std::move(context));
+            }
+
+            // RFC 3501 STARTTLS on a fresh connection, login() has to follow.
+            void startTls(std::shared_ptr<TlsContext> context) {
+                std::string greeting = receiveLine();
+                if (toUpper(greeting).rfind("* OK", 0) != 0)
+                    throw mailio::imap_error("Connection to server failure.", greeting);
+                command("STARTTLS");
+                secure(std::move(context));
+                _capabilities_loaded = false;
+            }
+
+            void login(const std::string& username, const std::string& password) {
+                command("LOGIN " + quoted(username) + " " + quoted(password));
+                // servers announce more extensions once authenticated
+                _capabilities.clear();
+                _capabilities_loaded = false;
+            }
+
+            const std::set<std::string>& capabilities() override {
+                if (_capabilities_loaded)
+                    return _capabilities;
+                for (const auto& line : command("CAPABILITY")) {
+                    std::string upper = toUpper(line);
+                    if (upper.rfind("* CAPABILITY ", 0) != 0)
+                        continue;
+                    std::istringstream tokens(upper.substr(13));
+                    std::string token;
+                    while (tokens >> token)
+                        _capabilities.insert(token);
+                }
+                _capabilities_loaded = true;
+                return _capabilities;
+            }
+
+            bool hasCapability(const std::string& capability) override {
+                const auto& caps = capabilities();
+                return caps.find(toUpper(capability)) != caps.end();
+            }
+
+            void noop() override {
+                command("NOOP");
+            }
+
+            bool compress() override {
+                if (!hasCapability("COMPRESS=DEFLATE"))
+                    return false;
+                // mailio's own TLS dialog keeps its stream private
+                auto tls = std::dynamic_pointer_cast<TlsDialog>(this->dialog_);
+                if (!tls && dynamic_cast<mailio::dialog_ssl*>(this->dialog_.get()) != nullptr)
+                    return false;
+                command("COMPRESS DEFLATE");
+                this->dialog_ = std::make_shared<DeflateDialog>(*this->dialog_, std::move(tls));
+                return true;
+            }
+
+            std::list<std::string> uidFetch(const std::string& uid_set, const std::string& items) override {
+                std::list<std::string> responses;
+                uidFetch(uid_set, items, [&responses](std::string&& response) {
+                    responses.push_back(std::move(response));
+                });
+                return responses;
+            }
+
+            void uidFetch(const std::string& uid_set, const std::string& items,
+                          const std::function<void(std::string&&)>& on_response) override {
+                command("UID FETCH " + uid_set + " " + items, [&on_response](std::string&& line) {
+                    if (line.rfind("* ", 0) == 0 && toUpper(line.substr(0, 64)).find(" FETCH ") != std::string::npos)
+                        on_response(std::move(line));
+                });
+            }
+
+            void uidFetch(const std::string& uid_set, const std::string& items,
+                          const std::function<void(const char*, std::size_t)>& on_literal,
+                          const std::function<void(std::string&&)>& on_response) override {
+                command("UID FETCH " + uid_set + " " + items, [&on_response](std::string&& line) {
+                    if (line.rfind("* ", 0) == 0 && toUpper(line.substr(0, 64)).find(" FETCH ") != std::string::npos)
+                        on_response(std::move(line));
+                }, &on_literal);
+            }
+
+            void markSeen(const std::string& uid_set) override {
+                command("UID STORE " + uid_set + " +FLAGS.SILENT (\\Seen)");
+            }
+
+            // RFC 2177: wait for untagged EXISTS/RECENT on the selected folder.
+            // Between lines the socket is polled in short steps, so `refresh`
+            // and `running` are honoured even when the server stays silent.
+            IdleEvent idle(std::chrono::seconds refresh, const std::atomic_bool& running) override {
+                this->dialog_->send(this->format("IDLE"));
+                const std::string tag = std::to_string(this->tag_);
+                std::string line = this->dialog_->receive();
+                if (line.empty() || line[0] != '+')
+                    throw mailio::imap_error("IDLE rejection.", line);
+
+                const auto deadline = std::chrono::steady_clock::now() + refresh;
+                IdleEvent event = IdleEvent::REFRESH;
+                while (true) {
+                    if (!running) {
+                        event = IdleEvent::STOPPED;
+                        break;
+                    }
+                    auto now = std::chrono::steady_clock::now();
+                    if (now >= deadline)
+                        break;
+                    auto wait = std::min(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now),
+                                         IDLE_STOP_CHECK);
+                    if (!DialogState::readable(*this->dialog_, wait))
+                        continue;
+                    line = toUpper(this->dialog_->receive());
+                    if (line.rfind("* ", 0) == 0 &&
+                        (line.find(" EXISTS") != std::string::npos || line.find(" RECENT") != std::string::npos)) {
+                        event = IdleEvent::NEW_MAIL;
+                        break;
+                    }
+                    if (line.rfind("* BYE", 0) == 0)
+                        throw mailio::imap_error("Network connection closed by server.", line);
+                }
+
+                this->dialog_->send("DONE");
+                while (true) {
+                    line = this->dialog_->receive();
+                    if (isTagged(line, tag)) {
+                        checkTagged(line, tag, "IDLE");
+                        break;
+                    }
+                }
+                return event;
+            }
+
+        protected:
+            // Sends a tagged command and returns the untagged lines up to the
+            // tagged completion, which has to be OK.
+            std::list<std::string> command(const std::string& cmd) {
+                std::list<std::string> untagged;
+                command(cmd, [&untagged](std::string&& line) {
+                    untagged.push_back(std::move(line));
+                });
+                return untagged;
+            }
+
+            void command(const std::string& cmd, const std::function<void(std::string&&)>& on_untagged,
+                         const std::function<void(const char*, std::size_t)>* on_literal = nullptr) {
+                this->dialog_->send(this->format(cmd));
+                const std::string tag = std::to_string(this->tag_);
+                while (true) {
+                    std::string line = receiveResponse(on_literal);
+                    if (isTagged(line, tag)) {
+                        checkTagged(line, tag, cmd.substr(0, cmd.find(' ')));
+                        break;
+                    }
+                    on_untagged(std::move(line));
+                }
+            }
+
+            // Reads one response; a line ending in `{n}` announces n octets of
+            // literal data after which the response continues. With on_literal
+            // the literal data is streamed to it and replaced by "".
+            std::string receiveResponse(const std::function<void(const char*, std::size_t)>* on_literal = nullptr) {
+                std::string response;
+                std::string line = receiveLine();
+                while (true) {
+                    response += line;
+                    std::size_t size = 0;
+                    if (!literalSize(line, size))
+                        break;
+                    if (on_literal != nullptr) {
+                        response.erase(response.size() - (line.size() - line.rfind('{')));
+                        response += "\"\"";
+                        line = streamLiteral(size, *on_literal);
+                    } else {
+                        response += "\r\n";
+                        std::string literal;
+                        while (literal.size() < size)
+                            literal += this->dialog_->receive(true) + "\n";
+                        response.append(literal, 0, size);
+                        line = literal.substr(size);
+                    }
+                    trimEol(line);
+                    if (line.empty())
+                        line = receiveLine();
+                }
+                return response;
+            }
+
+            // Passes size octets on as they are read, one line at a time, and
+            // returns what follows them on the last line.
+            std::string streamLiteral(std::size_t size, const std::function<void(const char*, std::size_t)>& on_literal) {
+                while (true) {
+                    std::string data = this->dialog_->receive(true) + "\n";
+                    if (data.size() >= size) {
+                        on_literal(data.data(), size);
+                        return data.substr(size);
+                    }
+                    on_literal(data.data(), data.size());
+                    size -= data.size();
+                }
+            }
+
+            std::string receiveLine() {
+                std::string line = this->dialog_->receive(true);
+                trimEol(line);
+                return line;
+            }
+
+            static void trimEol(std::string& line) {
+                while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+                    line.pop_back();
+            }
+
+            static bool literalSize(const std::string& line, std::size_t& size) {
+                if (line.empty() || line.back() != '}')
+                    return false;
+                auto open = line.rfind('{');
+                if (open == std::string::npos || open + 2 > line.size() - 1)
+                    return false;
+                std::string digits = line.substr(open + 1, line.size() - open - 2);
+                if (digits.empty() || !std::all_of(digits.begin(), digits.end(), [](unsigned char c) { return std::isdigit(c); }))
+                    return false;
+                size = std::stoul(digits);
+                return true;
+            }
+
+            static std::string toUpper(std::string str) {
+                std::transform(str.begin(), str.end(), str.begin(),
+                               [](unsigned char c) { return std::toupper(c); });
+                return str;
+            }
+
+            static std::string quoted(const std::string& str) {
+                std::string result = "\"";
+                for (char c : str) {
+                    if (c == '"' || c == '\\')
+                        result += '\\';
+                    result += c;
+                }
+                return result + "\"";
+            }
+
+            static bool isTagged(const std::string& line, const std::string& tag) {
+                return line.rfind(tag + " ", 0) == 0;
+            }
+
+            static void checkTagged(const std::string& line, const std::string& tag, const std::string& name) {
+                std::string status = toUpper(line.substr(tag.size() + 1, 2));
+                if (status != "OK")
+                    throw mailio::imap_error(name + " rejection.", line);
+            }
+
+        private:
+            // How often a silent IDLE looks at `running`.
+            static constexpr std::chrono::milliseconds IDLE_STOP_CHECK{1000};
+
+            // mailio keeps the socket and its line buffer protected; they are
+            // reached through member pointers of this never constructed type.
+            struct DialogState : mailio::dialog {
+                // False when nothing arrived within wait; errors and hangups
+                // count as readable and are left to receive() to report.
+                static bool readable(mailio::dialog& dialog, std::chrono::milliseconds wait) {
+                    const auto& buffer = dialog.*(&DialogState::strmbuf_);
+                    if (buffer && buffer->size() > 0)
+                        return true;
+                    if (auto deflate = dynamic_cast<DeflateDialog*>(&dialog)) {
+                        if (deflate->buffered())
+                            return true;
+                    } else if (auto tls = dynamic_cast<TlsDialog*>(&dialog)) {
+                        if (tls->pending())
+                            return true;
+                    }
+                    // mailio's own dialog_ssl keeps its engine private, a
+                    // record it already holds waits for the next one or refresh
+                    pollfd fd{(dialog.*(&DialogState::socket_))->native_handle(), POLLIN, 0};
+                    int rc = ::poll(&fd, 1, static_cast<int>(wait.count()));
+                    return rc > 0 || (rc < 0 && errno != EINTR);
+                }
+            };
+
+            std::set<std::string> _capabilities;
+            bool _capabilities_loaded;
+    };
+};
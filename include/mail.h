@@ -3,7 +3,13 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <memory>
 #include <optional>
+#include <map>
+#include <ostream>
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <tuple>
 #include <variant>
 
@@ -14,6 +20,9 @@
 #include <mailio/imap.hpp>
 
 #include "config.h"
+#include "imap_parser.h"
+#include "imap_session.h"
+#include "smtp_session.h"
 
 namespace remote_agent::mail {
 
@@ -54,19 +63,42 @@ namespace remote_agent::mail {
             std::optional<Error> send(const Recipient& recipient, const std::string& subject, const std::string& body, 
               const std::list<File>& file_list);
             std::optional<Error> send(const std::string& subject, const std::string& body, const std::list<File>& file_list);
+            // MIME encodes body and attachments once into destination, so the
+            // same content can go out through several accounts via sendContent.
+            std::optional<Error> encodeContent(const std::string& body, const std::list<File>& file_list,
+              const std::string& destination);
+            std::optional<Error> sendContent(const std::string& subject, const std::string& content_file);
             std::pair<uint32_t,std::optional<Error>> count(const std::string& folder);
-            std::pair<std::string,std::optional<Error>> getByFilter();            
+            // Returns one directory per stored message, also when an error
+            // interrupted the poll half way.
+            std::pair<std::vector<std::string>,std::optional<Error>> getByFilter();
+            std::pair<std::vector<std::string>,std::optional<Error>> getByFilter(ImapSession& session);
+            std::pair<std::unique_ptr<ImapSession>,std::optional<Error>> openImap(std::chrono::milliseconds timeout);
+            std::pair<std::unique_ptr<SmtpSession>,std::optional<Error>> openSmtp(std::chrono::milliseconds timeout);
 
         private:
             mailio::message prepareMessage(const Recipient& recipient, const std::string& subject, const std::string& body);
             mailio::message prepareMessage(const std::string& subject, const std::string& body);
-            std::list<std::tuple<std::shared_ptr<std::istream>, mailio::string_t, mailio::mime::content_type_t>> 
-              prepareAttachment(const std::list<File>& file_list);
+            // MIME content: MIME-Version and Content-* headers, blank line and
+            // body, encoded with codec rather than mailio.
+            void writeContent(std::ostream& out, const std::string& body, const std::list<File>& file_list);
+            void prepareAttachment(std::ostream& out, const std::list<File>& file_list, const std::string& boundary);
             Error parseError(const std::string& error);
-            std::optional<Error> send(const mailio::message& msg);
-            std::pair<std::string,std::optional<Error>> getByFilter(mailio::imap& conn);
+            std::optional<Error> send(const mailio::message& envelope, const std::string& body,
+              const std::list<File>& file_list);
+            std::optional<Error> send(const mailio::message& envelope, const std::string& headers, std::istream& content);
+            std::optional<Error> submit(const std::function<std::string(SmtpSession&)>& submission);
             std::optional<Error> authenticate(const Protocol& protocol);
-            std::string generateTempFilename();
+            std::list<unsigned long> matchRules(ImapSession& session, const std::list<unsigned long>& uids);
+            std::map<unsigned long, std::string> fetchBatch(ImapSession& session, const std::vector<unsigned long>& uids,
+              const std::string& work_dir);
+            std::string messageDirectory(const std::string& work_dir, unsigned long uid);
+            static std::string uidSet(const std::vector<unsigned long>& uids);
+            void fetchSelective(ImapSession& session, unsigned long uid, const std::string& work_dir);
+            bool isWantedPart(const BodyPart& part) const;
+            std::filesystem::path partialPath(const std::string& work_dir, std::size_t index);
+            void publishAttachment(const std::filesystem::path& partial, const std::string& name,
+              const std::string& work_dir, std::size_t index);
             std::string getCurrentTimeDirectoryName();
 
             const AccountConfig& _config;
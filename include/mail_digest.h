@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "mail_to.pb.h"
+#include "timer.h"
+
+namespace remote_agent {
+
+    // Collects task result mails per target account and turns each batch
+    // into one digest: a summary body plus a zip of all attachments. A batch
+    // is sent window_sec after its first result or once it holds
+    // max_results results. Every result waiting in a batch is kept under
+    // <work_dir>/.digest/open with its own copy of its files until the
+    // spool has taken the mail carrying it, and is batched again on start.
+    class MailDigest {
+        public:
+            // Returns false when the mail could not be queued for sending.
+            using Emit = std::function<bool(const MailTo&)>;
+
+            MailDigest(const DigestConfig& config, const std::string& work_dir, Emit emit);
+            ~MailDigest();
+            MailDigest(const MailDigest&) = delete;
+            MailDigest& operator=(const MailDigest&) = delete;
+
+            void add(const MailTo& result);
+            // Sends every open batch, e.g. before shutdown.
+            void flushAll();
+            void stop();
+
+        private:
+            struct Batch {
+                std::vector<MailTo> results;
+                std::vector<std::string> stored;  // open/<id> of each result
+                std::chrono::steady_clock::time_point deadline;
+            };
+
+            void load();
+            bool store(MailTo& result, std::string& stored);
+            void push(const std::string& account, MailTo result, const std::string& stored,
+                      std::chrono::steady_clock::time_point deadline);
+            void tick();
+            void flush(const std::string& account, Batch batch);
+
+            const DigestConfig _config;
+            const std::string _digest_dir;
+            Emit _emit;
+            std::mutex _mutex;
+            std::map<std::string, Batch> _batches;  // empty key: all accounts
+            std::atomic<uint64_t> _sequence;
+            Timer _timer;
+    };
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <list>
+#include <optional>
+#include <regex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace remote_agent::mail {
+
+    // Local filter evaluated on the header of a message before its body is
+    // downloaded. Built once when the configuration is loaded; every
+    // criterion that is given has to match.
+    class MailRules {
+        public:
+            struct Spec {
+                std::string subject;            // ECMAScript regex, case insensitive, searched in the decoded subject
+                std::list<std::string> senders; // Addresses, or whole domains as "@example.com"
+                std::list<std::string> headers; // Field names that have to be present
+            };
+
+            explicit MailRules(const Spec& spec);
+
+            // header is the raw header block as returned by BODY[HEADER].
+            bool matches(const std::string& header) const;
+
+        private:
+            bool senderAllowed(const std::string& from) const;
+
+            bool _valid;                    // false when the spec did not compile
+            std::optional<std::regex> _subject;
+            std::unordered_set<std::string> _addresses;
+            std::unordered_set<std::string> _domains;
+            std::vector<std::string> _headers;  // lower case
+    };
+};
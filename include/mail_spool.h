@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "mail_to.pb.h"
+
+namespace remote_agent {
+
+    // Outgoing MailTo messages kept on disk until they are delivered, under
+    // <work_dir>/.spool:
+    //   segments/<n>.seg  append-only, length prefixed MailTo payloads
+    //   index.log         append-only job records, the last one per id wins
+    //   files/<id>/       copies of the attachments of job <id>
+    // Jobs survive restarts; the index is compacted at startup, whenever the
+    // spool runs empty and once superseded records outnumber the live ones.
+    class MailSpool {
+        public:
+            // Delivers one MailTo whose account_name is set. REJECTION (a 5xx
+            // reply to the mail itself) and BAD_CONFIG errors are final, the
+            // mail is not retried.
+            using Sender = std::function<std::optional<Error>(const MailTo&)>;
+
+            MailSpool(const SpoolConfig& config, const std::string& work_dir);
+            ~MailSpool();
+            MailSpool(const MailSpool&) = delete;
+            MailSpool& operator=(const MailSpool&) = delete;
+
+            // Stores mail and its attachments; account_name has to be set.
+            // On success the spool holds its own links or copies of every
+            // file, so the caller may remove the originals; on error nothing
+            // is queued.
+            std::optional<Error> enqueue(const MailTo& mail);
+            void start(Sender sender);
+            void stop();
+            std::size_t pending() const;
+
+        private:
+            enum class JobState : uint32_t { PENDING = 0, DONE = 1, FAILED = 2 };
+
+            struct IndexRecord {
+                uint64_t id;
+                uint64_t segment;
+                uint64_t offset;        // payload position in the segment
+                uint32_t size;
+                uint32_t attempts;
+                int64_t next_attempt;   // unix time in seconds
+                uint32_t state;
+                uint32_t reserved;
+            };
+
+            struct Job {
+                IndexRecord record;
+                std::string account;
+                bool in_flight;
+            };
+
+            void load();
+            void work();
+            void finish(Job& job, const std::optional<Error>& err, bool permanent);
+            static bool isPermanent(const Error& err);
+            std::optional<MailTo> readPayload(const IndexRecord& record) const;
+            std::optional<Error> appendIndex(const IndexRecord& record);
+            std::optional<Error> openSegment(uint64_t segment);
+            std::optional<Error> compact();
+            std::string segmentPath(uint64_t segment) const;
+            std::string filesPath(uint64_t id) const;
+            std::time_t retryDelay(uint32_t attempts) const;
+
+            const SpoolConfig _config;
+            const std::string _spool_dir;
+            Sender _sender;
+            mutable std::mutex _mutex;
+            std::condition_variable _cv;
+            std::atomic_bool _running;
+            std::vector<std::thread> _workers;
+            std::map<uint64_t, Job> _jobs;
+            std::map<std::string, int> _in_flight;
+            uint64_t _next_id;
+            uint64_t _segment;
+            uint64_t _segment_offset;
+            uint64_t _dead_records;     // index.log records superseded since the last compaction
+            int _segment_fd;
+            int _index_fd;
+    };
+};
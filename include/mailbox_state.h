@@ -0,0 +1,53 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "config.h"
+
+namespace remote_agent::mail {
+
+    struct SyncState {
+        unsigned long uid_validity;
+        unsigned long last_uid;     // highest UID already handed to the pipeline
+    };
+
+    // UID high-water marks per folder of one account, persisted under
+    // <work_dir>/.sync/<account>.yaml so restarts resume where they stopped.
+    // The file is read once per process, polls use the instance in memory.
+    class MailboxState {
+        public:
+            static std::shared_ptr<MailboxState> forAccount(const std::string& account);
+
+            MailboxState(const std::string& account);
+
+            std::optional<SyncState> get(const std::string& folder) const;
+            std::optional<Error> update(const std::string& folder, const SyncState& state);
+            // Counts a failed fetch of uid and returns how many polls in a
+            // row it failed; kept in memory only.
+            unsigned int fetchFailed(const std::string& folder, unsigned long uid);
+            // UIDs above last_uid that were handed to the pipeline already,
+            // behind one that failed; update() forgets those it passes.
+            std::set<unsigned long> delivered(const std::string& folder) const;
+            void markDelivered(const std::string& folder, unsigned long uid);
+            // Held for a whole fetch of the account, whoever starts it.
+            std::mutex& fetchMutex();
+
+        private:
+            void load();
+            std::optional<Error> save();
+
+            static std::mutex _file_mutex;
+            mutable std::mutex _mutex;
+            std::mutex _fetch_mutex;
+            std::string _path;
+            std::map<std::string, SyncState> _folders;
+            std::map<std::string, std::pair<unsigned long, unsigned int>> _failures;   // UID and count per folder
+            std::map<std::string, std::set<unsigned long>> _delivered;
+    };
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+
+namespace remote_agent::mail {
+
+    // Incremental MIME parser for messages that arrive in chunks. The raw
+    // message is written to <mail_dir>/mail.txt and every attachment is
+    // decoded into its own file while the message is still being received,
+    // so memory use is bounded by the line length, not the message size.
+    class MimeStream {
+        public:
+            // Where attachment `index` (1-based) is written until it is complete.
+            using PartialPath = std::function<std::filesystem::path(std::size_t index)>;
+            // Moves a complete attachment to its final name.
+            using Publish = std::function<void(const std::filesystem::path& partial, const std::string& name,
+                                               std::size_t index)>;
+
+            MimeStream(const std::string& mail_dir, PartialPath partial_path, Publish publish);
+            // Removes the partial file of an unfinished attachment.
+            ~MimeStream();
+            MimeStream(const MimeStream&) = delete;
+            MimeStream& operator=(const MimeStream&) = delete;
+
+            void write(const char* data, std::size_t size);
+            // Ends the last part, call once at the end of the message; false
+            // when mail.txt could not be written.
+            bool finish();
+
+        private:
+            enum class State { HEADER, BODY, SKIP };
+
+            struct Entity {
+                std::string type;           // lower case, e.g. "multipart/mixed"
+                std::string encoding;       // lower case content transfer encoding
+                std::string disposition;    // lower case, empty when not given
+                std::string filename;
+                std::string boundary;
+            };
+
+            void line(const std::string& content, const std::string& eol, bool complete);
+            bool boundaryLine(const std::string& content);
+            void headerLine(const std::string& content);
+            void beginBody();
+            void bodyData(const std::string& content, const std::string& eol);
+            void endPart();
+            void emit(const std::string& data);
+
+            static constexpr std::size_t MAX_LINE = 64 * 1024;
+            static constexpr std::size_t MAX_HEADER = 64 * 1024;
+
+            PartialPath _partial_path;
+            Publish _publish;
+            std::ofstream _raw;
+            std::string _line;
+            bool _continued;                // _line does not start at a line start
+            State _state;
+            std::vector<std::string> _boundaries;   // innermost last
+            std::vector<std::string> _fields;       // Content-* fields of the current header
+            bool _keep_field;
+            Entity _entity;
+            std::size_t _index;
+            std::filesystem::path _partial;
+            std::ofstream _out;
+            codec::Base64Decoder _base64;
+            std::string _pending_eol;       // belongs to the part unless a boundary follows
+    };
+};
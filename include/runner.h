@@ -1,6 +1,7 @@
 #pragma once
 
 #include <boost/process/v1/detail/child_decl.hpp>
+#include <functional>
 #include <string>
 #include <tuple>
 #include <boost/process.hpp>
@@ -19,6 +20,8 @@ public:
   CommandResult execute(const std::string &command);
   int execute(const Task &task, std::optional<std::string> error);
   void setShell(Shell shell);
+  // Runs before every step of execute(task, ...); false fails the task.
+  void setBeforeStep(std::function<bool(const Step &)> before_step);
   std::string getOutputfile();
   Task parseTasks(const std::string &yaml_file);
 
@@ -32,5 +35,6 @@ private:
   Shell _shell;
   std::string _task_name;
   std::string _output_file;
+  std::function<bool(const Step &)> _before_step;
 };
 } // namespace remote_agent
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "config.h"
+#include "imap_session.h"
+#include "smtp_session.h"
+#include "timer.h"
+
+namespace remote_agent::mail {
+
+    // Borrowed session; goes back to the pool when the lease is destroyed
+    // unless it was invalidated after a protocol or network failure.
+    template <typename Session> class SessionLease {
+        public:
+            using Release = std::function<void(std::unique_ptr<Session>, bool)>;
+
+            SessionLease() : _healthy{false} {}
+            SessionLease(std::unique_ptr<Session> session, Release release)
+                : _session{std::move(session)}, _release{std::move(release)}, _healthy{true} {}
+            SessionLease(const SessionLease&) = delete;
+            SessionLease& operator=(const SessionLease&) = delete;
+            SessionLease(SessionLease&& other) noexcept
+                : _session{std::move(other._session)}, _release{std::move(other._release)}, _healthy{other._healthy} {}
+            SessionLease& operator=(SessionLease&& other) noexcept {
+                if (this != &other) {
+                    giveBack();
+                    _session = std::move(other._session);
+                    _release = std::move(other._release);
+                    _healthy = other._healthy;
+                }
+                return *this;
+            }
+            ~SessionLease() {
+                giveBack();
+            }
+
+            Session* operator->() const {
+                return _session.get();
+            }
+            Session& operator*() const {
+                return *_session;
+            }
+            explicit operator bool() const {
+                return static_cast<bool>(_session);
+            }
+            void invalidate() {
+                _healthy = false;
+            }
+
+        private:
+            void giveBack() {
+                if (_session && _release)
+                    _release(std::move(_session), _healthy);
+                _session.reset();
+            }
+
+            std::unique_ptr<Session> _session;
+            Release _release;
+            bool _healthy;
+    };
+
+    using ImapLease = SessionLease<ImapSession>;
+    using SmtpLease = SessionLease<SmtpSession>;
+
+    // Authenticated IMAP/SMTP sessions kept alive per AccountConfig::name.
+    class SessionPool {
+        public:
+            static SessionPool& getInstance();
+
+            std::pair<ImapLease,std::optional<Error>> borrowImap(const AccountConfig& config);
+            std::pair<SmtpLease,std::optional<Error>> borrowSmtp(const AccountConfig& config);
+
+        private:
+            template <typename Session> struct IdleSession {
+                std::unique_ptr<Session> session;
+                std::chrono::steady_clock::time_point last_used;
+                std::chrono::steady_clock::time_point last_checked;
+            };
+
+            template <typename Session> struct Slot {
+                std::list<IdleSession<Session>> idle;
+                std::size_t in_use = 0;
+            };
+
+            template <typename Session> using Slots = std::unordered_map<std::string, Slot<Session>>;
+
+            SessionPool();
+            ~SessionPool();
+            SessionPool(const SessionPool&) = delete;
+            SessionPool& operator=(const SessionPool&) = delete;
+
+            template <typename Session, typename Open>
+            std::pair<SessionLease<Session>,std::optional<Error>> borrow(Slots<Session>& slots, const std::string& account,
+              Open open);
+            template <typename Session>
+            void giveBack(Slots<Session>& slots, const std::string& account, std::unique_ptr<Session> session,
+              bool healthy);
+            template <typename Session>
+            void maintain(Slots<Session>& slots);
+            void maintain();
+
+            const SessionPoolConfig _pool_config;
+            std::chrono::milliseconds _timeout;
+            std::mutex _mutex;
+            std::condition_variable _cv;   // waiters of every slot, always notify_all
+            Slots<ImapSession> _imap;
+            Slots<SmtpSession> _smtp;
+            Timer _maintenance_timer;
+    };
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <istream>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <mailio/message.hpp>
+#include <mailio/smtp.hpp>
+
+#include "codec.h"
+#include "tls_context.h"
+
+namespace remote_agent::mail {
+
+    // Protocol extensions on top of an authenticated mailio SMTP connection.
+    class SmtpSession {
+        public:
+            virtual ~SmtpSession() = default;
+
+            virtual mailio::smtp& connection() = 0;
+            // EHLO keywords in upper case, e.g. "PIPELINING", "CHUNKING".
+            virtual const std::set<std::string>& extensions() = 0;
+            virtual bool hasExtension(const std::string& name) = 0;
+            virtual void noop() = 0;
+            virtual void reset() = 0;
+            // Submits msg on the open session; uses PIPELINING and CHUNKING
+            // when the server offers them.
+            virtual std::string submit(const mailio::message& msg) = 0;
+            // Same for an already formatted message, its headers followed by
+            // content: sender and recipients come from envelope, the octets
+            // are sent as they are read, never more than one chunk in memory.
+            virtual std::string submit(const mailio::message& envelope, const std::string& headers,
+                                       std::istream& content) = 0;
+    };
+
+    // Base is either mailio::smtp or mailio::smtps.
+    template <typename Base> class SmtpClient : public Base, public SmtpSession {
+        public:
+            SmtpClient(const std::string& hostname, unsigned port, std::chrono::milliseconds timeout)
+                : Base(hostname, port, timeout) {}
+
+            mailio::smtp& connection() override {
+                return *this;
+            }
+
+            // Implicit TLS on a fresh connection; authenticate() follows as on
+            // a plain one and reads the greeting through TLS.
+            void secure(std::shared_ptr<TlsContext> context) {
+                this->dialog_ = std::make_shared<TlsDialog>(*this->dialog_, std::move(context));
+            }
+
+            // RFC 3207 STARTTLS on a fresh connection, login() has to follow.
+            void startTls(std::shared_ptr<TlsContext> context) {
+                reply("Connection", 220);
+                replyLines("EHLO " + this->src_host_, 250);
+                command("STARTTLS", 220);
+                secure(std::move(context));
+                _extensions_loaded = false;
+            }
+
+            // EHLO again after STARTTLS, then AUTH LOGIN unless auth is false.
+            void login(const std::string& username, const std::string& password, bool auth) {
+                extensions();
+                if (!auth)
+                    return;
+                command("AUTH LOGIN", 334);
+                // credentials must not end up in the rejection message
+                this->dialog_->send(codec::encodeBase64(username));
+                reply("AUTH", 334);
+                this->dialog_->send(codec::encodeBase64(password));
+                reply("AUTH", 235);
+            }
+
+            const std::set<std::string>& extensions() override {
+                if (!_extensions_loaded) {
+                    // mailio keeps the EHLO reply of authenticate() to itself;
+                    // asking again is allowed and only costs one round trip
+                    // per pooled session.
+                    auto lines = replyLines("EHLO " + this->src_host_, 250);
+                    _extensions.clear();
+                    for (std::size_t i = 1; i < lines.size(); i++) {
+                        std::string keyword = lines[i].substr(4, lines[i].find(' ', 4) - 4);
+                        std::transform(keyword.begin(), keyword.end(), keyword.begin(),
+                                       [](unsigned char c) { return std::toupper(c); });
+                        _extensions.insert(keyword);
+                    }
+                    _extensions_loaded = true;
+                }
+                return _extensions;
+            }
+
+            bool hasExtension(const std::string& name) override {
+                return extensions().count(name) > 0;
+            }
+
+            void noop() override {
+                command("NOOP", 250);
+            }
+
+            // Aborts any half-finished transaction left over by a failed submit.
+            void reset() override {
+                command("RSET", 250);
+            }
+
+            std::string submit(const mailio::message& msg) override {
+                if (!hasExtension("PIPELINING") && !hasExtension("CHUNKING"))
+                    return Base::submit(msg);
+                std::string data;
+                msg.format(data);
+                std::istringstream none;
+                return submit(msg, data, none);
+            }
+
+            std::string submit(const mailio::message& envelope, const std::string& headers,
+                               std::istream& content) override {
+                const bool pipelining = hasExtension("PIPELINING");
+                const bool chunking = hasExtension("CHUNKING");
+                MessageReader reader(headers, content);
+
+                std::string mail_from = envelope.sender().address.empty() ? envelope.from().addresses.at(0).address
+                                                                          : envelope.sender().address;
+                std::string mail_cmd = "MAIL FROM: <" + mail_from + ">";
+                auto size = reader.size();
+                if (hasExtension("SIZE") && size.has_value())
+                    mail_cmd += " SIZE=" + std::to_string(size.value());
+                std::vector<std::string> recipients = envelopeRecipients(envelope);
+                if (recipients.empty())
+                    throw mailio::smtp_error("No recipients rejection.", "");
+                if (pipelining) {
+                    // MAIL and all RCPT commands go out in one write, their
+                    // replies are read in order afterwards (RFC 2920)
+                    std::string batch = mail_cmd;
+                    for (const auto& rcpt : recipients)
+                        batch += "\r\nRCPT TO: <" + rcpt + ">";
+                    if (!chunking)
+                        batch += "\r\nDATA";
+                    this->dialog_->send(batch);
+                    reply("MAIL", 250);
+                } else {
+                    command(mail_cmd, 250);
+                }
+                for (const auto& rcpt : recipients) {
+                    if (!pipelining)
+                        this->dialog_->send("RCPT TO: <" + rcpt + ">");
+                    auto [status, line] = readReply();
+                    if (status != 250 && status != 251)
+                        throw mailio::smtp_error("RCPT rejection.", line);
+                }
+
+                // Every piece ends on a line break, so the CRLF the dialog
+                // appends is its last line break and DATA pieces always start
+                // a line for the dot-stuffing.
+                std::string piece;
+                if (!chunking) {
+                    if (!pipelining)
+                        this->dialog_->send("DATA");
+                    reply("DATA", 354);
+                    while (reader.next(piece)) {
+                        piece = dotStuff(piece);
+                        piece.resize(piece.size() - 2);
+                        this->dialog_->send(piece);
+                    }
+                    this->dialog_->send(".");
+                    return reply("DATA", 250);
+                }
+
+                // BDAT sends the message as is: no dot-stuffing and no line
+                // by line transform (RFC 3030).
+                std::string result;
+                std::size_t pending = 0;
+                while (reader.next(piece)) {
+                    bool last = reader.done();
+                    std::string chunk = "BDAT " + std::to_string(piece.size()) + (last ? " LAST" : "") + "\r\n";
+                    chunk.append(piece, 0, piece.size() - 2);
+                    this->dialog_->send(chunk);
+                    pending++;
+                    // without PIPELINING every chunk waits for its reply
+                    if (!pipelining || last) {
+                        for (; pending > 0; pending--)
+                            result = reply("BDAT", 250);
+                    }
+                }
+                return result;
+            }
+
+        protected:
+            // Sends one command and returns the last line of the reply, which
+            // has to carry the expected status code.
+            std::string command(const std::string& cmd, int expected) {
+                this->dialog_->send(cmd);
+                return reply(cmd.substr(0, cmd.find(' ')), expected);
+            }
+
+            std::string reply(const std::string& name, int expected) {
+                auto [status, line] = readReply();
+                if (status != expected)
+                    throw mailio::smtp_error(name + " rejection.", line);
+                return line;
+            }
+
+            // Status and last line of one possibly multi-line reply.
+            std::pair<int, std::string> readReply() {
+                std::string line;
+                do {
+                    line = this->dialog_->receive();
+                } while (line.size() > 3 && line[3] == '-');
+                try {
+                    return std::make_pair(std::stoi(line.substr(0, 3)), line);
+                }
+                catch (const std::exception&) {
+                    throw mailio::smtp_error("Parsing server failure.", line);
+                }
+            }
+
+            // All lines of a multi-line reply to cmd.
+            std::vector<std::string> replyLines(const std::string& cmd, int expected) {
+                this->dialog_->send(cmd);
+                std::vector<std::string> lines;
+                do {
+                    lines.push_back(this->dialog_->receive());
+                } while (lines.back().size() > 3 && lines.back()[3] == '-');
+                if (lines.back().compare(0, 3, std::to_string(expected)) != 0)
+                    throw mailio::smtp_error(cmd.substr(0, cmd.find(' ')) + " rejection.", lines.back());
+                return lines;
+            }
+
+        private:
+            static constexpr std::size_t BDAT_CHUNK_SIZE = 1024 * 1024;
+
+            // Headers, then content read block by block, handed out in pieces
+            // of about BDAT_CHUNK_SIZE that end right after a CRLF; the last
+            // piece gets one when the message lacks it.
+            class MessageReader {
+                public:
+                    MessageReader(const std::string& headers, std::istream& content)
+                        : _pending{headers}, _content{content} {}
+
+                    // Octets still to come, when the content can tell.
+                    std::optional<std::size_t> size() {
+                        auto start = _content.tellg();
+                        if (start < 0)
+                            return std::nullopt;
+                        _content.seekg(0, std::ios::end);
+                        auto end = _content.tellg();
+                        _content.seekg(start);
+                        if (end < start)
+                            return std::nullopt;
+                        return _pending.size() + static_cast<std::size_t>(end - start);
+                    }
+
+                    bool next(std::string& piece) {
+                        while (_pending.size() < BDAT_CHUNK_SIZE && read()) {
+                        }
+                        if (_pending.empty())
+                            return false;
+                        std::size_t end = _pending.size();
+                        if (!exhausted() || end > BDAT_CHUNK_SIZE) {
+                            auto eol = _pending.rfind("\r\n", BDAT_CHUNK_SIZE - 2);
+                            // a line longer than a chunk is read up to its end
+                            std::size_t from = 0;
+                            while (eol == std::string::npos) {
+                                eol = _pending.find("\r\n", from);
+                                from = _pending.empty() ? 0 : _pending.size() - 1;
+                                if (eol == std::string::npos && !read())
+                                    break;
+                            }
+                            end = eol == std::string::npos ? _pending.size() : eol + 2;
+                        }
+                        piece.assign(_pending, 0, end);
+                        _pending.erase(0, end);
+                        if (done() && (piece.size() < 2 || piece.compare(piece.size() - 2, 2, "\r\n") != 0))
+                            piece += "\r\n";
+                        return true;
+                    }
+
+                    bool done() {
+                        return _pending.empty() && exhausted();
+                    }
+
+                private:
+                    bool exhausted() {
+                        return !_content.good() || _content.peek() == std::char_traits<char>::eof();
+                    }
+
+                    bool read() {
+                        if (!_content.good())
+                            return false;
+                        char block[64 * 1024];
+                        _content.read(block, sizeof(block));
+                        _pending.append(block, static_cast<std::size_t>(_content.gcount()));
+                        return _content.gcount() > 0;
+                    }
+
+                    std::string _pending;
+                    std::istream& _content;
+            };
+
+            // Doubles leading dots for DATA (RFC 5321 4.5.2).
+            static std::string dotStuff(const std::string& data) {
+                std::string stuffed;
+                stuffed.reserve(data.size() + data.size() / 1000);
+                for (std::size_t i = 0; i < data.size(); i++) {
+                    if (data[i] == '.' && (i == 0 || data[i - 1] == '\n'))
+                        stuffed += '.';
+                    stuffed += data[i];
+                }
+                return stuffed;
+            }
+
+            static std::vector<std::string> envelopeRecipients(const mailio::message& msg) {
+                std::vector<std::string> recipients;
+                for (const auto& boxes : {msg.recipients(), msg.cc_recipients(), msg.bcc_recipients()}) {
+                    for (const auto& address : boxes.addresses)
+                        recipients.push_back(address.address);
+                    for (const auto& group : boxes.groups)
+                        for (const auto& member : group.members)
+                            recipients.push_back(member.address);
+                }
+                return recipients;
+            }
+
+            std::set<std::string> _extensions;
+            bool _extensions_loaded = false;
+    };
+};
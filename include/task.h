@@ -5,12 +5,16 @@
 #include <map>
 #include <optional>
 
+#include <yaml-cpp/yaml.h>
+
 
 namespace remote_agent {
 struct Step {
   std::string name;
   std::vector<std::string> commands;
   std::map<std::string,std::string> environments;
+  // Bundle entries the step reads, extracted right before it runs
+  std::vector<std::string> payload;
 };
 
 struct Task {
@@ -25,11 +29,15 @@ public:
   TaskParser& operator=(const TaskParser& other) = delete;
   ~TaskParser();
   bool parseYaml(std::string filename);
+  // Same as parseYaml for a task file that is already in memory.
+  bool parseYamlBuffer(const std::string& content);
 
   const Task& getTask() const;
   std::optional<std::string> getError() const;
 
 private:
+  void load(const YAML::Node& config);
+
   Task _task;
   std::optional<std::string> _error;
 };
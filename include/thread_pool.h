@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace remote_agent {
+class ThreadPool {
+public:
+  ThreadPool(std::size_t workers);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  template <typename Function>
+  auto submit(Function &&function)
+      -> std::future<std::invoke_result_t<std::decay_t<Function>>> {
+    using Result = std::invoke_result_t<std::decay_t<Function>>;
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+        std::forward<Function>(function));
+    auto future = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return future;
+  }
+
+  void stop();
+  std::size_t size() const;
+
+private:
+  void enqueue(std::function<void()> job);
+  void work();
+
+  std::vector<std::thread> _threads;
+  std::queue<std::function<void()>> _jobs;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::atomic_bool _running;
+};
+} // namespace remote_agent
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl.hpp>
+#include <mailio/dialog.hpp>
+#include <openssl/ssl.h>
+
+namespace remote_agent::mail {
+
+    // TLS client state shared by every connection to one host: the CA store
+    // is loaded once and the last session is offered for resumption, so
+    // reconnects skip the full handshake and the certificate chain check.
+    class TlsContext {
+        public:
+            static std::shared_ptr<TlsContext> forHost(const std::string& host, unsigned port, bool verify_peer);
+
+            TlsContext(const std::string& host, bool verify_peer);
+            ~TlsContext();
+            TlsContext(const TlsContext&) = delete;
+            TlsContext& operator=(const TlsContext&) = delete;
+
+            boost::asio::ssl::context& context();
+            const std::string& host() const;
+            bool verifyPeer() const;
+            // Offers the cached session, if any, on the next handshake of ssl.
+            void prepare(SSL* ssl);
+            void handshakeDone(bool resumed);
+
+        private:
+            static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
+            const std::string _host;
+            const bool _verify_peer;
+            boost::asio::ssl::context _context;
+            std::mutex _mutex;
+            SSL_SESSION* _session;
+            std::atomic<unsigned long> _handshakes;
+            std::atomic<unsigned long> _resumed;
+    };
+
+    // mailio dialog speaking TLS through a shared TlsContext; it replaces
+    // the plain dialog of a connection right after connect or STARTTLS.
+    class TlsDialog : public mailio::dialog {
+        public:
+            TlsDialog(const mailio::dialog& other, std::shared_ptr<TlsContext> context);
+
+            void send(const std::string& line) override;
+            std::string receive(bool raw = false) override;
+            // For layers that need the raw octet stream, see DeflateDialog.
+            boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>& stream();
+            // Whether the engine holds input, decrypted or not, that poll()
+            // on the socket would no longer report.
+            bool pending();
+
+        private:
+            std::shared_ptr<TlsContext> _context;
+            std::shared_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>> _stream;
+    };
+};
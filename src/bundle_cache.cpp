@@ -0,0 +1,216 @@
+#include "bundle_cache.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <sys/ioctl.h>
+#include <syslog.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <openssl/evp.h>
+
+#include "file_utils.h"
+
+namespace remote_agent {
+
+    namespace {
+        // runs only get clones or copies, the cache itself stays read-only
+        constexpr auto WRITE_PERMS = std::filesystem::perms::owner_write | std::filesystem::perms::group_write |
+                                     std::filesystem::perms::others_write;
+
+        // Copy-on-write clone where the filesystem supports it (btrfs, XFS).
+        bool reflink(const std::filesystem::path& source, const std::filesystem::path& target) {
+#ifdef FICLONE
+            int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in < 0)
+                return false;
+            int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (out < 0) {
+                ::close(in);
+                return false;
+            }
+            bool cloned = ::ioctl(out, FICLONE, in) == 0;
+            ::close(in);
+            ::close(out);
+            if (!cloned)
+                ::unlink(target.c_str());
+            return cloned;
+#else
+            return false;
+#endif
+        }
+    }
+
+    BundleCache& BundleCache::getInstance() {
+        static BundleCache instance;
+        return instance;
+    }
+
+    BundleCache::BundleCache()
+        : _config{Config::getInstance().getGlobalConfig().bundle_cache},
+          _root{std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) / ".bundles"} {
+    }
+
+    std::optional<std::string> BundleCache::archiveDigest(const std::string& zip_file) {
+        std::ifstream fis(zip_file, std::ios::binary);
+        if (!fis.is_open())
+            return std::nullopt;
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+        EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+        std::vector<char> buffer(1024 * 1024);
+        while (fis.read(buffer.data(), buffer.size()) || fis.gcount() > 0)
+            EVP_DigestUpdate(ctx.get(), buffer.data(), fis.gcount());
+        if (fis.bad())
+            return std::nullopt;
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(ctx.get(), digest, &length);
+        static constexpr char HEX[] = "0123456789abcdef";
+        std::string hex;
+        for (unsigned int i = 0; i < length; i++) {
+            hex += HEX[digest[i] >> 4];
+            hex += HEX[digest[i] & 0x0f];
+        }
+        return hex;
+    }
+
+    bool BundleCache::enabled() const {
+        return _config.enabled;
+    }
+
+    std::optional<Error> BundleCache::materialize(const std::string& zip_file, const std::string& digest,
+                                                  const std::vector<std::string>& entries,
+                                                  const std::string& destination_dir) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const auto bundle = _root / digest;
+        std::error_code ec;
+        if (!std::filesystem::is_directory(bundle / "tree", ec)) {
+            auto err = populate(zip_file, digest);
+            if (err.has_value())
+                return err;
+            evict(digest);
+        } else {
+            syslog(LOG_INFO, "BundleCache: %s is cached as %s", zip_file.c_str(), digest.c_str());
+        }
+        // the directory time is the last use
+        std::filesystem::last_write_time(bundle, std::filesystem::file_time_type::clock::now(), ec);
+
+        for (const auto& entry : entries) {
+            if (!isSafeEntryName(entry))
+                return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Unsafe entry " + entry + " in archive " + zip_file);
+            auto target = std::filesystem::path(destination_dir) / entry;
+            if (!isWithinDirectory(target, destination_dir))
+                return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Entry " + entry + " resolves outside " + destination_dir);
+            auto err = link(bundle / "tree" / entry, target);
+            if (err.has_value())
+                return err;
+        }
+        return std::nullopt;
+    }
+
+    std::optional<Error> BundleCache::populate(const std::string& zip_file, const std::string& digest) {
+        // extracted next to its final place and renamed, a crash never
+        // leaves a half filled bundle behind under its digest
+        const auto staging = _root / (".staging-" + digest);
+        std::error_code ec;
+        std::filesystem::remove_all(staging, ec);
+        Zip zip(Config::getInstance().getGlobalConfig().zip);
+        auto err = zip.extract(zip_file, (staging / "tree").string());
+        if (err.has_value()) {
+            std::filesystem::remove_all(staging, ec);
+            return err;
+        }
+
+        uint64_t size = 0;
+        for (const auto& file : std::filesystem::recursive_directory_iterator(staging / "tree", ec)) {
+            if (!file.is_regular_file(ec))
+                continue;
+            size += file.file_size(ec);
+            std::filesystem::permissions(file.path(), WRITE_PERMS, std::filesystem::perm_options::remove, ec);
+        }
+        {
+            std::ofstream fos(staging / "size", std::ios::trunc);
+            fos << size;
+        }
+        std::filesystem::rename(staging, _root / digest, ec);
+        if (ec) {
+            syslog(LOG_ERR, "BundleCache/populate: %s", ec.message().c_str());
+            std::filesystem::remove_all(staging, ec);
+            return std::make_pair(ErrorCode::FILE_CREATE_FAILED, "cannot cache " + zip_file + " as " + digest);
+        }
+        syslog(LOG_INFO, "BundleCache: cached %s as %s, %llu bytes", zip_file.c_str(), digest.c_str(),
+               static_cast<unsigned long long>(size));
+        return std::nullopt;
+    }
+
+    std::optional<Error> BundleCache::link(const std::filesystem::path& source, const std::filesystem::path& target) {
+        std::error_code ec;
+        std::filesystem::create_directories(target.parent_path(), ec);
+        std::filesystem::remove(target, ec);
+        if (reflink(source, target)) {
+            // a clone is the run's own copy, keep the mode but make it writable
+            std::filesystem::permissions(target, std::filesystem::status(source, ec).permissions() |
+                                                     std::filesystem::perms::owner_write, ec);
+            return std::nullopt;
+        }
+        // no hardlinks: a step writing or chmod-ing its input would change
+        // the cached file for every later run
+        ec.clear();
+        std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing, ec);
+        if (!ec) {
+            std::filesystem::permissions(target, std::filesystem::perms::owner_write,
+                                         std::filesystem::perm_options::add, ec);
+            return std::nullopt;
+        }
+        syslog(LOG_ERR, "BundleCache/link: %s: %s", source.c_str(), ec.message().c_str());
+        return std::make_pair(ErrorCode::FILE_CREATE_FAILED, "cannot copy " + source.string() + ": " + ec.message());
+    }
+
+    void BundleCache::evict(const std::string& keep) {
+        struct Bundle {
+            std::filesystem::path path;
+            std::filesystem::file_time_type used;
+            uint64_t size;
+        };
+        std::vector<Bundle> bundles;
+        uint64_t total = 0;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(_root, ec)) {
+            std::string name = entry.path().filename().string();
+            if (name.empty() || name[0] == '.' || !entry.is_directory(ec))
+                continue;
+            Bundle bundle{entry.path(), std::filesystem::last_write_time(entry.path(), ec), bundleSize(entry.path())};
+            total += bundle.size;
+            if (name != keep)
+                bundles.push_back(bundle);
+        }
+        if (total <= _config.max_bytes)
+            return;
+        std::sort(bundles.begin(), bundles.end(), [](const Bundle& a, const Bundle& b) { return a.used < b.used; });
+        for (const auto& bundle : bundles) {
+            if (total <= _config.max_bytes)
+                break;
+            // runs keep their own copies, only the cache one goes
+            std::filesystem::remove_all(bundle.path, ec);
+            if (ec) {
+                syslog(LOG_ERR, "BundleCache/evict: %s: %s", bundle.path.c_str(), ec.message().c_str());
+                continue;
+            }
+            total -= bundle.size;
+            syslog(LOG_INFO, "BundleCache: evicted %s, %llu bytes", bundle.path.filename().c_str(),
+                   static_cast<unsigned long long>(bundle.size));
+        }
+    }
+
+    uint64_t BundleCache::bundleSize(const std::filesystem::path& bundle) {
+        std::ifstream fis(bundle / "size");
+        uint64_t size = 0;
+        if (!(fis >> size))
+            return 0;
+        return size;
+    }
+};
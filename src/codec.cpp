@@ -0,0 +1,300 @@
+#include "codec.h"
+#include "codec_simd.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+
+namespace remote_agent::codec {
+
+    namespace {
+        constexpr uint8_t INVALID = 0xff;
+        constexpr const char* BASE64_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        constexpr const char* HEX_DIGITS = "0123456789ABCDEF";
+        // RFC 2045 allows 76 characters per line, one is kept for the '='
+        // of a soft line break
+        constexpr std::size_t QP_LINE_LENGTH = 75;
+
+        constexpr std::array<uint8_t, 256> makeBase64Table() {
+            std::array<uint8_t, 256> table{};
+            for (auto& entry : table)
+                entry = INVALID;
+            for (uint8_t i = 0; i < 64; i++)
+                table[static_cast<uint8_t>(BASE64_ALPHABET[i])] = i;
+            return table;
+        }
+
+        constexpr std::array<uint8_t, 256> BASE64_TABLE = makeBase64Table();
+
+        int hexValue(char c) {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        }
+
+        const simd::Kernels* detectKernels() {
+            if (const auto* kernels = simd::avx2())
+                return kernels;
+            return simd::sse41();
+        }
+
+        // null selects the scalar code
+        std::atomic<const simd::Kernels*>& activeKernels() {
+            static std::atomic<const simd::Kernels*> kernels{detectKernels()};
+            return kernels;
+        }
+
+        bool isQpLiteral(unsigned char c) {
+            return (c > 32 && c < 127 && c != '=') || c == ' ' || c == '\t';
+        }
+
+        // Encodes count octets of in to out and returns the end of the
+        // output; the vector kernels may load up to readable octets.
+        char* encodeBase64To(const uint8_t* in, std::size_t count, std::size_t readable, char* out,
+                             const simd::Kernels* kernels) {
+            std::size_t i = 0;
+            if (kernels != nullptr) {
+                i = kernels->encode_base64(in, count, readable, out);
+                out += i / 3 * 4;
+            }
+            for (; i + 2 < count; i += 3) {
+                uint32_t group = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+                *out++ = BASE64_ALPHABET[(group >> 18) & 0x3f];
+                *out++ = BASE64_ALPHABET[(group >> 12) & 0x3f];
+                *out++ = BASE64_ALPHABET[(group >> 6) & 0x3f];
+                *out++ = BASE64_ALPHABET[group & 0x3f];
+            }
+            if (i < count) {
+                uint32_t group = in[i] << 16;
+                if (i + 1 < count)
+                    group |= in[i + 1] << 8;
+                *out++ = BASE64_ALPHABET[(group >> 18) & 0x3f];
+                *out++ = BASE64_ALPHABET[(group >> 12) & 0x3f];
+                *out++ = i + 1 < count ? BASE64_ALPHABET[(group >> 6) & 0x3f] : '=';
+                *out++ = '=';
+            }
+            return out;
+        }
+    }
+
+    std::string encodeBase64(const std::string& input, std::size_t line_length) {
+        const auto* kernels = activeKernels().load(std::memory_order_relaxed);
+        const auto* in = reinterpret_cast<const uint8_t*>(input.data());
+        const std::size_t size = input.size();
+        std::size_t group = line_length / 4 * 3;
+        if (group == 0)
+            group = size;
+        const std::size_t lines = group == 0 ? 0 : (size + group - 1) / group;
+        std::string output((size + 2) / 3 * 4 + (line_length >= 4 ? lines * 2 : 0), '\0');
+        char* out = &output[0];
+        for (std::size_t pos = 0; pos < size; pos += group) {
+            out = encodeBase64To(in + pos, std::min(group, size - pos), size - pos, out, kernels);
+            if (line_length >= 4) {
+                *out++ = '\r';
+                *out++ = '\n';
+            }
+        }
+        return output;
+    }
+
+    void Base64Decoder::decode(const char* data, std::size_t size, std::string& output) {
+        const auto* kernels = activeKernels().load(std::memory_order_relaxed);
+        const std::size_t block = kernels != nullptr ? kernels->decode_block : 0;
+        std::size_t base = output.size();
+        // the kernels store a whole block, 3/4 of it is output
+        output.resize(base + size / 4 * 3 + 3 + block);
+        auto* out = reinterpret_cast<uint8_t*>(&output[base]);
+        std::size_t written = 0;
+        bool scalar_until_gap = false;
+        for (std::size_t i = 0; i < size && !_done;) {
+            if (block != 0 && _bits == 0 && !scalar_until_gap && i + block <= size) {
+                if (kernels->decode_base64(data + i, out + written)) {
+                    i += block;
+                    written += block / 4 * 3;
+                    continue;
+                }
+                // a line break or padding is ahead, step over it first
+                scalar_until_gap = true;
+            }
+            unsigned char c = data[i++];
+            if (c == '=') {
+                _done = true;
+                break;
+            }
+            uint8_t value = BASE64_TABLE[c];
+            if (value == INVALID) {
+                scalar_until_gap = false;
+                continue;
+            }
+            _buffer = (_buffer << 6) | value;
+            _bits += 6;
+            if (_bits >= 8) {
+                _bits -= 8;
+                out[written++] = static_cast<uint8_t>((_buffer >> _bits) & 0xff);
+            }
+        }
+        output.resize(base + written);
+    }
+
+    std::string decodeBase64(const std::string& input) {
+        std::string output;
+        Base64Decoder decoder;
+        decoder.decode(input.data(), input.size(), output);
+        return output;
+    }
+
+    std::string encodeQuotedPrintable(const std::string& input) {
+        const auto* kernels = activeKernels().load(std::memory_order_relaxed);
+        const char* in = input.data();
+        const std::size_t size = input.size();
+        std::string output;
+        output.reserve(size + size / 8);
+        std::size_t column = 0;
+        std::size_t i = 0;
+        while (i < size) {
+            std::size_t end = i;
+            if (kernels != nullptr) {
+                end += kernels->qp_literal_run(in + i, size - i);
+            } else {
+                while (end < size && isQpLiteral(in[end]))
+                    end++;
+            }
+            // blanks right before a line break have to be encoded
+            if (end == size || in[end] == '\r' || in[end] == '\n') {
+                while (end > i && (in[end - 1] == ' ' || in[end - 1] == '\t'))
+                    end--;
+            }
+            while (i < end) {
+                if (column == QP_LINE_LENGTH) {
+                    output += "=\r\n";
+                    column = 0;
+                }
+                std::size_t take = std::min(QP_LINE_LENGTH - column, end - i);
+                output.append(in + i, take);
+                column += take;
+                i += take;
+            }
+            if (i == size)
+                break;
+
+            unsigned char c = in[i];
+            if (c == '\n' || (c == '\r' && i + 1 < size && in[i + 1] == '\n')) {
+                output += "\r\n";
+                column = 0;
+                i += c == '\r' ? 2 : 1;
+                continue;
+            }
+            if (column + 3 > QP_LINE_LENGTH) {
+                output += "=\r\n";
+                column = 0;
+            }
+            output += '=';
+            output += HEX_DIGITS[c >> 4];
+            output += HEX_DIGITS[c & 0x0f];
+            column += 3;
+            i++;
+        }
+        return output;
+    }
+
+    std::string decodeQuotedPrintable(const std::string& input) {
+        const auto* kernels = activeKernels().load(std::memory_order_relaxed);
+        std::string output;
+        output.reserve(input.size());
+        for (std::size_t i = 0; i < input.size(); i++) {
+            // everything up to the next '=' is copied as is
+            std::size_t next = i;
+            if (kernels != nullptr) {
+                next += kernels->find_byte(input.data() + i, input.size() - i, '=');
+            } else {
+                while (next < input.size() && input[next] != '=')
+                    next++;
+            }
+            output.append(input, i, next - i);
+            i = next;
+            if (i == input.size())
+                break;
+            char c = input[i];
+            // soft line break: "=\r\n" or "=\n"
+            if (i + 1 < input.size() && (input[i + 1] == '\r' || input[i + 1] == '\n')) {
+                i += (input[i + 1] == '\r' && i + 2 < input.size() && input[i + 2] == '\n') ? 2 : 1;
+                continue;
+            }
+            int high = i + 1 < input.size() ? hexValue(input[i + 1]) : -1;
+            int low = i + 2 < input.size() ? hexValue(input[i + 2]) : -1;
+            if (high < 0 || low < 0) {
+                output += c;
+                continue;
+            }
+            output += static_cast<char>((high << 4) | low);
+            i += 2;
+        }
+        return output;
+    }
+
+    std::string decodeEncodedWords(const std::string& text) {
+        std::string decoded;
+        bool after_word = false;
+        std::size_t pos = 0;
+        while (pos < text.size()) {
+            auto start = text.find("=?", pos);
+            std::size_t charset_end = start == std::string::npos ? start : text.find('?', start + 2);
+            std::size_t encoding_end = charset_end == std::string::npos ? charset_end : text.find('?', charset_end + 1);
+            std::size_t end = encoding_end == std::string::npos ? encoding_end : text.find("?=", encoding_end + 1);
+            if (end == std::string::npos || encoding_end != charset_end + 2) {
+                decoded += text.substr(pos);
+                break;
+            }
+            // whitespace between two encoded words is dropped
+            std::string between = text.substr(pos, start - pos);
+            if (!after_word || between.find_first_not_of(" \t\r\n") != std::string::npos)
+                decoded += between;
+            char encoding = std::toupper(static_cast<unsigned char>(text[charset_end + 1]));
+            std::string word = text.substr(encoding_end + 1, end - encoding_end - 1);
+            if (encoding == 'B') {
+                decoded += decodeBase64(word);
+            } else {
+                std::replace(word.begin(), word.end(), '_', ' ');
+                decoded += decodeQuotedPrintable(word);
+            }
+            after_word = true;
+            pos = end + 2;
+        }
+        return decoded;
+    }
+
+    std::string decodeTransfer(const std::string& input, const std::string& encoding) {
+        std::string lower = encoding;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (lower == "base64")
+            return decodeBase64(input);
+        if (lower == "quoted-printable")
+            return decodeQuotedPrintable(input);
+        return input;
+    }
+
+    const char* implementation() {
+        const auto* kernels = activeKernels().load();
+        return kernels != nullptr ? kernels->name : "scalar";
+    }
+
+    bool selectImplementation(const std::string& name) {
+        const simd::Kernels* kernels = nullptr;
+        if (name == "avx2")
+            kernels = simd::avx2();
+        else if (name == "sse4.1")
+            kernels = simd::sse41();
+        else if (name != "scalar")
+            return false;
+        if (kernels == nullptr && name != "scalar")
+            return false;
+        activeKernels().store(kernels);
+        return true;
+    }
+};
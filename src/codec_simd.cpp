@@ -0,0 +1,226 @@
+#include "codec_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REMOTE_AGENT_CODEC_X86 1
+#endif
+
+namespace remote_agent::codec::simd {
+
+#ifdef REMOTE_AGENT_CODEC_X86
+    // The kernels are compiled for their instruction set through target
+    // attributes, so the rest of the program keeps the baseline flags and
+    // runs on any x86 CPU. The base64 kernels follow Muła and Lemire,
+    // "Faster Base64 Encoding and Decoding using AVX2 Instructions".
+    namespace {
+
+        // ---- SSE4.1 ----
+
+        __attribute__((target("sse4.1"))) inline __m128i encodeLanes(__m128i in) {
+            // spread 3 octets over 4 bytes, then move every 6 bit group to
+            // the low bits of its own byte
+            in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+            const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+            const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+            const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+            const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+            const __m128i indices = _mm_or_si128(t1, t3);
+            // 6 bit value to its character by adding a per-range offset
+            const __m128i offsets = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+            __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+            range = _mm_sub_epi8(range, _mm_cmpgt_epi8(indices, _mm_set1_epi8(25)));
+            return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+        }
+
+        __attribute__((target("sse4.1")))
+        std::size_t encodeBase64Sse41(const uint8_t* in, std::size_t count, std::size_t readable, char* out) {
+            std::size_t done = 0;
+            while (done + 12 <= count && done + 16 <= readable) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), encodeLanes(block));
+                out += 16;
+                done += 12;
+            }
+            return done;
+        }
+
+        __attribute__((target("sse4.1"))) bool decodeBase64Sse41(const char* in, uint8_t* out) {
+            __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+            const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+            const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                                 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m128i mask_2f = _mm_set1_epi8(0x2f);
+            const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+            const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+            const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+            const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+            if (!_mm_testz_si128(lo, hi))
+                return false;
+            const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+            const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+            str = _mm_add_epi8(str, roll);
+            // pack four 6 bit values into 3 octets per 32 bit lane
+            const __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+            __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+            packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+            return true;
+        }
+
+        __attribute__((target("sse4.1"))) inline unsigned qpLiteralMask(__m128i v) {
+            const __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(32)),
+                                                    _mm_cmplt_epi8(v, _mm_set1_epi8(127)));
+            const __m128i literal = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')), printable);
+            const __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                               _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+            return static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(literal, blank)));
+        }
+
+        __attribute__((target("sse4.1"))) std::size_t qpLiteralRunSse41(const char* in, std::size_t size) {
+            std::size_t done = 0;
+            for (; done + 16 <= size; done += 16) {
+                unsigned mask = qpLiteralMask(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done)));
+                if (mask != 0xffff)
+                    return done + __builtin_ctz(~mask);
+            }
+            while (done < size) {
+                unsigned char c = in[done];
+                if (!((c > 32 && c < 127 && c != '=') || c == ' ' || c == '\t'))
+                    break;
+                done++;
+            }
+            return done;
+        }
+
+        __attribute__((target("sse4.1"))) std::size_t findByteSse41(const char* in, std::size_t size, char c) {
+            const __m128i needle = _mm_set1_epi8(c);
+            std::size_t done = 0;
+            for (; done + 16 <= size; done += 16) {
+                __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+                int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+                if (mask != 0)
+                    return done + __builtin_ctz(mask);
+            }
+            while (done < size && in[done] != c)
+                done++;
+            return done;
+        }
+
+        // ---- AVX2 ----
+
+        __attribute__((target("avx2")))
+        std::size_t encodeBase64Avx2(const uint8_t* in, std::size_t count, std::size_t readable, char* out) {
+            std::size_t done = 0;
+            // two overlapping 16 octet loads put 12 octets in each lane
+            while (done + 24 <= count && done + 28 <= readable) {
+                __m256i block = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done))),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done + 12)), 1);
+                block = _mm256_shuffle_epi8(block, _mm256_setr_epi8(
+                    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                    1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+                const __m256i t0 = _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00));
+                const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+                const __m256i t2 = _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0));
+                const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+                const __m256i indices = _mm256_or_si256(t1, t3);
+                const __m256i offsets = _mm256_setr_epi8(
+                    65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                    65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+                __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+                range = _mm256_sub_epi8(range, _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(25)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+                                    _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range)));
+                out += 32;
+                done += 24;
+            }
+            // one SSE block still fits when less than 28 octets are readable
+            return done + encodeBase64Sse41(in + done, count - done, readable - done, out);
+        }
+
+        __attribute__((target("avx2"))) bool decodeBase64Avx2(const char* in, uint8_t* out) {
+            __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+            const __m256i lut_lo = _mm256_setr_epi8(
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+            const __m256i lut_hi = _mm256_setr_epi8(
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m256i lut_roll = _mm256_setr_epi8(
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+            const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+            const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+            const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+            if (!_mm256_testz_si256(lo, hi))
+                return false;
+            const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+            const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+            str = _mm256_add_epi8(str, roll);
+            const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+            __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+            packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+            // join the 12 octets of both lanes
+            packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+            return true;
+        }
+
+        __attribute__((target("avx2"))) std::size_t qpLiteralRunAvx2(const char* in, std::size_t size) {
+            std::size_t done = 0;
+            for (; done + 32 <= size; done += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done));
+                const __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(32)),
+                                                           _mm256_cmpgt_epi8(_mm256_set1_epi8(127), v));
+                const __m256i literal = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')), printable);
+                const __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+                unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(literal, blank)));
+                if (mask != 0xffffffffu)
+                    return done + __builtin_ctz(~mask);
+            }
+            return done + qpLiteralRunSse41(in + done, size - done);
+        }
+
+        __attribute__((target("avx2"))) std::size_t findByteAvx2(const char* in, std::size_t size, char c) {
+            const __m256i needle = _mm256_set1_epi8(c);
+            std::size_t done = 0;
+            for (; done + 32 <= size; done += 32) {
+                __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done));
+                unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+                if (mask != 0)
+                    return done + __builtin_ctz(mask);
+            }
+            return done + findByteSse41(in + done, size - done, c);
+        }
+
+        const Kernels SSE41_KERNELS{"sse4.1", encodeBase64Sse41, decodeBase64Sse41, 16, qpLiteralRunSse41,
+                                    findByteSse41};
+        const Kernels AVX2_KERNELS{"avx2", encodeBase64Avx2, decodeBase64Avx2, 32, qpLiteralRunAvx2, findByteAvx2};
+    }
+
+    const Kernels* sse41() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1") ? &SSE41_KERNELS : nullptr;
+    }
+
+    const Kernels* avx2() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &AVX2_KERNELS : nullptr;
+    }
+#else
+    const Kernels* sse41() {
+        return nullptr;
+    }
+
+    const Kernels* avx2() {
+        return nullptr;
+    }
+#endif
+};
@@ -1,5 +1,7 @@
 #include "config.h"
+#include "file_utils.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <string>
 #include <sys/syslog.h>
@@ -7,6 +9,13 @@
 
 namespace remote_agent {
 
+namespace {
+constexpr int MIN_POLL_INTERVAL_MS = 100;
+// polls of an IDLE account without check_mail_interval_ms, while the
+// watcher reconnects or when the server has no IDLE
+constexpr int IDLE_FALLBACK_INTERVAL_MS = 60000;
+}
+
 Config& Config::getInstance(std::string config_path) {
   static Config instance;
   if (!config_path.empty()) {
@@ -45,14 +54,34 @@ void Config::loadConfig(const std::string& config_path) {
       _global_config.work_dir = global["work_dir"].as<std::string>("/tmp");
       _global_config.zeromq_endpoint = global["zeromq_endpoint"].as<std::string>("tcp://*:2986");
       _global_config.check_mail_interval_ms = global["check_mail_interval_ms"].as<int>(0);
+      // negative counts would wrap to a huge ThreadPool size
+      _global_config.mail_workers = std::max(global["mail_workers"].as<int>(4), 1);
+      _global_config.mail_processors = std::max(global["mail_processors"].as<int>(4), 1);
+      _global_config.session_pool = parseSessionPool(global);
+      _global_config.tls = parseTls(global);
+      _global_config.poll_schedule = parsePollSchedule(
+          global, _global_config.check_mail_interval_ms,
+          PollScheduleConfig{0, 60000, 2.0, 0.2});
+      _global_config.spool = parseSpool(global);
+      _global_config.digest = parseDigest(global);
+      _global_config.result_archive = parseResultArchive(global);
+      _global_config.zip = parseZip(global);
+      _global_config.bundle_cache = parseBundleCache(global);
+      _global_config.dedup = parseDedup(global);
     }
     loadDotEnvFile();
 
     // Parse accounts
     if (config["accounts"]) {
       for (const auto &account_node : config["accounts"]) {
-        AccountConfig account;
+        AccountConfig account{};
         account.name = account_node["name"].as<std::string>();
+        account.check_mail_interval_ms =
+            account_node["check_mail_interval_ms"].as<int>(
+                _global_config.check_mail_interval_ms);
+        account.poll_schedule =
+            parsePollSchedule(account_node, account.check_mail_interval_ms,
+                              _global_config.poll_schedule);
 
         // Parse SMTP configuration
         if (account_node["protocol"]["smtp"]) {
@@ -62,6 +91,7 @@ void Config::loadConfig(const std::string& config_path) {
           account.smtp.security = smtp["security"].as<std::string>("plain");
           account.smtp.auth_method =
               smtp["auth_method"].as<std::string>("login");
+          account.smtp.compress = false;
           account.smtp_details = parseSmtpConfig(smtp);
         }
 
@@ -73,9 +103,17 @@ void Config::loadConfig(const std::string& config_path) {
           account.imap.security = imap["security"].as<std::string>("plain");
           account.imap.auth_method =
               imap["auth_method"].as<std::string>("login");
+          account.imap.compress = imap["compress"].as<bool>(false);
           auto filter = parseImapFilter(imap);
           if (filter.has_value())
             account.imap_filter = filter.value();
+          account.imap_idle = parseImapIdle(imap);
+          if (account.imap_idle.enabled &&
+              account.check_mail_interval_ms <= 0) {
+            account.poll_schedule = parsePollSchedule(
+                account_node, IDLE_FALLBACK_INTERVAL_MS,
+                _global_config.poll_schedule);
+          }
         }
 
         // Parse credentials
@@ -175,6 +213,11 @@ Config::parseImapFilter(const YAML::Node &imap_node) {
     filter.folders.push_back("inbox");
   }
 
+  filter.read_only = filter_node["read_only"].as<bool>(false);
+  filter.attachments = parseAttachmentFilter(filter_node);
+  filter.fetch_batch_size = filter_node["fetch_batch_size"].as<int>(50);
+  filter.rules = parseMailRules(filter_node);
+
   // Parse conditions
   if (filter_node["conditions"] && filter_node["conditions"].IsSequence()) {
     for (const auto &condition_node : filter_node["conditions"]) {
@@ -185,6 +228,277 @@ Config::parseImapFilter(const YAML::Node &imap_node) {
   return filter;
 }
 
+AttachmentFilterConfig
+Config::parseAttachmentFilter(const YAML::Node &filter_node) {
+  // Defaults match what Daemon::processMail acts on
+  AttachmentFilterConfig attachments{
+      false,
+      {".zip", ".yaml", ".yml"},
+      {"application/zip", "application/x-zip-compressed", "application/yaml",
+       "application/x-yaml", "text/yaml", "text/x-yaml"},
+      0};
+  if (!filter_node["attachments"]) {
+    return attachments;
+  }
+
+  const auto &node = filter_node["attachments"];
+  attachments.selective = node["selective"].as<bool>(true);
+  if (node["extensions"] && node["extensions"].IsSequence()) {
+    attachments.extensions.clear();
+    for (const auto &ext : node["extensions"]) {
+      std::string value = boost::to_lower_copy(ext.as<std::string>());
+      if (!value.empty() && value[0] != '.')
+        value = "." + value;
+      attachments.extensions.push_back(value);
+    }
+  }
+  if (node["mime_types"] && node["mime_types"].IsSequence()) {
+    attachments.mime_types.clear();
+    for (const auto &mime : node["mime_types"]) {
+      attachments.mime_types.push_back(
+          boost::to_lower_copy(mime.as<std::string>()));
+    }
+  }
+  attachments.max_size = node["max_size"].as<unsigned long>(0);
+  return attachments;
+}
+
+std::shared_ptr<const mail::MailRules>
+Config::parseMailRules(const YAML::Node &filter_node) {
+  if (!filter_node["rules"]) {
+    return nullptr;
+  }
+
+  // Compiled here once, not per message
+  const auto &node = filter_node["rules"];
+  mail::MailRules::Spec spec;
+  spec.subject = node["subject"].as<std::string>("");
+  if (node["senders"] && node["senders"].IsSequence()) {
+    spec.senders = node["senders"].as<std::list<std::string>>();
+  }
+  if (node["headers"] && node["headers"].IsSequence()) {
+    spec.headers = node["headers"].as<std::list<std::string>>();
+  }
+  if (spec.subject.empty() && spec.senders.empty() && spec.headers.empty()) {
+    return nullptr;
+  }
+  return std::make_shared<const mail::MailRules>(spec);
+}
+
+PollScheduleConfig Config::parsePollSchedule(const YAML::Node &node,
+                                             int interval_ms,
+                                             const PollScheduleConfig &defaults) {
+  PollScheduleConfig schedule = defaults;
+  // the plain interval stays the fastest rate unless configured otherwise
+  schedule.min_interval_ms = interval_ms;
+  if (node["poll_schedule"]) {
+    const auto &schedule_node = node["poll_schedule"];
+    schedule.min_interval_ms =
+        schedule_node["min_interval_ms"].as<int>(schedule.min_interval_ms);
+    schedule.max_interval_ms =
+        schedule_node["max_interval_ms"].as<int>(schedule.max_interval_ms);
+    schedule.backoff_factor =
+        schedule_node["backoff_factor"].as<double>(schedule.backoff_factor);
+    schedule.jitter = schedule_node["jitter"].as<double>(schedule.jitter);
+  }
+  // the poll timer ticks at the smallest min_interval_ms, 0 or below would
+  // spin it or leave the accounts unpolled
+  if (schedule.min_interval_ms < MIN_POLL_INTERVAL_MS)
+    schedule.min_interval_ms = MIN_POLL_INTERVAL_MS;
+  if (schedule.max_interval_ms < schedule.min_interval_ms)
+    schedule.max_interval_ms = schedule.min_interval_ms;
+  if (schedule.backoff_factor < 1.0)
+    schedule.backoff_factor = 1.0;
+  if (schedule.jitter < 0.0 || schedule.jitter >= 1.0)
+    schedule.jitter = 0.2;
+  return schedule;
+}
+
+SpoolConfig Config::parseSpool(const YAML::Node &global_node) {
+  SpoolConfig spool{4, 1, 30, 3600, 20, 16 * 1024 * 1024};
+  if (!global_node["spool"]) {
+    return spool;
+  }
+
+  const auto &spool_node = global_node["spool"];
+  spool.workers = spool_node["workers"].as<int>(spool.workers);
+  spool.max_per_account =
+      spool_node["max_per_account"].as<int>(spool.max_per_account);
+  spool.retry_base_sec =
+      spool_node["retry_base_sec"].as<int>(spool.retry_base_sec);
+  spool.retry_max_sec = spool_node["retry_max_sec"].as<int>(spool.retry_max_sec);
+  spool.max_attempts = spool_node["max_attempts"].as<int>(spool.max_attempts);
+  spool.segment_size =
+      spool_node["segment_size"].as<unsigned long>(spool.segment_size);
+  if (spool.workers < 1)
+    spool.workers = 1;
+  if (spool.max_per_account < 1)
+    spool.max_per_account = 1;
+  if (spool.retry_base_sec < 1)
+    spool.retry_base_sec = 1;
+  if (spool.retry_max_sec < spool.retry_base_sec)
+    spool.retry_max_sec = spool.retry_base_sec;
+  return spool;
+}
+
+ResultArchiveConfig Config::parseResultArchive(const YAML::Node &global_node) {
+  // 18 MiB of raw data stays below a 25 MB limit after base64 encoding
+  ResultArchiveConfig archive{1024 * 1024, 18 * 1024 * 1024,
+                              MZ_COMPRESS_METHOD_DEFLATE,
+                              MZ_COMPRESS_LEVEL_DEFAULT};
+  if (!global_node["result_archive"]) {
+    return archive;
+  }
+
+  const auto &archive_node = global_node["result_archive"];
+  archive.compress_threshold = archive_node["compress_threshold"].as<unsigned long>(
+      archive.compress_threshold);
+  archive.max_attachment_size = archive_node["max_attachment_size"].as<unsigned long>(
+      archive.max_attachment_size);
+  auto method_name =
+      archive_node["compress_method"].as<std::string>("deflate");
+  auto method = Zip::compressMethod(method_name);
+  if (method.has_value()) {
+    archive.compress_method = method.value();
+  } else {
+    syslog(LOG_WARNING,
+           "Config/parseResultArchive: unknown compress_method %s, using "
+           "deflate",
+           method_name.c_str());
+  }
+  archive.compress_level =
+      archive_node["compress_level"].as<int16_t>(archive.compress_level);
+  return archive;
+}
+
+ZipConfig Config::parseZip(const YAML::Node &global_node) {
+  ZipConfig zip{1, 64 * 1024 * 1024, 4UL * 1024 * 1024 * 1024, 10000, 200,
+                300};
+  if (!global_node["zip"]) {
+    return zip;
+  }
+
+  const auto &zip_node = global_node["zip"];
+  zip.threads = zip_node["threads"].as<int>(zip.threads);
+  zip.memory_limit =
+      zip_node["memory_limit"].as<unsigned long>(zip.memory_limit);
+  zip.max_extract_bytes = zip_node["max_extract_bytes"].as<unsigned long>(
+      zip.max_extract_bytes);
+  zip.max_entries =
+      zip_node["max_entries"].as<unsigned long>(zip.max_entries);
+  zip.max_ratio = zip_node["max_ratio"].as<unsigned long>(zip.max_ratio);
+  zip.extract_timeout_sec =
+      zip_node["extract_timeout_sec"].as<int>(zip.extract_timeout_sec);
+  if (zip.extract_timeout_sec < 0)
+    zip.extract_timeout_sec = 0;
+  if (zip.threads < 1)
+    zip.threads = 1;
+  return zip;
+}
+
+BundleCacheConfig Config::parseBundleCache(const YAML::Node &global_node) {
+  BundleCacheConfig cache{true, 2UL * 1024 * 1024 * 1024};
+  if (!global_node["bundle_cache"]) {
+    return cache;
+  }
+
+  const auto &cache_node = global_node["bundle_cache"];
+  cache.enabled = cache_node["enabled"].as<bool>(cache.enabled);
+  cache.max_bytes = cache_node["max_bytes"].as<unsigned long>(cache.max_bytes);
+  return cache;
+}
+
+DigestConfig Config::parseDigest(const YAML::Node &global_node) {
+  DigestConfig digest{false, 300, 50};
+  if (!global_node["digest"]) {
+    return digest;
+  }
+
+  const auto &digest_node = global_node["digest"];
+  digest.enabled = digest_node["enabled"].as<bool>(true);
+  digest.window_sec = digest_node["window_sec"].as<int>(digest.window_sec);
+  digest.max_results = digest_node["max_results"].as<int>(digest.max_results);
+  if (digest.window_sec < 1)
+    digest.window_sec = 1;
+  if (digest.max_results < 1)
+    digest.max_results = 1;
+  return digest;
+}
+
+DedupConfig Config::parseDedup(const YAML::Node &global_node) {
+  DedupConfig dedup{true, 30, 1000000, 0.001};
+  if (!global_node["dedup"]) {
+    return dedup;
+  }
+
+  const auto &dedup_node = global_node["dedup"];
+  dedup.enabled = dedup_node["enabled"].as<bool>(dedup.enabled);
+  dedup.retention_days =
+      dedup_node["retention_days"].as<int>(dedup.retention_days);
+  dedup.max_entries =
+      dedup_node["max_entries"].as<unsigned long>(dedup.max_entries);
+  dedup.false_positive_rate =
+      dedup_node["false_positive_rate"].as<double>(dedup.false_positive_rate);
+  if (dedup.max_entries < 1)
+    dedup.max_entries = 1;
+  if (dedup.false_positive_rate <= 0 || dedup.false_positive_rate >= 1)
+    dedup.false_positive_rate = 0.001;
+  return dedup;
+}
+
+TlsConfig Config::parseTls(const YAML::Node &global_node) {
+  // verification stays opt-in, existing self-signed servers keep working
+  TlsConfig tls{true, false};
+  if (!global_node["tls"]) {
+    return tls;
+  }
+
+  const auto &tls_node = global_node["tls"];
+  tls.shared_context = tls_node["shared_context"].as<bool>(tls.shared_context);
+  tls.verify_peer = tls_node["verify_peer"].as<bool>(tls.verify_peer);
+  return tls;
+}
+
+SessionPoolConfig Config::parseSessionPool(const YAML::Node &global_node) {
+  SessionPoolConfig pool{2, 300, 60};
+  if (!global_node["session_pool"]) {
+    return pool;
+  }
+
+  const auto &pool_node = global_node["session_pool"];
+  pool.max_per_account =
+      pool_node["max_per_account"].as<int>(pool.max_per_account);
+  pool.idle_timeout_sec =
+      pool_node["idle_timeout_sec"].as<int>(pool.idle_timeout_sec);
+  pool.keepalive_interval_sec =
+      pool_node["keepalive_interval_sec"].as<int>(pool.keepalive_interval_sec);
+  if (pool.max_per_account < 1)
+    pool.max_per_account = 1;
+  if (pool.keepalive_interval_sec < 1)
+    pool.keepalive_interval_sec = 60;
+  return pool;
+}
+
+ImapIdleConfig Config::parseImapIdle(const YAML::Node &imap_node) {
+  ImapIdleConfig idle{false, 1500};
+  if (!imap_node["idle"]) {
+    return idle;
+  }
+
+  const auto &idle_node = imap_node["idle"];
+  idle.enabled = idle_node["enabled"].as<bool>(true);
+  idle.refresh_interval_sec =
+      idle_node["refresh_interval_sec"].as<int>(idle.refresh_interval_sec);
+  if (idle.refresh_interval_sec <= 0 || idle.refresh_interval_sec > 1740) {
+    syslog(LOG_WARNING,
+           "Config/parseImapIdle: refresh_interval_sec %d out of range, "
+           "using 1500",
+           idle.refresh_interval_sec);
+    idle.refresh_interval_sec = 1500;
+  }
+  return idle;
+}
+
 mailio::imap::search_condition_t
 Config::parseCondition(const YAML::Node &condition_node) {
   std::string type = condition_node["type"].as<std::string>();
@@ -1,15 +1,22 @@
 #include "daemon.h"
 
+#include <algorithm>
+#include <cstring>
 #include <exception>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <regex>
 #include <syslog.h>
 #include <thread>
+#include <unistd.h>
 
+#include "bundle_cache.h"
 #include "config.h"
+#include "dedup_index.h"
 #include "file_utils.h"
 #include "mail.h"
 #include "mail_to.pb.h"
@@ -20,9 +27,114 @@
 
 namespace remote_agent {
 
+namespace {
+std::list<mail::File> toFileList(const MailTo &info) {
+  std::list<mail::File> file_list;
+  for (const auto &f : info.file_list()) {
+    std::cout << "File: " << f.local_filepath() << " MIME: " << f.mime_type()
+              << std::endl;
+    file_list.push_back(std::make_pair(f.local_filepath(), f.mime_type()));
+  }
+  return file_list;
+}
+
+// A task file inside a zip attachment is published as "<archive>!/<entry>"
+// and read from the archive when it runs; the rest of the bundle is
+// extracted into <archive stem>/ next to it only when a step needs it.
+constexpr char ENTRY_SEPARATOR[] = "!/";
+
+bool isTaskFile(const std::filesystem::path &path) {
+  return path.extension() == ".yaml" || path.extension() == ".yml";
+}
+
+bool splitEntryReference(const std::string &reference, std::string &archive,
+                         std::string &entry) {
+  auto separator = reference.find(ENTRY_SEPARATOR);
+  if (separator == std::string::npos) {
+    return false;
+  }
+  archive = reference.substr(0, separator);
+  entry = reference.substr(separator + std::strlen(ENTRY_SEPARATOR));
+  return true;
+}
+
+bool isPayloadOf(const Step &step, const std::string &entry) {
+  for (const auto &wanted : step.payload) {
+    if (wanted.empty()) {
+      continue;
+    }
+    std::string prefix = wanted.back() == '/' ? wanted : wanted + "/";
+    if (entry == wanted || entry.rfind(prefix, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Extracts the entries a step lists under `payload` before it runs; tasks
+// without any payload list get the whole bundle before their first step.
+std::function<bool(const Step &)> payloadExtractor(const std::string &archive,
+                                                   const Task &task) {
+  std::vector<ZipEntry> entries;
+  Zip zip;
+  auto err = zip.entries(archive, entries);
+  if (err.has_value()) {
+    std::cout << "Zip error: " << err.value().second << std::endl;
+  }
+  bool declared = std::any_of(task.steps.begin(), task.steps.end(),
+                              [](const Step &step) { return !step.payload.empty(); });
+  auto out_dir = std::filesystem::path(archive).parent_path() /
+                 std::filesystem::path(archive).stem();
+  // hashed on the first step that needs a payload, shared by the later ones
+  auto digest = std::make_shared<std::optional<std::string>>();
+  return [archive, out_dir, entries, declared, digest](const Step &step) {
+    std::vector<std::string> wanted;
+    for (const auto &entry : entries) {
+      if (entry.directory || (declared && !isPayloadOf(step, entry.name))) {
+        continue;
+      }
+      // already there from an earlier step or another task of the bundle
+      std::error_code ec;
+      if (std::filesystem::file_size(out_dir / entry.name, ec) == entry.size && !ec) {
+        continue;
+      }
+      wanted.push_back(entry.name);
+    }
+    if (wanted.empty()) {
+      return true;
+    }
+    auto &cache = BundleCache::getInstance();
+    if (cache.enabled() && !digest->has_value()) {
+      *digest = BundleCache::archiveDigest(archive);
+    }
+    std::optional<Error> err;
+    if (cache.enabled() && digest->has_value()) {
+      err = cache.materialize(archive, digest->value(), wanted, out_dir.string());
+    } else {
+      Zip zip(Config::getInstance().getGlobalConfig().zip);
+      err = zip.extract(archive, wanted, out_dir.string());
+    }
+    if (err.has_value()) {
+      std::cout << "Zip error: " << err.value().second << std::endl;
+      return false;
+    }
+    return true;
+  };
+}
+
+double randomUnit() {
+  thread_local std::mt19937 rng{std::random_device{}()};
+  return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+}
+} // namespace
+
 Daemon::Daemon() : _running(false) {
   _mail_enabled =
       (Config::getInstance().getGlobalConfig().check_mail_interval_ms > 0);
+  for (const auto &account : Config::getInstance().getAccounts()) {
+    _mail_enabled = _mail_enabled || account.check_mail_interval_ms > 0 ||
+                    account.imap_idle.enabled;
+  }
   std::cout << "check_mail_interval_ms: "
             << Config::getInstance().getGlobalConfig().check_mail_interval_ms
             << " " << _mail_enabled << std::endl;
@@ -49,9 +161,39 @@ void Daemon::stop() {
   }
 
   _running = false;
+  _mail_timer.stop();
+  if (_mail_workers) {
+    _mail_workers->stop();
+  }
+  if (_mail_processors) {
+    _mail_processors->stop();
+  }
+  // open digests go to the spool, which sends them after a restart
+  if (_mail_digest) {
+    _mail_digest->stop();
+  }
+  if (_mail_spool) {
+    _mail_spool->stop();
+  }
+  for (auto &[name, watcher] : _idle_watchers) {
+    watcher->stop();
+  }
 }
 
 void Daemon::run() {
+  _mail_processors = std::make_unique<ThreadPool>(static_cast<std::size_t>(
+      std::max(Config::getInstance().getGlobalConfig().mail_processors, 1)));
+  _mail_spool = std::make_unique<MailSpool>(
+      Config::getInstance().getGlobalConfig().spool,
+      Config::getInstance().getGlobalConfig().work_dir);
+  _mail_spool->start(
+      [this](const MailTo &info) { return deliverMail(info); });
+  if (Config::getInstance().getGlobalConfig().digest.enabled) {
+    _mail_digest = std::make_unique<MailDigest>(
+        Config::getInstance().getGlobalConfig().digest,
+        Config::getInstance().getGlobalConfig().work_dir,
+        [this](const MailTo &info) { return spoolMail(info); });
+  }
   startPublishService<std::string>();
   // startPublishService<MailInfo>();
   startSubscribeService<std::string>();
@@ -66,30 +208,105 @@ void Daemon::run() {
 
 void Daemon::startMailService() {
   std::cout << __FUNCTION__ << std::endl;
-  _mail_timer.startPeriodic(
-      Config::getInstance().getGlobalConfig().check_mail_interval_ms, [this]() {
-        std::cout << "periodic mail checker" << std::endl;
-        std::unique_lock<std::mutex> lock(_mail_checker_mutex,
-                                          std::try_to_lock);
-        if (!lock.owns_lock()) {
-          return;
-        }
-        // auto account =
-        // Config::getInstance().getAccountByName("gmail_account").value();
-        for (const auto &account : Config::getInstance().getAccounts()) {
-          std::cout << "account name:" << account.name << std::endl;
-          remote_agent::mail::Mail mail(account);
-          auto [out_dir, err] = mail.getByFilter();
-          if (err.has_value()) {
-            std::cout << "Mail error: " << err.value().second << std::endl;
-            continue;
-          }
-          if (out_dir.empty()) {
-            continue;
-          }
+  for (const auto &account : Config::getInstance().getAccounts()) {
+    if (!account.imap_idle.enabled) {
+      continue;
+    }
+    auto watcher = std::make_unique<mail::ImapIdleWatcher>(
+        account, [this](const std::string &out_dir) {
           publish<std::string>(out_dir, TOPIC_MAIL_RECV);
-        }
+        });
+    watcher->start();
+    _idle_watchers[account.name] = std::move(watcher);
+  }
+  int tick_ms = 0;
+  for (const auto &account : Config::getInstance().getAccounts()) {
+    // IDLE accounts are polled while their watcher is not idling: during
+    // reconnects and for good when the server has no IDLE
+    if (account.check_mail_interval_ms <= 0 && !account.imap_idle.enabled) {
+      continue;
+    }
+    const auto &schedule = account.poll_schedule;
+    auto state = std::make_unique<AccountPollState>(
+        std::chrono::milliseconds(schedule.min_interval_ms));
+    // spread the first polls so restarted daemons do not start in lockstep
+    state->next_poll += std::chrono::milliseconds(
+        static_cast<long>(schedule.min_interval_ms * randomUnit()));
+    _poll_states[account.name] = std::move(state);
+    if (tick_ms == 0 || schedule.min_interval_ms < tick_ms) {
+      tick_ms = schedule.min_interval_ms;
+    }
+  }
+  if (tick_ms == 0) {
+    return;
+  }
+  _mail_workers = std::make_unique<ThreadPool>(static_cast<std::size_t>(
+      std::max(Config::getInstance().getGlobalConfig().mail_workers, 1)));
+  _mail_timer.startPeriodic(tick_ms, [this]() {
+    auto now = std::chrono::steady_clock::now();
+    for (const auto &account : Config::getInstance().getAccounts()) {
+      auto poll_state = _poll_states.find(account.name);
+      if (poll_state == _poll_states.end()) {
+        continue;
+      }
+      auto watcher = _idle_watchers.find(account.name);
+      if (watcher != _idle_watchers.end() && watcher->second->isIdling()) {
+        continue;
+      }
+      auto &state = *poll_state->second;
+      if (state.in_flight || now < state.next_poll) {
+        continue;
+      }
+      state.in_flight = true;
+      _mail_workers->submit([this, &account, &state]() {
+        auto outcome = pollAccount(account);
+        state.next_poll = std::chrono::steady_clock::now() +
+                          nextPollDelay(account.poll_schedule, state, outcome);
+        state.in_flight = false;
       });
+    }
+  });
+}
+
+PollOutcome Daemon::pollAccount(const AccountConfig &account) {
+  std::cout << "account name:" << account.name << std::endl;
+  remote_agent::mail::Mail mail(account);
+  auto [out_dirs, err] = mail.getByFilter();
+  // messages stored before an error are already marked as synced
+  for (const auto &out_dir : out_dirs) {
+    publish<std::string>(out_dir, TOPIC_MAIL_RECV);
+  }
+  if (!out_dirs.empty()) {
+    return PollOutcome::HIT;
+  }
+  if (!err.has_value() || err.value().first == ErrorCode::NO_NEW_MAIL) {
+    return PollOutcome::EMPTY;
+  }
+  std::cout << "Mail error: " << err.value().second << std::endl;
+  return PollOutcome::FAILURE;
+}
+
+std::chrono::milliseconds
+Daemon::nextPollDelay(const PollScheduleConfig &schedule,
+                      AccountPollState &state, PollOutcome outcome) {
+  using std::chrono::milliseconds;
+  const milliseconds min_interval(schedule.min_interval_ms);
+  const milliseconds max_interval(schedule.max_interval_ms);
+  if (outcome == PollOutcome::HIT) {
+    // mail tends to arrive in bursts, so look again soon
+    state.interval = min_interval;
+  } else {
+    // empty polls and NETWORK/REJECTION errors both back off
+    auto grown = milliseconds(static_cast<milliseconds::rep>(
+        state.interval.count() * schedule.backoff_factor));
+    if (outcome == PollOutcome::FAILURE) {
+      grown = std::max(grown, min_interval * 2);
+    }
+    state.interval = std::clamp(grown, min_interval, max_interval);
+  }
+  double spread = 1.0 + schedule.jitter * (2.0 * randomUnit() - 1.0);
+  return milliseconds(
+      static_cast<milliseconds::rep>(state.interval.count() * spread));
 }
 
 const std::string Daemon::getSubscriberEndpoint(const std::string &endpoint) {
@@ -135,31 +352,43 @@ void Daemon::initSubscribers() {
 
 void Daemon::processMail(const std::string &mail_dir) {
   std::cout << "mail dir: " << mail_dir << std::endl;
+  // the same mail shows up again after reconnects, in several folders or
+  // with read_only filters
+  auto key = DedupIndex::messageKey(mail_dir);
+  // reserved before anything is published: copies of one mail from two
+  // folders, or from IDLE and the poller, are processed in parallel
+  if (key.has_value() && !DedupIndex::getInstance().reserve(key.value())) {
+    std::cout << "Duplicate mail skipped: " << mail_dir << std::endl;
+    return;
+  }
+  bool processed = true;
   try {
     if (std::filesystem::exists(mail_dir) &&
         std::filesystem::is_directory(mail_dir)) {
       for (const auto &entry : std::filesystem::directory_iterator(mail_dir)) {
         std::cout << entry.path().filename() << std::endl;
         if (entry.path().extension() == ".zip") {
-          auto out_dir = std::filesystem::path(mail_dir) / entry.path().stem();
-          if (std::filesystem::create_directories(out_dir)) {
-            Zip zip;
-            auto err = zip.extract(entry.path().string(), out_dir.string());
-            if (err.has_value()) {
-              std::cout << "Zip error: " << err.value().second << std::endl;
-            } else {
-              for (const auto &file :
-                   std::filesystem::directory_iterator(out_dir)) {
-                std::cout << file.path().filename() << std::endl;
-                if (file.path().extension() == ".yaml" ||
-                    file.path().extension() == ".yml") {
-                  publish<std::string>(file.path().string(), TOPIC_TASK_RECV);
-                }
+          // only the central directory is read here, see processTask
+          Zip zip;
+          std::vector<ZipEntry> entries;
+          auto err = zip.entries(entry.path().string(), entries);
+          if (err.has_value()) {
+            std::cout << "Zip error: " << err.value().second << std::endl;
+            processed = false;
+          } else {
+            for (const auto &zip_entry : entries) {
+              std::cout << zip_entry.name << std::endl;
+              // top level only, as when the whole archive was extracted
+              if (!zip_entry.directory &&
+                  zip_entry.name.find('/') == std::string::npos &&
+                  isTaskFile(zip_entry.name)) {
+                publish<std::string>(entry.path().string() + ENTRY_SEPARATOR +
+                                         zip_entry.name,
+                                     TOPIC_TASK_RECV);
               }
             }
           }
-        } else if (entry.path().extension() == ".yaml" ||
-                   entry.path().extension() == ".yml") {
+        } else if (isTaskFile(entry.path())) {
           publish<std::string>(entry.path().string(), TOPIC_TASK_RECV);
         }
         std::cout << "extension: " << entry.path().extension() << std::endl;
@@ -167,70 +396,196 @@ void Daemon::processMail(const std::string &mail_dir) {
     }
   } catch (const std::filesystem::filesystem_error &e) {
     std::cerr << "Filesystem error: " << e.what() << std::endl;
+    processed = false;
   } catch (const std::exception &e) {
     std::cerr << "Error: " << e.what() << std::endl;
+    processed = false;
+  }
+  if (key.has_value()) {
+    DedupIndex::getInstance().release(key.value(), processed);
   }
 }
 void Daemon::processTask(const std::string &task_file) {
   std::cout << "task file: " << task_file << std::endl;
   TaskParser task_parser;
-  if (!task_parser.parseYaml(task_file)) {
+  std::string archive;
+  std::string entry;
+  const bool bundled = splitEntryReference(task_file, archive, entry);
+  bool parsed;
+  if (bundled) {
+    std::string content;
+    Zip zip(Config::getInstance().getGlobalConfig().zip);
+    auto err = zip.read(archive, entry, content);
+    if (err.has_value()) {
+      std::cout << "Zip error: " << err.value().second << std::endl;
+      return;
+    }
+    parsed = task_parser.parseYamlBuffer(content);
+  } else {
+    parsed = task_parser.parseYaml(task_file);
+  }
+  if (!parsed) {
     std::cout << "Error parsing task file: " << task_parser.getError().value()
               << std::endl;
     return;
   }
   auto task = task_parser.getTask();
   Runner runner;
+  if (bundled) {
+    runner.setBeforeStep(payloadExtractor(archive, task));
+  }
   auto res = runner.execute(task, task_parser.getError());
   std::cout << "Result: " << res << std::endl;
-  MailTo msg_to_send;
-  msg_to_send.set_subject(task.name);
-  msg_to_send.set_body((res == 0) ? "Task completed successfully" : "Task failed");
-  auto* attachment = msg_to_send.add_file_list();
-  attachment->set_local_filepath(runner.getOutputfile());
-  attachment->set_mime_type("text/plain");
-  // MailInfo info;
-  // info.subject = task.name;
-  // info.body = (res == 0) ? "Task completed successfully" : "Task failed";
-  // info.file_list.push_back(make_pair(runner.getOutputfile(), "text/plain"));
-  publish<std::string>(msg_to_send.SerializeAsString(), TOPIC_MAIL_SEND);
+  std::string body = (res == 0) ? "Task completed successfully" : "Task failed";
+  auto parts = packOutput(runner.getOutputfile());
+  for (std::size_t i = 0; i < parts.size(); i++) {
+    MailTo msg_to_send;
+    if (parts.size() == 1) {
+      msg_to_send.set_subject(task.name);
+      msg_to_send.set_body(body);
+    } else {
+      std::string part = std::to_string(i + 1) + "/" + std::to_string(parts.size());
+      msg_to_send.set_subject(task.name + " (" + part + ")");
+      msg_to_send.set_body(body + "\n\nOutput archive part " + part +
+                           ". Save all parts into one directory and open the "
+                           ".zip part to extract it.");
+    }
+    auto* attachment = msg_to_send.add_file_list();
+    attachment->set_local_filepath(parts[i].first);
+    attachment->set_mime_type(parts[i].second);
+    publish<std::string>(msg_to_send.SerializeAsString(), TOPIC_MAIL_SEND);
+  }
+}
+
+std::vector<std::pair<std::string, std::string>>
+Daemon::packOutput(const std::string &output_file) {
+  const auto &archive_config =
+      Config::getInstance().getGlobalConfig().result_archive;
+  std::vector<std::pair<std::string, std::string>> raw{
+      {output_file, "text/plain"}};
+  std::error_code ec;
+  auto size = std::filesystem::file_size(output_file, ec);
+  if (ec || size <= archive_config.compress_threshold) {
+    return raw;
+  }
+
+  std::filesystem::path archive = output_file + ".zip";
+  // parts of an earlier, longer run would be taken for this one's
+  for (const auto &part : Zip::segments(archive.string())) {
+    std::filesystem::remove(part, ec);
+  }
+  Zip zip(Config::getInstance().getGlobalConfig().zip);
+  // minizip writes <name>.z01, <name>.z02, ... and ends with <name>.zip
+  zip.setSegmentSize(archive_config.max_attachment_size);
+  zip.setCompressMethod(archive_config.compress_method);
+  zip.setCompressLevel(archive_config.compress_level);
+  auto err = zip.compress({output_file}, archive.string());
+  if (err.has_value()) {
+    std::cout << "Zip error: " << err.value().second << std::endl;
+    return raw;
+  }
+  std::vector<std::pair<std::string, std::string>> parts;
+  for (const auto &part : Zip::segments(archive.string())) {
+    parts.emplace_back(part, part == archive.string() ? "application/zip"
+                                                      : "application/octet-stream");
+  }
+  std::cout << "Output " << output_file << " packed into " << parts.size()
+            << " part(s), " << size << " bytes raw" << std::endl;
+  return parts;
 }
 
 void Daemon::sendMail(const MailTo& info) {
-  std::cout << "Sending mail" << std::endl;
-  std::cout << "Subject: " << info.subject() << std::endl;
-  std::cout << "Body: " << info.body() << std::endl;
-  std::cout << "File: " << info.file_list(0).local_filepath() << std::endl;
-  std::list<mail::File> file_list;
-  bool found = false;
-  for (const auto &f : info.file_list()) {
-    std::shared_ptr<std::ifstream> ifs = std::make_shared<std::ifstream>(f.local_filepath(), std::ios::binary);
-    std::cout << "File: " << f.local_filepath() <<" MIME: " << f.mime_type() << std::endl; 
-    mail::File file = std::make_pair(f.local_filepath(), f.mime_type());
-    file_list.push_back(file);
+  if (_mail_digest) {
+    _mail_digest->add(info);
+    return;
   }
+  spoolMail(info);
+}
+
+bool Daemon::spoolMail(const MailTo& info) {
+  std::cout << "Spooling mail: " << info.subject() << std::endl;
+  std::vector<const AccountConfig *> targets;
   for (const auto &account : Config::getInstance().getAccounts()) {
     if (info.has_account_name() &&
         info.account_name() != account.name) {
       continue;
     }
-    found = true;
-    remote_agent::mail::Mail mail(account);
+    targets.push_back(&account);
+  }
+  if (targets.empty()) {
+    std::cout << "No account found for sending mail (" << info.account_name() << ")" << std::endl;
+    return false;
+  }
 
-    if (file_list.empty()) {
-      auto err = mail.send(info.subject(), info.body());
-      if (err.has_value()) {
-        std::cout << "Mail error: " << err.value().second << std::endl;
-      }
+  // Encode body and attachments once; each account only adds its own
+  // addressing headers when the spool delivers its copy.
+  MailTo shared = info;
+  std::string content_file;
+  if (targets.size() > 1) {
+    static std::atomic<unsigned long> sequence{0};
+    auto content_dir = std::filesystem::path(
+        Config::getInstance().getGlobalConfig().work_dir) / ".fanout";
+    std::error_code ec;
+    std::filesystem::create_directories(content_dir, ec);
+    content_file =
+        (content_dir / (std::to_string(::getpid()) + "_" +
+                        std::to_string(sequence++) + ".eml")).string();
+    remote_agent::mail::Mail mail(*targets.front());
+    auto err = mail.encodeContent(info.body(), toFileList(info), content_file);
+    if (err.has_value()) {
+      std::cout << "Encode error: " << err.value().second << std::endl;
+      std::filesystem::remove(content_file, ec);
+      content_file.clear();
     } else {
-      auto err = mail.send(info.subject(), info.body(), file_list);
-      if (err.has_value()) {
-        std::cout << "Mail error: " << err.value().second << std::endl;
-      }
+      shared.set_content_file(content_file);
+      shared.clear_file_list();
     }
   }
-  if (!found) {
-    std::cout << "No account found for sending mail (" << info.account_name() << ")" << std::endl;
+  // one spool job per account, so a slow or failing server only delays
+  // its own copy, and copies go out in parallel on the spool workers
+  bool spooled = true;
+  for (const auto *account : targets) {
+    MailTo job = shared;
+    job.set_account_name(account->name);
+    auto err = _mail_spool->enqueue(job);
+    if (err.has_value()) {
+      std::cout << "Spool error: " << err.value().second << std::endl;
+      spooled = false;
+    }
+  }
+  // a job that could not be queued holds no copy of its own, so the
+  // shared content stays on disk for it
+  if (!content_file.empty()) {
+    if (spooled) {
+      std::error_code ec;
+      std::filesystem::remove(content_file, ec);
+    } else {
+      std::cout << "Keeping " << content_file << std::endl;
+    }
+  }
+  return spooled;
+}
+
+std::optional<Error> Daemon::deliverMail(const MailTo& info) {
+  auto account = Config::getInstance().getAccountByName(info.account_name());
+  if (!account.has_value()) {
+    return std::make_pair(ErrorCode::BAD_CONFIG,
+                          "No account found for sending mail (" + info.account_name() + ")");
+  }
+  std::cout << "Sending mail via " << account->name << ": " << info.subject() << std::endl;
+  remote_agent::mail::Mail mail(account.value());
+  std::optional<Error> err;
+  auto file_list = toFileList(info);
+  if (info.has_content_file()) {
+    err = mail.sendContent(info.subject(), info.content_file());
+  } else if (file_list.empty()) {
+    err = mail.send(info.subject(), info.body());
+  } else {
+    err = mail.send(info.subject(), info.body(), file_list);
+  }
+  if (err.has_value()) {
+    std::cout << "Mail error: " << err.value().second << std::endl;
   }
+  return err;
 }
 } // namespace remote_agent
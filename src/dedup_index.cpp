@@ -0,0 +1,344 @@
+#include "dedup_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+namespace remote_agent {
+
+    namespace {
+        // journal entries merged into the sorted index at once
+        constexpr std::size_t COMPACT_THRESHOLD = 65536;
+        constexpr int64_t SECONDS_PER_DAY = 86400;
+
+        uint64_t mix(uint64_t key) {
+            // splitmix64 finalizer
+            key ^= key >> 30;
+            key *= 0xbf58476d1ce4e5b9ULL;
+            key ^= key >> 27;
+            key *= 0x94d049bb133111ebULL;
+            key ^= key >> 31;
+            return key;
+        }
+
+        uint64_t digestKey(const unsigned char* digest) {
+            uint64_t key = 0;
+            for (int i = 0; i < 8; i++)
+                key = (key << 8) | digest[i];
+            return key;
+        }
+
+        uint64_t sha256Key(const std::string& data) {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+            EVP_Digest(data.data(), data.size(), digest, &length, EVP_sha256(), nullptr);
+            return digestKey(digest);
+        }
+
+        std::string trim(const std::string& str) {
+            auto first = str.find_first_not_of(" \t\r\n");
+            if (first == std::string::npos)
+                return "";
+            auto last = str.find_last_not_of(" \t\r\n");
+            return str.substr(first, last - first + 1);
+        }
+
+        bool startsWithNoCase(const std::string& str, const std::string& prefix) {
+            if (str.size() < prefix.size())
+                return false;
+            for (std::size_t i = 0; i < prefix.size(); i++)
+                if (std::tolower(static_cast<unsigned char>(str[i])) != prefix[i])
+                    return false;
+            return true;
+        }
+    }
+
+    BloomFilter::BloomFilter(unsigned long capacity, double false_positive_rate) {
+        const double ln2 = std::log(2.0);
+        double bits = -static_cast<double>(std::max(capacity, 1UL)) * std::log(false_positive_rate) / (ln2 * ln2);
+        _bit_count = std::max<uint64_t>(static_cast<uint64_t>(std::ceil(bits)), 64);
+        _hashes = std::max(1U, static_cast<unsigned int>(std::round(bits / std::max(capacity, 1UL) * ln2)));
+        _bits.assign((_bit_count + 63) / 64, 0);
+    }
+
+    void BloomFilter::add(uint64_t key) {
+        // double hashing: bit i = h1 + i * h2
+        uint64_t h1 = mix(key);
+        uint64_t h2 = mix(h1) | 1;
+        for (unsigned int i = 0; i < _hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % _bit_count;
+            _bits[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    bool BloomFilter::mayContain(uint64_t key) const {
+        uint64_t h1 = mix(key);
+        uint64_t h2 = mix(h1) | 1;
+        for (unsigned int i = 0; i < _hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % _bit_count;
+            if ((_bits[bit / 64] & (1ULL << (bit % 64))) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    void BloomFilter::clear() {
+        std::fill(_bits.begin(), _bits.end(), 0);
+    }
+
+    DedupIndex& DedupIndex::getInstance() {
+        static DedupIndex instance;
+        return instance;
+    }
+
+    DedupIndex::DedupIndex()
+        : _config{Config::getInstance().getGlobalConfig().dedup},
+          _index_path{std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) / ".dedup" / "index.bin"},
+          _journal_path{std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) / ".dedup" / "journal.bin"},
+          _index_fd{-1}, _index_records{0},
+          _filter{_config.enabled ? _config.max_entries : 1, _config.false_positive_rate} {
+        if (_config.enabled)
+            load();
+    }
+
+    DedupIndex::~DedupIndex() {
+        closeIndex();
+    }
+
+    std::optional<uint64_t> DedupIndex::messageKey(const std::string& mail_dir) {
+        std::ifstream fis(std::filesystem::path(mail_dir) / "mail.txt", std::ios::binary);
+        if (!fis.is_open())
+            return std::nullopt;
+
+        // header lines end at the first empty line; folded lines start with WSP
+        std::string line;
+        std::string message_id;
+        bool in_message_id = false;
+        while (std::getline(fis, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                break;
+            if (in_message_id && (line[0] == ' ' || line[0] == '\t')) {
+                message_id += line;
+                continue;
+            }
+            in_message_id = startsWithNoCase(line, "message-id:");
+            if (in_message_id)
+                message_id = line.substr(11);
+        }
+        message_id = trim(message_id);
+        if (!message_id.empty())
+            return sha256Key("message-id:" + message_id);
+
+        // messages can be huge, hash the file in pieces
+        fis.clear();
+        fis.seekg(0);
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+        EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+        std::vector<char> buffer(64 * 1024);
+        while (fis.read(buffer.data(), buffer.size()) || fis.gcount() > 0)
+            EVP_DigestUpdate(ctx.get(), buffer.data(), fis.gcount());
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(ctx.get(), digest, &length);
+        return digestKey(digest);
+    }
+
+    bool DedupIndex::reserve(uint64_t key) {
+        if (!_config.enabled)
+            return true;
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (seen(key, std::time(nullptr)) || _reserved.count(key) != 0)
+            return false;
+        _reserved.insert(key);
+        return true;
+    }
+
+    void DedupIndex::release(uint64_t key, bool processed) {
+        if (!_config.enabled)
+            return;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _reserved.erase(key);
+        if (processed)
+            append(key, std::time(nullptr));
+    }
+
+    bool DedupIndex::insert(uint64_t key) {
+        if (!_config.enabled)
+            return true;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto now = std::time(nullptr);
+        if (seen(key, now))
+            return false;
+        append(key, now);
+        return true;
+    }
+
+    bool DedupIndex::seen(uint64_t key, std::time_t now) const {
+        if (!_filter.mayContain(key))
+            return false;
+        auto record = find(key);
+        return record.has_value() && !expired(record.value(), now);
+    }
+
+    void DedupIndex::append(uint64_t key, std::time_t now) {
+        Record record{key, static_cast<int64_t>(now)};
+        std::ofstream fos(_journal_path, std::ios::binary | std::ios::app);
+        if (fos.is_open())
+            fos.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        else
+            syslog(LOG_ERR, "DedupIndex/insert: cannot open %s", _journal_path.c_str());
+        fos.close();
+        _journal[key] = record.seen_at;
+        _filter.add(key);
+        if (_journal.size() >= COMPACT_THRESHOLD)
+            compactLocked();
+    }
+
+    std::optional<Error> DedupIndex::compact() {
+        if (!_config.enabled)
+            return std::nullopt;
+        std::lock_guard<std::mutex> lock(_mutex);
+        return compactLocked();
+    }
+
+    void DedupIndex::load() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        try {
+            std::filesystem::create_directories(std::filesystem::path(_index_path).parent_path());
+        }
+        catch (const std::filesystem::filesystem_error& exc) {
+            syslog(LOG_ERR, "DedupIndex/load: %s", exc.what());
+            return;
+        }
+
+        std::ifstream index(_index_path, std::ios::binary);
+        Record record;
+        while (index.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            _filter.add(record.key);
+            _index_records++;
+        }
+        index.close();
+        if (_index_records > 0)
+            _index_fd = ::open(_index_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        std::ifstream journal(_journal_path, std::ios::binary);
+        while (journal.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            _journal[record.key] = std::max(_journal[record.key], record.seen_at);
+            _filter.add(record.key);
+        }
+        journal.close();
+        syslog(LOG_INFO, "DedupIndex/load: %lu indexed, %lu journaled", static_cast<unsigned long>(_index_records),
+               static_cast<unsigned long>(_journal.size()));
+        // startup is also when the retention window gets applied
+        compactLocked();
+    }
+
+    std::optional<Error> DedupIndex::compactLocked() {
+        auto now = std::time(nullptr);
+        std::vector<Record> records;
+        records.reserve(_index_records + _journal.size());
+        std::ifstream index(_index_path, std::ios::binary);
+        Record record;
+        while (index.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            auto journaled = _journal.find(record.key);
+            if (journaled != _journal.end())
+                continue;
+            if (!expired(record, now))
+                records.push_back(record);
+        }
+        index.close();
+        for (const auto& [key, seen_at] : _journal) {
+            if (!expired(Record{key, seen_at}, now))
+                records.push_back(Record{key, seen_at});
+        }
+
+        if (records.size() > _config.max_entries) {
+            // keep the newest entries only
+            std::nth_element(records.begin(), records.begin() + _config.max_entries, records.end(),
+                             [](const Record& a, const Record& b) { return a.seen_at > b.seen_at; });
+            records.resize(_config.max_entries);
+        }
+        std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.key < b.key; });
+
+        std::string tmp_path = _index_path + ".tmp";
+        std::ofstream fos(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!fos.is_open()) {
+            syslog(LOG_ERR, "DedupIndex/compact: cannot open %s", tmp_path.c_str());
+            return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + tmp_path);
+        }
+        fos.write(reinterpret_cast<const char*>(records.data()),
+                  static_cast<std::streamsize>(records.size() * sizeof(Record)));
+        fos.close();
+        if (!fos) {
+            syslog(LOG_ERR, "DedupIndex/compact: writing %s failed", tmp_path.c_str());
+            return std::make_pair(ErrorCode::FILE_CLOSE_FAILED, "writing " + tmp_path + " failed");
+        }
+
+        closeIndex();
+        try {
+            std::filesystem::rename(tmp_path, _index_path);
+            std::ofstream(_journal_path, std::ios::binary | std::ios::trunc).close();
+        }
+        catch (const std::filesystem::filesystem_error& exc) {
+            syslog(LOG_ERR, "DedupIndex/compact: %s", exc.what());
+            return std::make_pair(ErrorCode::FILE_CREATE_FAILED, exc.what());
+        }
+        _journal.clear();
+        _index_records = records.size();
+        _index_fd = ::open(_index_path.c_str(), O_RDONLY | O_CLOEXEC);
+        _filter.clear();
+        for (const auto& item : records)
+            _filter.add(item.key);
+        return std::nullopt;
+    }
+
+    std::optional<DedupIndex::Record> DedupIndex::find(uint64_t key) const {
+        auto journaled = _journal.find(key);
+        if (journaled != _journal.end())
+            return Record{key, journaled->second};
+        return findOnDisk(key);
+    }
+
+    std::optional<DedupIndex::Record> DedupIndex::findOnDisk(uint64_t key) const {
+        if (_index_fd < 0)
+            return std::nullopt;
+        uint64_t low = 0;
+        uint64_t high = _index_records;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            Record record;
+            if (::pread(_index_fd, &record, sizeof(record), static_cast<off_t>(middle * sizeof(Record))) !=
+                static_cast<ssize_t>(sizeof(record)))
+                return std::nullopt;
+            if (record.key == key)
+                return record;
+            if (record.key < key)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return std::nullopt;
+    }
+
+    bool DedupIndex::expired(const Record& record, std::time_t now) const {
+        return _config.retention_days > 0 &&
+               static_cast<int64_t>(now) - record.seen_at > _config.retention_days * SECONDS_PER_DAY;
+    }
+
+    void DedupIndex::closeIndex() {
+        if (_index_fd >= 0)
+            ::close(_index_fd);
+        _index_fd = -1;
+    }
+};
@@ -0,0 +1,180 @@
+#include "deflate_dialog.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <syslog.h>
+
+#include <boost/asio/write.hpp>
+
+namespace remote_agent::mail {
+
+    namespace {
+        constexpr std::size_t BUFFER_SIZE = 16 * 1024;
+        // negative window bits select raw deflate without the zlib wrapper
+        constexpr int WINDOW_BITS = -15;
+    }
+
+    std::atomic<unsigned long long> DeflateDialog::_total_plain_in{0};
+    std::atomic<unsigned long long> DeflateDialog::_total_wire_in{0};
+    std::atomic<unsigned long long> DeflateDialog::_total_plain_out{0};
+    std::atomic<unsigned long long> DeflateDialog::_total_wire_out{0};
+
+    DeflateDialog::DeflateDialog(const mailio::dialog& other, std::shared_ptr<TlsDialog> tls)
+        : mailio::dialog(other), _tls{std::move(tls)}, _deflate{}, _inflate{}, _in(BUFFER_SIZE),
+          _out(BUFFER_SIZE), _pos{0}, _inflate_pending{false}, _counters{0, 0, 0, 0} {
+        if (deflateInit2(&_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw mailio::dialog_error("Compression failure.", "deflateInit2");
+        if (inflateInit2(&_inflate, WINDOW_BITS) != Z_OK) {
+            deflateEnd(&_deflate);
+            throw mailio::dialog_error("Compression failure.", "inflateInit2");
+        }
+    }
+
+    DeflateDialog::~DeflateDialog() {
+        auto ratio = [](unsigned long long plain, unsigned long long wire) {
+            return plain == 0 ? 0.0 : 100.0 * wire / plain;
+        };
+        syslog(LOG_INFO,
+               "DeflateDialog: received %llu octets as %llu (%.0f%%), sent %llu as %llu (%.0f%%); "
+               "process total received %llu as %llu, sent %llu as %llu",
+               _counters.plain_in, _counters.wire_in, ratio(_counters.plain_in, _counters.wire_in),
+               _counters.plain_out, _counters.wire_out, ratio(_counters.plain_out, _counters.wire_out),
+               _total_plain_in.load(), _total_wire_in.load(), _total_plain_out.load(), _total_wire_out.load());
+        deflateEnd(&_deflate);
+        inflateEnd(&_inflate);
+    }
+
+    void DeflateDialog::send(const std::string& line) {
+        std::string data = line + "\r\n";
+        _deflate.next_in = reinterpret_cast<Bytef*>(&data[0]);
+        _deflate.avail_in = static_cast<uInt>(data.size());
+        do {
+            _deflate.next_out = reinterpret_cast<Bytef*>(_out.data());
+            _deflate.avail_out = static_cast<uInt>(_out.size());
+            if (deflate(&_deflate, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                throw mailio::dialog_error("Network sending error.", "deflate failure");
+            writeWire(_out.data(), _out.size() - _deflate.avail_out);
+        } while (_deflate.avail_out == 0);
+        _counters.plain_out += data.size();
+        _total_plain_out += data.size();
+    }
+
+    std::string DeflateDialog::receive(bool raw) {
+        // same line semantics as mailio::dialog: the line feed is dropped,
+        // the carriage return only when not raw
+        fill();
+        auto eol = _plain.find('\n', _pos);
+        std::string line = _plain.substr(_pos, eol - _pos);
+        _pos = eol + 1;
+        if (!raw && !line.empty() && line.back() == '\r')
+            line.pop_back();
+        return line;
+    }
+
+    bool DeflateDialog::buffered() const {
+        return _plain.find('\n', _pos) != std::string::npos || _inflate.avail_in > 0 || _inflate_pending ||
+               (_tls && _tls->pending());
+    }
+
+    DeflateDialog::Counters DeflateDialog::totals() {
+        return Counters{_total_plain_in.load(), _total_wire_in.load(), _total_plain_out.load(),
+                        _total_wire_out.load()};
+    }
+
+    void DeflateDialog::logTotals() {
+        static std::atomic<unsigned long long> logged{0};
+        auto counters = totals();
+        unsigned long long octets = counters.wire_in + counters.wire_out;
+        if (octets == 0 || logged.exchange(octets) == octets)
+            return;
+        auto ratio = [](unsigned long long plain, unsigned long long wire) {
+            return plain == 0 ? 0.0 : 100.0 * wire / plain;
+        };
+        syslog(LOG_INFO, "DeflateDialog: process total received %llu octets as %llu (%.0f%%), sent %llu as %llu (%.0f%%)",
+               counters.plain_in, counters.wire_in, ratio(counters.plain_in, counters.wire_in),
+               counters.plain_out, counters.wire_out, ratio(counters.plain_out, counters.wire_out));
+    }
+
+    void DeflateDialog::fill() {
+        std::size_t searched = _pos;
+        if (_plain.find('\n', searched) != std::string::npos)
+            return;
+        _plain.erase(0, _pos);
+        _pos = 0;
+        searched = 0;
+        char inflated[BUFFER_SIZE];
+        while (true) {
+            // zlib may still hold output from the last input, read the wire only after that
+            if (_inflate.avail_in == 0 && !_inflate_pending) {
+                std::size_t size = readWire(_in.data(), _in.size());
+                _inflate.next_in = reinterpret_cast<Bytef*>(_in.data());
+                _inflate.avail_in = static_cast<uInt>(size);
+                _counters.wire_in += size;
+                _total_wire_in += size;
+            }
+            _inflate.next_out = reinterpret_cast<Bytef*>(inflated);
+            _inflate.avail_out = sizeof(inflated);
+            int rc = inflate(&_inflate, Z_SYNC_FLUSH);
+            if (rc == Z_STREAM_END)
+                throw mailio::dialog_error("Network receiving error.", "compressed stream ended");
+            if (rc != Z_OK && rc != Z_BUF_ERROR)
+                throw mailio::dialog_error("Network receiving error.", _inflate.msg != nullptr ? _inflate.msg : "inflate failure");
+            _inflate_pending = _inflate.avail_out == 0;
+            std::size_t size = sizeof(inflated) - _inflate.avail_out;
+            _plain.append(inflated, size);
+            _counters.plain_in += size;
+            _total_plain_in += size;
+            if (_plain.find('\n', searched) != std::string::npos)
+                return;
+            searched = _plain.size();
+        }
+    }
+
+    void DeflateDialog::writeWire(const char* data, std::size_t size) {
+        if (size == 0)
+            return;
+        try {
+            if (_tls)
+                boost::asio::write(_tls->stream(), boost::asio::buffer(data, size));
+            else
+                boost::asio::write(*socket_, boost::asio::buffer(data, size));
+        }
+        catch (const boost::system::system_error& exc) {
+            throw mailio::dialog_error("Network sending error.", exc.what());
+        }
+        _counters.wire_out += size;
+        _total_wire_out += size;
+    }
+
+    std::size_t DeflateDialog::readWire(char* data, std::size_t size) {
+        waitReadable();
+        try {
+            if (_tls)
+                return _tls->stream().read_some(boost::asio::buffer(data, size));
+            return socket_->read_some(boost::asio::buffer(data, size));
+        }
+        catch (const boost::system::system_error& exc) {
+            throw mailio::dialog_error("Network receiving error.", exc.what());
+        }
+    }
+
+    void DeflateDialog::waitReadable() {
+        // A plain poll() on the socket instead of mailio's shared io_context,
+        // which other sessions run on their own threads.
+        if (timeout_.count() == 0)
+            return;
+        if (_tls && _tls->pending())
+            return;
+        pollfd fd{socket_->native_handle(), POLLIN, 0};
+        while (true) {
+            int rc = ::poll(&fd, 1, static_cast<int>(timeout_.count()));
+            if (rc > 0)
+                return;
+            if (rc == 0)
+                throw mailio::dialog_error("Network receiving error.", "timeout");
+            if (errno != EINTR)
+                throw mailio::dialog_error("Network receiving error.", std::strerror(errno));
+        }
+    }
+};
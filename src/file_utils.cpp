@@ -1,20 +1,318 @@
 #include "file_utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <sys/syslog.h>
 #include <syslog.h>
+#include <unordered_map>
 #include <utility>
 
+#include <zlib.h>
+
 #include "config.h"
+#include "thread_pool.h"
 
 namespace remote_agent {
+  namespace {
+    using Reader = std::unique_ptr<void, void (*)(void *)>;
+
+    void deleteReader(void *reader) {
+      mz_zip_reader_delete(&reader);
+    }
+
+    std::pair<Reader, std::optional<Error>> openReader(const std::string& zip_file, const char *caller) {
+      Reader reader(mz_zip_reader_create(), deleteReader);
+      if (!reader.get()) {
+        syslog(LOG_ERR, "Zip/%s: memory error in mz_zip_reader_create", caller);
+        return std::make_pair(std::move(reader), std::make_pair(ErrorCode::MEMORY_ERROR, std::string("Memory error: mz_zip_reader_create")));
+      }
+      int32_t res = mz_zip_reader_open_file(reader.get(), zip_file.c_str());
+      if (res != MZ_OK) {
+        syslog(LOG_ERR, "Zip/%s: error %d opening archive %s for reading", caller, res, zip_file.c_str());
+        return std::make_pair(std::move(reader), std::make_pair(ErrorCode::FILE_OPEN_FAILED, "Error "+ std::to_string(res) + " opening archive " + zip_file + " for reading"));
+      }
+      return std::make_pair(std::move(reader), std::nullopt);
+    }
+
+    // entries inflating to at most this much are never refused for their ratio
+    constexpr uint64_t RATIO_FLOOR = 1024 * 1024;
+
+    // Shared by the workers of one extraction.
+    struct ExtractBudget {
+      uint64_t max_bytes;
+      std::chrono::steady_clock::time_point deadline;
+      std::atomic<uint64_t> total;
+      const std::atomic_bool *failed;
+    };
+
+    // Output of one entry, fed chunk by chunk by mz_zip_reader_entry_save.
+    struct EntrySink {
+      std::ofstream out;
+      std::string *link;          // Collects a symlink target instead of out
+      ExtractBudget *budget;
+      uint64_t allowed;           // Ratio bound of the entry, 0 = unlimited
+      uint64_t written;
+      std::string violation;
+    };
+
+    int32_t writeEntry(void *stream, const void *buf, int32_t size) {
+      auto *sink = static_cast<EntrySink *>(stream);
+      ExtractBudget& budget = *sink->budget;
+      // another worker failed, stop as well
+      if (*budget.failed)
+        return MZ_WRITE_ERROR;
+      sink->written += size;
+      uint64_t total = budget.total += size;
+      if (budget.max_bytes > 0 && total > budget.max_bytes) {
+        sink->violation = "takes the extraction past " + std::to_string(budget.max_bytes) + " bytes";
+        return MZ_WRITE_ERROR;
+      }
+      if (sink->allowed > 0 && sink->written > sink->allowed) {
+        sink->violation = "inflates past " + std::to_string(sink->allowed) + " bytes, over the ratio limit";
+        return MZ_WRITE_ERROR;
+      }
+      if (std::chrono::steady_clock::now() > budget.deadline) {
+        sink->violation = "was not done before the extraction timed out";
+        return MZ_WRITE_ERROR;
+      }
+      if (sink->link != nullptr) {
+        sink->link->append(static_cast<const char *>(buf), size);
+        return size;
+      }
+      sink->out.write(static_cast<const char *>(buf), size);
+      return sink->out ? size : MZ_WRITE_ERROR;
+    }
+
+    // mz_zip_reader_entry_save_file with the budget checked on every chunk;
+    // refused is set to why the entry was stopped, after "Entry <name> ".
+    int32_t saveEntry(void *reader, const mz_zip_file *info, const std::filesystem::path& target,
+                      const std::filesystem::path& destination_dir, ExtractBudget& budget, uint64_t max_ratio,
+                      std::optional<Error>& refused) {
+      const bool symlink =
+          mz_zip_attrib_is_symlink(info->external_fa, MZ_HOST_SYSTEM(info->version_madeby)) == MZ_OK;
+      // the content of a symlink is its target, inflated under the same checks
+      std::string link;
+      EntrySink sink;
+      sink.link = symlink ? &link : nullptr;
+      if (!symlink) {
+        sink.out.open(target, std::ios::binary | std::ios::trunc);
+        if (!sink.out.is_open())
+          return MZ_OPEN_ERROR;
+      }
+      sink.budget = &budget;
+      sink.written = 0;
+      const uint64_t compressed = static_cast<uint64_t>(info->compressed_size);
+      sink.allowed = max_ratio == 0 || compressed > UINT64_MAX / max_ratio ? 0
+                     : std::max(RATIO_FLOOR, compressed * max_ratio);
+      int32_t res = mz_zip_reader_entry_save(reader, &sink, writeEntry);
+      if (!sink.violation.empty())
+        refused = std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, sink.violation);
+      if (symlink) {
+        if (res != MZ_OK)
+          return res;
+        // links may only point inside, so nothing written through one
+        // later, by any worker, can leave the destination
+        if (!isWithinDirectory(target.parent_path() / link, destination_dir)) {
+          refused = std::make_pair(ErrorCode::UNARCHIVE_FAILED, "links outside the destination to " + link);
+          return MZ_WRITE_ERROR;
+        }
+        std::error_code ec;
+        std::filesystem::remove(target, ec);
+        std::filesystem::create_symlink(link, target, ec);
+        return ec ? MZ_WRITE_ERROR : MZ_OK;
+      }
+      sink.out.close();
+      if (res == MZ_OK && sink.out.fail())
+        res = MZ_WRITE_ERROR;
+      if (res != MZ_OK)
+        return res;
+      mz_os_set_file_date(target.c_str(), info->modified_date, info->accessed_date, info->creation_date);
+      uint32_t attrib = 0;
+      if (mz_zip_attrib_convert(MZ_HOST_SYSTEM(info->version_madeby), info->external_fa,
+                                MZ_VERSION_MADEBY_HOST_SYSTEM, &attrib) == MZ_OK)
+        mz_os_set_file_attribs(target.c_str(), attrib);
+      return MZ_OK;
+    }
+
+    struct CompressJob {
+      std::string path;
+      std::string name;           // Name inside the archive
+      uint64_t size;
+    };
+
+    struct Deflated {
+      std::string data;           // Raw deflate stream
+      uint64_t size;
+      uint32_t crc;
+      std::optional<Error> error;
+    };
+
+    // The files compress() would add, in archive order; names follow
+    // mz_zip_writer_add_path: the file name, or the path with include_path,
+    // and entries below a directory start with the directory name.
+    std::vector<CompressJob> collectFiles(const std::vector<std::string>& file_list, bool include_path,
+                                          bool recursive) {
+      std::vector<CompressJob> jobs;
+      for (const auto& item : file_list) {
+        std::filesystem::path path = std::filesystem::path(item).lexically_normal();
+        if (path.filename().empty())
+          path = path.parent_path();
+        std::filesystem::path base = include_path ? path.relative_path() : path.filename();
+        std::error_code ec;
+        if (std::filesystem::is_regular_file(path, ec)) {
+          jobs.push_back(CompressJob{path.string(), base.generic_string(), std::filesystem::file_size(path, ec)});
+          continue;
+        }
+        if (!std::filesystem::is_directory(path, ec)) {
+          syslog(LOG_ERR, "Zip/compress: cannot add %s to archive", item.c_str());
+          continue;
+        }
+        std::vector<CompressJob> files;
+        auto add = [&](const std::filesystem::directory_entry& entry) {
+          if (entry.is_regular_file(ec))
+            files.push_back(CompressJob{entry.path().string(),
+                                        (base / entry.path().lexically_relative(path)).generic_string(),
+                                        entry.file_size(ec)});
+        };
+        if (recursive) {
+          for (const auto& entry : std::filesystem::recursive_directory_iterator(path, ec))
+            add(entry);
+        } else {
+          for (const auto& entry : std::filesystem::directory_iterator(path, ec))
+            add(entry);
+        }
+        // directory order is not stable, the archive has to be
+        std::sort(files.begin(), files.end(),
+                  [](const CompressJob& a, const CompressJob& b) { return a.name < b.name; });
+        jobs.insert(jobs.end(), files.begin(), files.end());
+      }
+      return jobs;
+    }
+
+    Deflated deflateFile(const std::string& path, int level) {
+      Deflated result{std::string(), 0, 0, std::nullopt};
+      std::ifstream in(path, std::ios::binary);
+      if (!in.is_open()) {
+        result.error = std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + path);
+        return result;
+      }
+      z_stream stream{};
+      if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        result.error = std::make_pair(ErrorCode::MEMORY_ERROR, std::string("Memory error: deflateInit2"));
+        return result;
+      }
+      std::vector<char> chunk(256 * 1024);
+      std::size_t used = 0;
+      int flush = Z_NO_FLUSH;
+      uLong crc = crc32(0L, Z_NULL, 0);
+      while (flush != Z_FINISH) {
+        in.read(chunk.data(), chunk.size());
+        std::size_t got = static_cast<std::size_t>(in.gcount());
+        if (in.bad()) {
+          result.error = std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot read " + path);
+          break;
+        }
+        flush = in.eof() ? Z_FINISH : Z_NO_FLUSH;
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(chunk.data()), static_cast<uInt>(got));
+        result.size += got;
+        stream.next_in = reinterpret_cast<Bytef*>(chunk.data());
+        stream.avail_in = static_cast<uInt>(got);
+        do {
+          if (result.data.size() - used < chunk.size())
+            result.data.resize(result.data.size() + std::max<std::size_t>(chunk.size(), result.data.size() / 2));
+          stream.next_out = reinterpret_cast<Bytef*>(&result.data[used]);
+          stream.avail_out = static_cast<uInt>(result.data.size() - used);
+          deflate(&stream, flush);
+          used = result.data.size() - stream.avail_out;
+        } while (stream.avail_out == 0 || (flush == Z_FINISH && stream.avail_in != 0));
+      }
+      deflateEnd(&stream);
+      result.data.resize(used);
+      result.crc = static_cast<uint32_t>(crc);
+      return result;
+    }
+
+    // Adds data that is already deflated, the counterpart of what
+    // mz_zip_writer_add_file does for a file it compresses itself.
+    int32_t writeRawEntry(void *writer, const CompressJob& job, const Deflated& deflated, int16_t level) {
+      void *zip_handle = nullptr;
+      mz_zip_writer_get_zip_handle(writer, &zip_handle);
+      mz_zip_file file_info{};
+      file_info.version_madeby = MZ_VERSION_MADEBY;
+      file_info.compression_method = MZ_COMPRESS_METHOD_DEFLATE;
+      file_info.filename = job.name.c_str();
+      file_info.uncompressed_size = static_cast<int64_t>(deflated.size);
+      file_info.compressed_size = static_cast<int64_t>(deflated.data.size());
+      file_info.flag = MZ_ZIP_FLAG_UTF8;
+      mz_os_get_file_date(job.path.c_str(), &file_info.modified_date, &file_info.accessed_date,
+                          &file_info.creation_date);
+      uint32_t src_attrib = 0;
+      uint32_t target_attrib = 0;
+      mz_os_get_file_attribs(job.path.c_str(), &src_attrib);
+      // high bytes are the unix mode, the low byte DOS attributes
+      if (mz_zip_attrib_convert(MZ_HOST_SYSTEM(file_info.version_madeby), src_attrib, MZ_HOST_SYSTEM_MSDOS,
+                                &target_attrib) == MZ_OK)
+        file_info.external_fa = target_attrib;
+      file_info.external_fa |= (src_attrib << 16);
+
+      int32_t res = mz_zip_entry_write_open(zip_handle, &file_info, level, 1, nullptr);
+      if (res != MZ_OK)
+        return res;
+      std::size_t written = 0;
+      while (written < deflated.data.size()) {
+        int32_t chunk = static_cast<int32_t>(std::min<std::size_t>(deflated.data.size() - written, INT32_MAX));
+        int32_t count = mz_zip_entry_write(zip_handle, deflated.data.data() + written, chunk);
+        if (count <= 0)
+          return count < 0 ? count : MZ_WRITE_ERROR;
+        written += count;
+      }
+      return mz_zip_entry_close_raw(zip_handle, static_cast<int64_t>(deflated.size), deflated.crc);
+    }
+  }
+
+  bool isSafeEntryName(const std::string& name) {
+    std::filesystem::path path = std::filesystem::path(name).lexically_normal();
+    return !name.empty() && !path.is_absolute() && *path.begin() != "..";
+  }
+
+  bool isWithinDirectory(const std::filesystem::path& path, const std::filesystem::path& dir) {
+    std::error_code ec;
+    auto base = std::filesystem::weakly_canonical(dir, ec);
+    if (ec)
+      return false;
+    auto resolved = std::filesystem::weakly_canonical(path, ec);
+    if (ec)
+      return false;
+    auto relative = resolved.lexically_relative(base);
+    return !relative.empty() && *relative.begin() != "..";
+  }
+
   Zip::Zip(): 
-  _segment_size{0}, _append{0}, _include_path{0}, _recursive{1} {
+  _segment_size{0}, _append{0}, _include_path{0}, _recursive{1}, _threads{1}, _memory_limit{64 * 1024 * 1024},
+  _compress_method{MZ_COMPRESS_METHOD_DEFLATE}, _compress_level{MZ_COMPRESS_LEVEL_DEFAULT},
+  _max_extract_bytes{0}, _max_entries{0}, _max_ratio{0}, _extract_timeout{0} {
     
   }
+
+  Zip::Zip(const ZipConfig& config): Zip() {
+    setThreads(config.threads);
+    setMemoryLimit(config.memory_limit);
+    setMaxExtractBytes(config.max_extract_bytes);
+    setMaxEntries(config.max_entries);
+    setMaxRatio(config.max_ratio);
+    setExtractTimeout(std::chrono::seconds(config.extract_timeout_sec));
+  }
   
   std::optional<Error> Zip::compress(const std::vector<std::string>& file_list, const std::string& destination_file) {
     if (std::filesystem::exists(destination_file)){
@@ -35,11 +333,17 @@ namespace remote_agent {
       syslog(LOG_ERR, "Zip/compress: error %d opening archive for writing", res);
       return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "Error "+ std::to_string(res) + " opening archive for writing");
     }
-    for (int32_t i = 0; i < file_list.size(); i++) {
-      res = mz_zip_writer_add_path(writer.get(), file_list[i].c_str(), NULL,
-                                   _include_path, _recursive);
-      if (res != MZ_OK) {
-        syslog(LOG_ERR, "Error %d adding path to archive %s", res, file_list[i].c_str());
+    mz_zip_writer_set_compress_method(writer.get(), _compress_method);
+    mz_zip_writer_set_compress_level(writer.get(), _compress_level);
+    if (_threads > 1 && _compress_method == MZ_COMPRESS_METHOD_DEFLATE) {
+      compressParallel(file_list, writer.get());
+    } else {
+      for (int32_t i = 0; i < file_list.size(); i++) {
+        res = mz_zip_writer_add_path(writer.get(), file_list[i].c_str(), NULL,
+                                     _include_path, _recursive);
+        if (res != MZ_OK) {
+          syslog(LOG_ERR, "Error %d adding path to archive %s", res, file_list[i].c_str());
+        }
       }
     }
     res = mz_zip_writer_close(writer.get());
@@ -52,36 +356,312 @@ namespace remote_agent {
   }
   
   std::optional<Error> Zip::extract(const std::string& zip_file, const std::string& destination_dir) {
+    std::vector<ZipEntry> list;
+    auto err = entries(zip_file, list);
+    if (err.has_value())
+      return err;
+    err = checkLimits(zip_file, list);
+    if (err.has_value())
+      return err;
+    bool created = false;
     if (!std::filesystem::exists(destination_dir)){
       if (!std::filesystem::create_directories(destination_dir)) {
         syslog(LOG_ERR, "Zip/extract: directory creation failed %s", destination_dir.c_str());
         return std::make_pair(ErrorCode::FILE_CREATE_FAILED, "directory creation failed" + destination_dir);
       }
+      created = true;
     }
-    auto cleanup = [](void *reader) {
-      mz_zip_reader_delete(&reader);
-    };
-    // void *reader = mz_zip_reader_create();
-    std::unique_ptr<void, decltype(cleanup)> reader(mz_zip_reader_create(),cleanup);
-    if (!reader.get()) {
-      syslog(LOG_ERR, "Zip/extract: memory error in mz_zip_reader_create");
-      return std::make_pair(ErrorCode::MEMORY_ERROR, "Memory error: mz_zip_reader_create");
+
+    std::vector<std::pair<std::size_t, std::string>> files;
+    for (std::size_t i = 0; i < list.size(); i++) {
+      if (!isSafeEntryName(list[i].name)) {
+        syslog(LOG_ERR, "Zip/extract: refusing entry %s of %s", list[i].name.c_str(), zip_file.c_str());
+        err = std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Unsafe entry " + list[i].name + " in archive " + zip_file);
+        break;
+      }
+      if (list[i].directory) {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(destination_dir) / list[i].name, ec);
+      } else {
+        files.emplace_back(i, list[i].name);
+      }
     }
+    if (!err.has_value())
+      err = extractPositions(zip_file, files, destination_dir);
+    if (err.has_value()) {
+      // nothing of a refused archive stays behind
+      std::error_code ec;
+      if (created)
+        std::filesystem::remove_all(destination_dir, ec);
+      return err;
+    }
+    syslog(LOG_INFO, "Zip/extract: successfully extracted to %s", destination_dir.c_str());
+    return std::nullopt;
+  }
   
-    int32_t res = mz_zip_reader_open_file(reader.get(), zip_file.c_str());
+  std::optional<Error> Zip::extract(const std::string& zip_file, const std::vector<std::string>& entries,
+                                    const std::string& destination_dir) {
+    // positions from one pass over the directory instead of a
+    // mz_zip_reader_locate_entry scan per entry
+    std::vector<ZipEntry> list;
+    auto err = this->entries(zip_file, list);
+    if (err.has_value())
+      return err;
+    std::unordered_map<std::string, std::size_t> positions;
+    for (std::size_t i = 0; i < list.size(); i++)
+      positions.emplace(list[i].name, i);
+    std::vector<std::pair<std::size_t, std::string>> files;
+    std::vector<ZipEntry> selected;
+    for (const auto& entry : entries) {
+      if (!isSafeEntryName(entry)) {
+        syslog(LOG_ERR, "Zip/extract: refusing entry %s of %s", entry.c_str(), zip_file.c_str());
+        return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Unsafe entry " + entry + " in archive " + zip_file);
+      }
+      auto position = positions.find(entry);
+      if (position == positions.end()) {
+        return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Entry " + entry + " not found in archive " + zip_file);
+      }
+      files.emplace_back(position->second, entry);
+      selected.push_back(list[position->second]);
+    }
+    err = checkLimits(zip_file, selected);
+    if (err.has_value())
+      return err;
+    std::sort(files.begin(), files.end());
+    err = extractPositions(zip_file, files, destination_dir);
+    if (err.has_value())
+      return err;
+    syslog(LOG_INFO, "Zip/extract: %zu entries extracted to %s", entries.size(), destination_dir.c_str());
+    return std::nullopt;
+  }
+
+  std::optional<Error> Zip::extractPositions(const std::string& zip_file,
+                                             const std::vector<std::pair<std::size_t, std::string>>& entries,
+                                             const std::string& destination_dir) {
+    // Every worker has its own reader and claims the next entry; claims
+    // only grow, so each reader walks the central directory once. Entries
+    // are streamed to disk, memory stays at a few buffers per worker, and
+    // the limits are checked on every chunk instead of trusting the sizes
+    // in the central directory.
+    std::atomic<std::size_t> next{0};
+    std::atomic_bool failed{false};
+    std::mutex error_mutex;
+    std::optional<Error> error;
+    std::vector<std::filesystem::path> written;
+    ExtractBudget budget{_max_extract_bytes,
+                         _extract_timeout.count() > 0 ? std::chrono::steady_clock::now() + _extract_timeout
+                                                      : std::chrono::steady_clock::time_point::max(),
+                         {0}, &failed};
+    auto fail = [&](Error err) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error.has_value())
+        error = std::move(err);
+      failed = true;
+    };
+    auto work = [&]() {
+      auto [reader, err] = openReader(zip_file, "extract");
+      if (err.has_value()) {
+        fail(err.value());
+        return;
+      }
+      std::size_t cursor = 0;
+      int32_t res = mz_zip_reader_goto_first_entry(reader.get());
+      while (!failed) {
+        std::size_t claim = next++;
+        if (claim >= entries.size())
+          break;
+        const auto& [position, name] = entries[claim];
+        while (res == MZ_OK && cursor < position) {
+          res = mz_zip_reader_goto_next_entry(reader.get());
+          cursor++;
+        }
+        if (std::chrono::steady_clock::now() > budget.deadline) {
+          fail(std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, "Extracting archive " + zip_file + " took longer than " + std::to_string(_extract_timeout.count()) + " s"));
+          return;
+        }
+        std::filesystem::path target = std::filesystem::path(destination_dir) / name;
+        // the name is safe, but a symlink already on disk may redirect it
+        if (!isWithinDirectory(target, destination_dir)) {
+          fail(std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Entry " + name + " of archive " + zip_file + " resolves outside " + destination_dir));
+          return;
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(target.parent_path(), ec);
+        mz_zip_file *info = nullptr;
+        if (res == MZ_OK)
+          res = mz_zip_reader_entry_get_info(reader.get(), &info);
+        std::optional<Error> refused;
+        if (res == MZ_OK) {
+          {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            written.push_back(target);
+          }
+          res = saveEntry(reader.get(), info, target, destination_dir, budget, _max_ratio, refused);
+        }
+        if (refused.has_value()) {
+          fail(std::make_pair(refused.value().first, "Entry " + name + " of archive " + zip_file + " " + refused.value().second));
+          return;
+        }
+        if (res != MZ_OK) {
+          fail(std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Error "+ std::to_string(res) + " extracting " + name + " from archive " + zip_file));
+          return;
+        }
+      }
+    };
+
+    const std::size_t workers = std::min<std::size_t>(std::max(_threads, 1), entries.size());
+    if (workers <= 1) {
+      work();
+    } else {
+      ThreadPool pool(workers);
+      std::vector<std::future<void>> done;
+      for (std::size_t i = 0; i < workers; i++)
+        done.push_back(pool.submit(work));
+      for (auto& worker : done)
+        worker.get();
+    }
+    if (error.has_value()) {
+      syslog(LOG_ERR, "Zip/extract: %s", error.value().second.c_str());
+      // partial output must not be mistaken for a complete extraction
+      std::error_code ec;
+      for (const auto& path : written)
+        std::filesystem::remove(path, ec);
+    }
+    return error;
+  }
+
+  std::optional<Error> Zip::checkLimits(const std::string& zip_file, const std::vector<ZipEntry>& entries) const {
+    // what the central directory declares; extractPositions counts again
+    // while inflating, the declared sizes may be forged
+    if (_max_entries > 0 && entries.size() > _max_entries) {
+      syslog(LOG_ERR, "Zip/extract: %s has %zu entries, refusing more than %llu", zip_file.c_str(),
+             entries.size(), static_cast<unsigned long long>(_max_entries));
+      return std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, "Archive " + zip_file + " has more than " + std::to_string(_max_entries) + " entries");
+    }
+    uint64_t total = 0;
+    for (const auto& entry : entries) {
+      total += entry.size;
+      if (_max_ratio > 0 && entry.size > RATIO_FLOOR &&
+          entry.size / std::max<uint64_t>(entry.compressed_size, 1) > _max_ratio) {
+        syslog(LOG_ERR, "Zip/extract: entry %s of %s exceeds the compression ratio limit", entry.name.c_str(),
+               zip_file.c_str());
+        return std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, "Entry " + entry.name + " of archive " + zip_file + " is compressed more than " + std::to_string(_max_ratio) + " times");
+      }
+    }
+    if (_max_extract_bytes > 0 && total > _max_extract_bytes) {
+      syslog(LOG_ERR, "Zip/extract: %s inflates to %llu bytes, refusing more than %llu", zip_file.c_str(),
+             static_cast<unsigned long long>(total), static_cast<unsigned long long>(_max_extract_bytes));
+      return std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, "Archive " + zip_file + " inflates to more than " + std::to_string(_max_extract_bytes) + " bytes");
+    }
+    return std::nullopt;
+  }
+
+  std::optional<Error> Zip::compressParallel(const std::vector<std::string>& file_list, void *writer) {
+    // Workers deflate whole files into memory, the calling thread writes
+    // them as raw entries in input order, so the archive is the same for
+    // any thread count. Buffered files are counted against _memory_limit
+    // by their size; a file above the limit is streamed by minizip on the
+    // calling thread when its turn comes.
+    const auto jobs = collectFiles(file_list, _include_path != 0, _recursive != 0);
+    const int level = _compress_level < 0 ? Z_DEFAULT_COMPRESSION : std::min<int>(_compress_level, Z_BEST_COMPRESSION);
+    const std::size_t max_pending = static_cast<std::size_t>(_threads) * 4;
+
+    struct Pending {
+      const CompressJob *job;
+      std::future<Deflated> result;     // not valid for a streamed file
+    };
+    ThreadPool pool(_threads);
+    std::deque<Pending> pending;
+    uint64_t reserved = 0;
+    std::size_t next = 0;
+    auto fill = [&]() {
+      while (next < jobs.size() && pending.size() < max_pending) {
+        const CompressJob& job = jobs[next];
+        if (job.size > _memory_limit) {
+          pending.push_back(Pending{&job, std::future<Deflated>()});
+        } else if (reserved + job.size > _memory_limit) {
+          break;
+        } else {
+          reserved += job.size;
+          pending.push_back(Pending{&job, pool.submit([&job, level]() { return deflateFile(job.path, level); })});
+        }
+        next++;
+      }
+    };
+
+    fill();
+    while (!pending.empty()) {
+      Pending item = std::move(pending.front());
+      pending.pop_front();
+      int32_t res;
+      if (!item.result.valid()) {
+        res = mz_zip_writer_add_file(writer, item.job->path.c_str(), item.job->name.c_str());
+      } else {
+        Deflated deflated = item.result.get();
+        reserved -= item.job->size;
+        if (deflated.error.has_value()) {
+          syslog(LOG_ERR, "Zip/compress: %s", deflated.error.value().second.c_str());
+          fill();
+          continue;
+        }
+        res = writeRawEntry(writer, *item.job, deflated, static_cast<int16_t>(level));
+      }
+      if (res != MZ_OK) {
+        syslog(LOG_ERR, "Error %d adding path to archive %s", res, item.job->path.c_str());
+      }
+      fill();
+    }
+    return std::nullopt;
+  }
+
+  std::optional<Error> Zip::entries(const std::string& zip_file, std::vector<ZipEntry>& entries) {
+    auto [reader, err] = openReader(zip_file, "entries");
+    if (err.has_value())
+      return err;
+    entries.clear();
+    int32_t res = mz_zip_reader_goto_first_entry(reader.get());
+    while (res == MZ_OK) {
+      mz_zip_file *info = nullptr;
+      res = mz_zip_reader_entry_get_info(reader.get(), &info);
+      if (res != MZ_OK)
+        break;
+      entries.push_back(ZipEntry{info->filename, static_cast<uint64_t>(info->uncompressed_size),
+                                 static_cast<uint64_t>(info->compressed_size),
+                                 mz_zip_reader_entry_is_dir(reader.get()) == MZ_OK});
+      res = mz_zip_reader_goto_next_entry(reader.get());
+    }
+    if (res != MZ_END_OF_LIST) {
+      syslog(LOG_ERR, "Zip/entries: error %d reading the directory of %s", res, zip_file.c_str());
+      return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Error "+ std::to_string(res) + " listing archive " + zip_file);
+    }
+    return std::nullopt;
+  }
+
+  std::optional<Error> Zip::read(const std::string& zip_file, const std::string& entry, std::string& content) {
+    auto [reader, err] = openReader(zip_file, "read");
+    if (err.has_value())
+      return err;
+    int32_t res = mz_zip_reader_locate_entry(reader.get(), entry.c_str(), 0);
     if (res != MZ_OK) {
-      syslog(LOG_ERR, "Zip/extract: error %d opening archive %s for reading", res, zip_file.c_str());
-      return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "Error "+ std::to_string(res) + " opening archive " + zip_file + " for reading");
+      return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Entry " + entry + " not found in archive " + zip_file);
     }
-  
-    res = mz_zip_reader_save_all(reader.get(), destination_dir.c_str());
+    int32_t length = mz_zip_reader_entry_save_buffer_length(reader.get());
+    if (length >= 0 && _max_extract_bytes > 0 && static_cast<uint64_t>(length) > _max_extract_bytes) {
+      return std::make_pair(ErrorCode::ARCHIVE_LIMIT_EXCEEDED, "Entry " + entry + " of " + zip_file + " inflates to more than " + std::to_string(_max_extract_bytes) + " bytes");
+    }
+    if (length < 0) {
+      syslog(LOG_ERR, "Zip/read: entry %s of %s does not fit in memory", entry.c_str(), zip_file.c_str());
+      return std::make_pair(ErrorCode::MEMORY_ERROR, "Entry " + entry + " of " + zip_file + " is too large");
+    }
+    content.resize(length);
+    res = mz_zip_reader_entry_save_buffer(reader.get(), content.data(), length);
     if (res != MZ_OK) {
-      return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Error "+ std::to_string(res) + " extracting archive " + zip_file);
+      content.clear();
+      return std::make_pair(ErrorCode::UNARCHIVE_FAILED, "Error "+ std::to_string(res) + " reading " + entry + " from archive " + zip_file);
     }
-    syslog(LOG_INFO, "Zip/extract: successfully extracted to %s", destination_dir.c_str());
     return std::nullopt;
   }
-  
+
   void Zip::setSegmentSize(uint64_t segment_size) {
     _segment_size = segment_size;
   }
@@ -109,4 +689,66 @@ namespace remote_agent {
   void Zip::disableRecursive() {
     _recursive = 0;
   }
+
+  void Zip::setThreads(int threads) {
+    _threads = std::max(threads, 1);
+  }
+
+  void Zip::setMemoryLimit(uint64_t memory_limit) {
+    _memory_limit = memory_limit;
+  }
+
+  void Zip::setCompressMethod(uint16_t method) {
+    _compress_method = method;
+  }
+
+  void Zip::setCompressLevel(int16_t level) {
+    _compress_level = level;
+  }
+
+  void Zip::setMaxExtractBytes(uint64_t max_bytes) {
+    _max_extract_bytes = max_bytes;
+  }
+
+  void Zip::setMaxEntries(uint64_t max_entries) {
+    _max_entries = max_entries;
+  }
+
+  void Zip::setMaxRatio(uint64_t max_ratio) {
+    _max_ratio = max_ratio;
+  }
+
+  void Zip::setExtractTimeout(std::chrono::seconds timeout) {
+    _extract_timeout = timeout;
+  }
+
+  std::optional<uint16_t> Zip::compressMethod(const std::string& name) {
+    static const std::unordered_map<std::string, uint16_t> methods{
+      {"store", MZ_COMPRESS_METHOD_STORE},
+      {"deflate", MZ_COMPRESS_METHOD_DEFLATE},
+      {"bzip2", MZ_COMPRESS_METHOD_BZIP2},
+      {"lzma", MZ_COMPRESS_METHOD_LZMA},
+      {"xz", MZ_COMPRESS_METHOD_XZ},
+      {"zstd", MZ_COMPRESS_METHOD_ZSTD},
+    };
+    auto method = methods.find(name);
+    if (method == methods.end())
+      return std::nullopt;
+    return method->second;
+  }
+
+  std::vector<std::string> Zip::segments(const std::string& zip_file) {
+    std::vector<std::string> parts;
+    std::error_code ec;
+    for (unsigned disk = 1;; disk++) {
+      char extension[16];
+      std::snprintf(extension, sizeof(extension), ".z%02u", disk);
+      auto part = std::filesystem::path(zip_file).replace_extension(extension);
+      if (!std::filesystem::exists(part, ec))
+        break;
+      parts.push_back(part.string());
+    }
+    parts.push_back(zip_file);
+    return parts;
+  }
 };
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "imap_idle.h"
+
+#include <algorithm>
+#include <chrono>
+#include <syslog.h>
+
+#include "mail.h"
+
+namespace remote_agent::mail {
+
+    ImapIdleWatcher::ImapIdleWatcher(const AccountConfig& config, MailCallback callback)
+        : _config{config}, _callback{std::move(callback)}, _running{false}, _idling{false}, _supported{true} {
+
+    }
+
+    ImapIdleWatcher::~ImapIdleWatcher() {
+        stop();
+    }
+
+    void ImapIdleWatcher::start() {
+        if (_running)
+            return;
+        _running = true;
+        _thread = std::thread(&ImapIdleWatcher::run, this);
+    }
+
+    void ImapIdleWatcher::stop() {
+        _running = false;
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    bool ImapIdleWatcher::isIdling() const {
+        return _idling.load();
+    }
+
+    bool ImapIdleWatcher::isSupported() const {
+        return _supported.load();
+    }
+
+    void ImapIdleWatcher::run() {
+        const auto refresh = std::chrono::seconds(_config.imap_idle.refresh_interval_sec);
+        // mailio discards a dialog after a read deadline, so the deadline is
+        // only hit when the server stayed silent for longer than the refresh.
+        const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(refresh + std::chrono::seconds(60));
+        int backoff_sec = 1;
+
+        while (_running) {
+            Mail mail(_config);
+            auto [session, err] = mail.openImap(timeout);
+            if (err.has_value() || !session) {
+                _idling = false;
+                syslog(LOG_ERR, "ImapIdleWatcher/run(%s): %s", _config.name.c_str(),
+                       err.has_value() ? err.value().second.c_str() : "no session");
+                for (int i = 0; i < backoff_sec && _running; i++)
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                backoff_sec = std::min(backoff_sec * 2, 300);
+                continue;
+            }
+
+            try {
+                if (!session->hasCapability("IDLE")) {
+                    syslog(LOG_WARNING, "ImapIdleWatcher/run(%s): server has no IDLE, falling back to polling",
+                           _config.name.c_str());
+                    _supported = false;
+                    _idling = false;
+                    _running = false;
+                    return;
+                }
+                backoff_sec = 1;
+                _idling = true;
+                // Mail that arrived while we were disconnected does not trigger EXISTS.
+                IdleEvent event = IdleEvent::NEW_MAIL;
+                while (_running) {
+                    if (event == IdleEvent::NEW_MAIL) {
+                        auto [out_dirs, fetch_err] = mail.getByFilter(*session);
+                        for (const auto& out_dir : out_dirs)
+                            _callback(out_dir);
+                        if (fetch_err.has_value() && fetch_err.value().first != ErrorCode::NO_NEW_MAIL)
+                            syslog(LOG_ERR, "ImapIdleWatcher/run(%s): %s", _config.name.c_str(),
+                                   fetch_err.value().second.c_str());
+                    }
+                    event = session->idle(refresh, _running);
+                    if (event == IdleEvent::STOPPED)
+                        break;
+                }
+            }
+            catch (const std::exception& exc) {
+                syslog(LOG_ERR, "ImapIdleWatcher/run(%s): %s, reconnecting", _config.name.c_str(), exc.what());
+            }
+            _idling = false;
+        }
+    }
+};
@@ -0,0 +1,199 @@
+#include "imap_parser.h"
+
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+#include "codec.h"
+
+namespace remote_agent::mail {
+
+    namespace {
+        std::string toLower(std::string str) {
+            std::transform(str.begin(), str.end(), str.begin(),
+                           [](unsigned char c) { return std::tolower(c); });
+            return str;
+        }
+
+        std::string toUpper(std::string str) {
+            std::transform(str.begin(), str.end(), str.begin(),
+                           [](unsigned char c) { return std::toupper(c); });
+            return str;
+        }
+
+        void skipSpaces(const std::string& data, std::size_t& pos) {
+            while (pos < data.size() && (data[pos] == ' ' || data[pos] == '\r' || data[pos] == '\n'))
+                pos++;
+        }
+
+        std::string text(const ImapValue& value) {
+            return value.isNil() || value.isList() ? std::string() : value.text;
+        }
+
+        std::string percentDecode(const std::string& str) {
+            std::string out;
+            for (std::size_t i = 0; i < str.size(); i++) {
+                if (str[i] == '%' && i + 2 < str.size() && std::isxdigit(static_cast<unsigned char>(str[i + 1])) &&
+                    std::isxdigit(static_cast<unsigned char>(str[i + 2]))) {
+                    out += static_cast<char>(std::stoi(str.substr(i + 1, 2), nullptr, 16));
+                    i += 2;
+                } else {
+                    out += str[i];
+                }
+            }
+            return out;
+        }
+
+        std::string paramValue(const ImapValue& params, const std::string& name) {
+            if (!params.isList())
+                return "";
+            for (std::size_t i = 0; i + 1 < params.items.size(); i += 2) {
+                std::string key = toLower(text(params.items[i]));
+                if (key == name)
+                    return text(params.items[i + 1]);
+                // RFC 2231: filename*=charset'lang'value
+                if (key == name + "*") {
+                    std::string value = text(params.items[i + 1]);
+                    auto quote = value.find('\'', value.find('\'') + 1);
+                    return percentDecode(quote == std::string::npos ? value : value.substr(quote + 1));
+                }
+            }
+            return "";
+        }
+
+        void collectParts(const ImapValue& body, const std::string& section, std::vector<BodyPart>& parts) {
+            if (!body.isList() || body.items.empty())
+                return;
+
+            if (body.items[0].isList()) {
+                // multipart: nested bodies followed by the subtype and extensions
+                std::size_t child = 1;
+                for (const auto& item : body.items) {
+                    if (!item.isList())
+                        break;
+                    collectParts(item, section.empty() ? std::to_string(child) : section + "." + std::to_string(child),
+                                 parts);
+                    child++;
+                }
+                return;
+            }
+
+            const auto& items = body.items;
+            if (items.size() < 7)
+                throw std::runtime_error("Parsing BODYSTRUCTURE failure.");
+            BodyPart part;
+            part.section = section.empty() ? "1" : section;
+            part.type = toLower(text(items[0]));
+            part.subtype = toLower(text(items[1]));
+            part.encoding = toLower(text(items[5]));
+            try {
+                part.size = std::stoul(text(items[6]));
+            }
+            catch (const std::exception&) {
+                part.size = 0;
+            }
+
+            // TEXT carries a line count, MESSAGE/RFC822 an envelope, body and line count
+            std::size_t ext = 7;
+            if (part.type == "text")
+                ext = 8;
+            else if (part.type == "message" && part.subtype == "rfc822")
+                ext = 10;
+            if (ext + 1 < items.size() && items[ext + 1].isList() && !items[ext + 1].items.empty()) {
+                const auto& disposition = items[ext + 1];
+                part.disposition = toLower(text(disposition.items[0]));
+                if (disposition.items.size() > 1)
+                    part.filename = paramValue(disposition.items[1], "filename");
+            }
+            if (part.filename.empty())
+                part.filename = paramValue(items[2], "name");
+            // same name as MimeStream gives the part, e.g. =?UTF-8?B?...?= decoded
+            part.filename = codec::decodeEncodedWords(part.filename);
+            parts.push_back(std::move(part));
+        }
+    }
+
+    ImapValue parseImapValue(const std::string& data, std::size_t& pos) {
+        skipSpaces(data, pos);
+        if (pos >= data.size())
+            throw std::runtime_error("Parsing IMAP response failure: unexpected end.");
+
+        ImapValue value{ImapValue::Type::ATOM, "", {}};
+        char c = data[pos];
+        if (c == '(') {
+            value.type = ImapValue::Type::LIST;
+            pos++;
+            while (true) {
+                skipSpaces(data, pos);
+                if (pos >= data.size())
+                    throw std::runtime_error("Parsing IMAP response failure: unbalanced list.");
+                if (data[pos] == ')') {
+                    pos++;
+                    break;
+                }
+                value.items.push_back(parseImapValue(data, pos));
+            }
+        } else if (c == '"') {
+            value.type = ImapValue::Type::STRING;
+            pos++;
+            while (pos < data.size() && data[pos] != '"') {
+                if (data[pos] == '\\' && pos + 1 < data.size())
+                    pos++;
+                value.text += data[pos++];
+            }
+            pos++;
+        } else if (c == '{') {
+            value.type = ImapValue::Type::STRING;
+            auto close = data.find('}', pos);
+            if (close == std::string::npos)
+                throw std::runtime_error("Parsing IMAP response failure: bad literal.");
+            std::size_t size = std::stoul(data.substr(pos + 1, close - pos - 1));
+            pos = close + 1;
+            if (data.compare(pos, 2, "\r\n") == 0)
+                pos += 2;
+            if (pos + size > data.size())
+                throw std::runtime_error("Parsing IMAP response failure: short literal.");
+            value.text = data.substr(pos, size);
+            pos += size;
+        } else {
+            // atoms such as BODY[HEADER.FIELDS (FROM)] may contain spaces and
+            // parentheses inside the brackets
+            int depth = 0;
+            while (pos < data.size()) {
+                c = data[pos];
+                if (c == '[')
+                    depth++;
+                else if (c == ']')
+                    depth--;
+                else if (depth == 0 && (c == ' ' || c == '(' || c == ')' || c == '\r' || c == '\n'))
+                    break;
+                value.text += c;
+                pos++;
+            }
+            if (toUpper(value.text) == "NIL")
+                value.type = ImapValue::Type::NIL;
+        }
+        return value;
+    }
+
+    std::map<std::string, ImapValue> parseFetchResponse(const std::string& response) {
+        std::map<std::string, ImapValue> result;
+        auto head = toUpper(response.substr(0, std::min<std::size_t>(response.size(), 64)));
+        auto fetch = head.find(" FETCH ");
+        if (fetch == std::string::npos)
+            return result;
+        std::size_t pos = fetch + 7;
+        ImapValue list = parseImapValue(response, pos);
+        if (!list.isList())
+            return result;
+        for (std::size_t i = 0; i + 1 < list.items.size(); i += 2)
+            result[toUpper(list.items[i].text)] = list.items[i + 1];
+        return result;
+    }
+
+    std::vector<BodyPart> parseBodyStructure(const ImapValue& body) {
+        std::vector<BodyPart> parts;
+        collectParts(body, "", parts);
+        return parts;
+    }
+};
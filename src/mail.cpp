@@ -1,78 +1,131 @@
 #include "mail.h"
 #include "config.h"
-
+#include "codec.h"
+#include "imap_parser.h"
+#include "mailbox_state.h"
+#include "mime_stream.h"
+#include "session_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <exception>
 #include <iomanip>
+#include <iterator>
 #include <mailio/dialog.hpp>
 #include <memory>
-#include <sstream>
 #include <random>
+#include <set>
+#include <sstream>
 #include <filesystem>
 #include <fstream>
 #include <syslog.h>
 
 namespace remote_agent::mail {
 
+    namespace {
+        std::atomic<unsigned long> fetch_sequence{0};
+        std::atomic<unsigned long> outgoing_sequence{0};
+        // a message failing this many polls in a row is skipped
+        constexpr unsigned int MAX_FETCH_FAILURES = 3;
+
+        // Splits a formatted message into its addressing headers and the
+        // content: Content-* and MIME-Version headers, blank line and body.
+        std::pair<std::string, std::string> splitContent(const std::string& text) {
+            auto header_end = text.find("\r\n\r\n");
+            if (header_end == std::string::npos)
+                return std::make_pair(text, std::string("\r\n"));
+            std::string headers;
+            std::string content_headers;
+            bool content_field = false;
+            std::size_t pos = 0;
+            while (pos < header_end + 2) {
+                auto eol = text.find("\r\n", pos);
+                std::string line = text.substr(pos, eol + 2 - pos);
+                pos = eol + 2;
+                // folded lines belong to the field above them
+                if (line[0] != ' ' && line[0] != '\t') {
+                    std::string name = boost::to_lower_copy(line.substr(0, line.find(':')));
+                    content_field = name.compare(0, 8, "content-") == 0 || name == "mime-version";
+                }
+                (content_field ? content_headers : headers) += line;
+            }
+            return std::make_pair(headers, content_headers + "\r\n" + text.substr(header_end + 4));
+        }
+    }
+
     Mail::Mail (const AccountConfig &config) : _config{config} {
 
     }
 
     std::optional<Error> Mail::send(const Recipient &recipient, const std::string &subject, const std::string &body) {
-        const auto& msg = prepareMessage(recipient, subject, body);
-
-        return send(msg);
+        return send(prepareMessage(recipient, subject, ""), body, {});
     }
 
     std::optional<Error> Mail::send(const Recipient &recipient, const std::string &subject, const std::string &body, const std::list<File> &file_list) {
-        auto msg = prepareMessage(recipient, subject, body);
-        auto list = prepareAttachment(file_list);
-        
-        std::list<std::tuple<std::istream&, mailio::string_t, mailio::mime::content_type_t>> attachment_list;
-        for (const auto &item : list)
-          attachment_list.push_back(std::make_tuple(std::ref(*std::get<0>(item).get()), std::get<1>(item), std::get<2>(item)));
-        if (!attachment_list.empty())
-            msg.attach(attachment_list);
-
-        return send(msg);        
+        return send(prepareMessage(recipient, subject, ""), body, file_list);
     }
 
     std::optional<Error> Mail::send(const std::string &subject, const std::string &body) {
-        const auto& msg = prepareMessage(subject, body);
-
-        return send(msg);
+        return send(prepareMessage(subject, ""), body, {});
     }
 
     std::optional<Error> Mail::send(const std::string &subject, const std::string &body, const std::list<File> &file_list) {
-        auto msg = prepareMessage(subject, body);
-        auto list = prepareAttachment(file_list);
-        
-        std::list<std::tuple<std::istream&, mailio::string_t, mailio::mime::content_type_t>> attachment_list;
-        for (const auto &item : list)
-          attachment_list.push_back(std::make_tuple(std::ref(*std::get<0>(item).get()), std::get<1>(item), std::get<2>(item)));
-        if (!attachment_list.empty())
-            msg.attach(attachment_list);
+        return send(prepareMessage(subject, ""), body, file_list);
+    }
 
-        return send(msg);        
+    std::optional<Error> Mail::encodeContent(const std::string& body, const std::list<File>& file_list,
+      const std::string& destination) {
+        try {
+            std::ofstream fos(destination, std::ios::binary | std::ios::trunc);
+            if (!fos.is_open()) {
+                syslog(LOG_ERR, "Mail/encodeContent: cannot open %s", destination.c_str());
+                return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + destination);
+            }
+            writeContent(fos, body, file_list);
+            fos.close();
+            if (!fos)
+                return std::make_pair(ErrorCode::FILE_CLOSE_FAILED, "writing " + destination + " failed");
+        }
+        catch (const std::exception& exc) {
+            syslog(LOG_ERR, "Mail/encodeContent: %s", exc.what());
+            return parseError(exc.what());
+        }
+        return std::nullopt;
+    }
+
+    std::optional<Error> Mail::sendContent(const std::string& subject, const std::string& content_file) {
+        std::ifstream fis(content_file, std::ios::binary);
+        if (!fis.is_open()) {
+            syslog(LOG_ERR, "Mail/sendContent: cannot open %s", content_file.c_str());
+            return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + content_file);
+        }
+        // only the addressing headers are built per account, the content
+        // goes out straight from the file
+        auto envelope = prepareMessage(subject, "");
+        std::string text;
+        try {
+            envelope.format(text);
+        }
+        catch (const std::exception& exc) {
+            syslog(LOG_ERR, "Mail/sendContent: %s", exc.what());
+            return parseError(exc.what());
+        }
+        return send(envelope, splitContent(text).first, fis);
     }
 
     std::pair<uint32_t,std::optional<Error>> Mail::count(const std::string& folder) {
         std::optional<Error> err;
         uint32_t count = 0;
 
+        auto [session, pool_err] = SessionPool::getInstance().borrowImap(_config);
+        if (pool_err.has_value())
+            return std::make_pair(count, pool_err);
         try {
-            if (_config.imap.security == "ssl") {
-                mailio::imaps conn(_config.imap.host , _config.imap.port);
-                err = authenticate(&conn);
-                mailio::imaps::mailbox_stat_t stat = conn.statistics(folder);
-                syslog(LOG_INFO, "Mail count in %s: %ld", folder.c_str(), stat.messages_no);
-                count = stat.messages_no;
-            } else {
-                mailio::imap conn(_config.imap.host , _config.imap.port);
-                err = authenticate(&conn);
-                mailio::imap::mailbox_stat_t stat = conn.statistics(folder);
-                syslog(LOG_INFO, "Mail count in %s: %ld", folder.c_str(), stat.messages_no);
-                count = stat.messages_no;
-            }
+            mailio::imap::mailbox_stat_t stat = session->connection().statistics(folder);
+            syslog(LOG_INFO, "Mail count in %s: %ld", folder.c_str(), stat.messages_no);
+            count = stat.messages_no;
         }
         catch (mailio::imap_error& exc)
         {
@@ -87,43 +140,83 @@ namespace remote_agent::mail {
             syslog(LOG_ERR, "Mail/count: %s", exc.what());
             err = parseError(exc.what());
         }
+        if (err.has_value())
+            session.invalidate();
         return std::make_pair(count,err);
     }
 
-    std::pair<std::string,std::optional<Error>> Mail::getByFilter() {
+    std::pair<std::vector<std::string>,std::optional<Error>> Mail::getByFilter() {
+        auto [session, err] = SessionPool::getInstance().borrowImap(_config);
+        if (err.has_value())
+            return std::make_pair(std::vector<std::string>(),err);
+        auto result = getByFilter(*session);
+        if (result.second.has_value() && result.second.value().first != ErrorCode::NO_NEW_MAIL)
+            session.invalidate();
+        DeflateDialog::logTotals();
+        return result;
+    }
+
+    std::pair<std::unique_ptr<ImapSession>,std::optional<Error>> Mail::openImap(std::chrono::milliseconds timeout) {
         std::optional<Error> err;
+        std::unique_ptr<ImapSession> session;
+        const TlsConfig& tls = Config::getInstance().getGlobalConfig().tls;
         try {
-        if (_config.imap.security == "ssl") {
-            mailio::imaps conn(_config.imap.host , _config.imap.port);
-            err = authenticate(&conn);
-            if (err.has_value())
-                return std::make_pair("",err);
-            return getByFilter(conn);                
-        } else {
-            mailio::imap conn(_config.imap.host , _config.imap.port);
-            err = authenticate(&conn);
-            if (err.has_value())
-                return std::make_pair("",err);
-            return getByFilter(conn);
+            if (_config.imap.security == "ssl" && tls.shared_context) {
+                auto context = TlsContext::forHost(_config.imap.host, _config.imap.port, tls.verify_peer);
+                auto conn = std::make_unique<ImapClient<mailio::imap>>(_config.imap.host, _config.imap.port, timeout);
+                if (boost::to_lower_copy(_config.imap.auth_method).find("start_tls") != std::string::npos) {
+                    conn->startTls(context);
+                    conn->login(_config.credentials.username, _config.credentials.password);
+                    syslog(LOG_INFO, "authenticate(imap): STARTTLS login done");
+                } else {
+                    conn->secure(context);
+                    err = authenticate(static_cast<mailio::imap*>(conn.get()));
+                }
+                session = std::move(conn);
+            } else if (_config.imap.security == "ssl") {
+                auto conn = std::make_unique<ImapClient<mailio::imaps>>(_config.imap.host, _config.imap.port, timeout);
+                err = authenticate(static_cast<mailio::imaps*>(conn.get()));
+                session = std::move(conn);
+            } else {
+                auto conn = std::make_unique<ImapClient<mailio::imap>>(_config.imap.host, _config.imap.port, timeout);
+                err = authenticate(static_cast<mailio::imap*>(conn.get()));
+                session = std::move(conn);
+            }
+            if (!err.has_value() && _config.imap.compress) {
+                if (session->compress())
+                    syslog(LOG_INFO, "Mail/openImap: COMPRESS=DEFLATE active for %s", _config.name.c_str());
+                else
+                    syslog(LOG_NOTICE, "Mail/openImap: COMPRESS=DEFLATE unavailable for %s", _config.name.c_str());
+            }
         }
-    }
-     catch (const mailio::dialog_error& exc) {
-        syslog(LOG_ERR, "Mail/getByFilter: %s", exc.what());
-        err = parseError(exc.what());
-        return std::make_pair("",err);
-     }
-     catch (const std::exception& exc) {
-        syslog(LOG_ERR, "Mail/getByFilter: %s", exc.what());
-        err = parseError(exc.what());
-        return std::make_pair("",err);
-     }
+        catch (const mailio::dialog_error& exc) {
+            syslog(LOG_ERR, "Mail/openImap: %s", exc.what());
+            err = parseError(exc.what());
+        }
+        catch (const std::exception& exc) {
+            syslog(LOG_ERR, "Mail/openImap: %s", exc.what());
+            err = parseError(exc.what());
+        }
+        if (err.has_value())
+            session.reset();
+        return std::make_pair(std::move(session), err);
     }
 
-    std::pair<std::string,std::optional<Error>> Mail::getByFilter(mailio::imap& conn) {
+    std::pair<std::vector<std::string>,std::optional<Error>> Mail::getByFilter(ImapSession& session) {
         std::optional<Error> err;
-        std::string work_dir = std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) / getCurrentTimeDirectoryName();
+        std::vector<std::string> mail_dirs;
+        mailio::imap& conn = session.connection();
+        auto mailbox_state = MailboxState::forAccount(_config.name);
+        // the IDLE watcher and the poller of one account take turns, both
+        // would fetch the same UIDs otherwise
+        std::lock_guard<std::mutex> fetch_lock(mailbox_state->fetchMutex());
+        // accounts are polled in parallel, the account keeps their UIDs apart
+        std::string account = _config.name;
+        std::replace_if(account.begin(), account.end(), [](unsigned char c) { return !std::isalnum(c) && c != '-'; }, '_');
+        std::string work_dir = std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) /
+                               (getCurrentTimeDirectoryName() + "_" + account);
         try{
-            mailio::imap::mailbox_stat_t stat = conn.select(_config.imap_filter.folders);
+            mailio::imap::mailbox_stat_t stat = conn.select(_config.imap_filter.folders, _config.imap_filter.read_only);
             std::string folders="(";
             for (auto f : _config.imap_filter.folders){
                 folders += f + ",";
@@ -131,39 +224,123 @@ namespace remote_agent::mail {
             folders.pop_back();
             folders += ")";
             syslog(LOG_INFO, "Mail count in %s: %ld", folders.c_str(), stat.messages_no);
+
+            SyncState sync{stat.uid_validity, 0};
+            auto stored = mailbox_state->get(folders);
+            if (stored.has_value() && stored.value().uid_validity == stat.uid_validity)
+                sync.last_uid = stored.value().last_uid;
+            else if (stored.has_value())
+                syslog(LOG_WARNING, "Mail/getByFilter: UIDVALIDITY of %s changed, rescanning", folders.c_str());
+            // every UID below UIDNEXT existed at SELECT and is covered by the SEARCH below
+            const unsigned long covered_uid = stat.uid_next != 0 ? stat.uid_next - 1 : 0;
+            // UIDNEXT from SELECT answers "anything new?" without a SEARCH
+            if (stat.uid_validity != 0 && stat.uid_next != 0 && sync.last_uid + 1 >= stat.uid_next) {
+                syslog(LOG_INFO, "No new mail found");
+                return  std::make_pair<std::vector<std::string>,std::optional<Error>>(std::vector<std::string>(),std::make_pair<ErrorCode,std::string>(ErrorCode::NO_NEW_MAIL, "No new mail found"));
+            }
+
+            std::list<mailio::imap::search_condition_t> conditions = _config.imap_filter.conditions;
+            if (stat.uid_validity != 0) {
+                // an empty upper bound is sent as `last+1:*`
+                std::list<mailio::imap::messages_range_t> range{std::make_pair(sync.last_uid + 1, std::optional<unsigned long>())};
+                conditions.push_back(mailio::imap::search_condition_t(mailio::imap::search_condition_t::UID_LIST, range));
+            }
             std::list<unsigned long> messages;
-            conn.search(_config.imap_filter.conditions, messages, true);
+            conn.search(conditions, messages, true);
+            // `n:*` always matches the highest UID, even when it is below n
+            messages.remove_if([&sync](unsigned long uid) { return uid <= sync.last_uid; });
+            messages.sort();
             if (messages.empty()) {
+                // nothing matched up to UIDNEXT, do not search that range again
+                if (stat.uid_validity != 0 && covered_uid > sync.last_uid) {
+                    sync.last_uid = covered_uid;
+                    mailbox_state->update(folders, sync);
+                }
                 syslog(LOG_INFO, "No new mail found");
-                return  std::make_pair<std::string,std::optional<Error>>(std::string(),std::make_pair<ErrorCode,std::string>(ErrorCode::NO_NEW_MAIL, "No new mail found"));
+                return  std::make_pair<std::vector<std::string>,std::optional<Error>>(std::vector<std::string>(),std::make_pair<ErrorCode,std::string>(ErrorCode::NO_NEW_MAIL, "No new mail found"));
             }
-            for(unsigned int msg_uid : messages) { 
-                mailio::message msg;
-                std::string msg_str;
-                conn.fetch(msg_uid, msg, true);
-                msg.format(msg_str);
-                if (!std::filesystem::exists(work_dir))
-                    if(std::filesystem::create_directories(work_dir))
-                        syslog(LOG_INFO, "Mail directory created: %s", work_dir.c_str());
-                std::ofstream fos_text(std::filesystem::path(work_dir) / "mail.txt");
-                if (fos_text.is_open()) {
-                    fos_text << msg_str;
-                    fos_text.close();
-                    syslog(LOG_INFO, "Mail content has written into: %s", std::string(work_dir + "mail.txt").c_str());
+            const unsigned long highest_uid = std::max(messages.back(), covered_uid);
+            if (_config.imap_filter.rules) {
+                messages = matchRules(session, messages);
+                if (messages.empty()) {
+                    // nothing wanted, their headers are not fetched again
+                    if (stat.uid_validity != 0) {
+                        sync.last_uid = highest_uid;
+                        mailbox_state->update(folders, sync);
+                    }
+                    syslog(LOG_INFO, "No new mail found");
+                    return  std::make_pair<std::vector<std::string>,std::optional<Error>>(std::vector<std::string>(),std::make_pair<ErrorCode,std::string>(ErrorCode::NO_NEW_MAIL, "No new mail found"));
                 }
-                for (std::size_t i = 1; i <= msg.attachments_size(); i++) {
-                    std::string tmp_file = generateTempFilename();
-                    std::ofstream fos(tmp_file, std::ios::binary);
-                    mailio::string_t name;
-                    msg.attachment(i, fos, name);
-                    fos.close();
-                    syslog(LOG_INFO, "Mail attachment (%ld) has written to %s", i, tmp_file.c_str());
-                    if(std::filesystem::copy_file(tmp_file, std::filesystem::path(work_dir) / name.buffer)) {
-                        syslog(LOG_INFO, "Mail attachment renamed into: %s", std::string(work_dir + name.buffer).c_str());
-                        std::filesystem::remove(tmp_file);
+            }
+            // a message that keeps failing is given up on after a few polls,
+            // it must not hold back everything behind it
+            auto giveUp = [&](unsigned long msg_uid) {
+                unsigned int failures = mailbox_state->fetchFailed(folders, msg_uid);
+                if (failures < MAX_FETCH_FAILURES)
+                    return false;
+                syslog(LOG_ERR, "Mail/getByFilter: skipping UID %lu in %s after %u failed fetches",
+                       msg_uid, folders.c_str(), failures);
+                return true;
+            };
+            if (_config.imap_filter.attachments.selective) {
+                for(unsigned long msg_uid : messages) { 
+                    std::string mail_dir = messageDirectory(work_dir, msg_uid);
+                    try {
+                        fetchSelective(session, msg_uid, mail_dir);
+                        mail_dirs.push_back(mail_dir);
+                    }
+                    catch (const std::exception& exc) {
+                        std::error_code ec;
+                        std::filesystem::remove_all(mail_dir, ec);
+                        // IMAP replies about this message count, a lost connection does not
+                        bool message_failure = dynamic_cast<const mailio::imap_error*>(&exc) != nullptr ||
+                                               dynamic_cast<const mailio::dialog_error*>(&exc) == nullptr;
+                        if (!message_failure || !giveUp(msg_uid))
+                            throw;
                     }
+                    if (stat.uid_validity != 0) {
+                        sync.last_uid = msg_uid;
+                        mailbox_state->update(folders, sync);
+                    }
+                }
+            } else {
+                const std::size_t batch_size = std::max(_config.imap_filter.fetch_batch_size, 1);
+                // handed over by an earlier poll that stopped at a failed UID
+                // in front of them; only the failed ones are fetched again
+                const auto delivered = sync.last_uid != 0 ? mailbox_state->delivered(folders)
+                                                          : std::set<unsigned long>();
+                std::vector<unsigned long> pending(messages.begin(), messages.end());
+                for (std::size_t first = 0; first < pending.size(); first += batch_size) {
+                    std::vector<unsigned long> batch(pending.begin() + first,
+                                                     pending.begin() + std::min(first + batch_size, pending.size()));
+                    std::vector<unsigned long> wanted;
+                    std::copy_if(batch.begin(), batch.end(), std::back_inserter(wanted),
+                                 [&delivered](unsigned long uid) { return delivered.count(uid) == 0; });
+                    std::map<unsigned long, std::string> stored;
+                    if (!wanted.empty())
+                        stored = fetchBatch(session, wanted, work_dir);
+                    for (const auto& [msg_uid, mail_dir] : stored) {
+                        mail_dirs.push_back(mail_dir);
+                        mailbox_state->markDelivered(folders, msg_uid);
+                    }
+                    // only the contiguous prefix is safe to skip next time
+                    for (unsigned long msg_uid : batch) {
+                        if (stored.find(msg_uid) == stored.end() && delivered.count(msg_uid) == 0 && !giveUp(msg_uid))
+                            break;
+                        sync.last_uid = msg_uid;
+                    }
+                    if (stat.uid_validity != 0)
+                        mailbox_state->update(folders, sync);
+                    if (sync.last_uid != batch.back())
+                        throw mailio::imap_error("Fetching message failure.", uidSet(batch));
                 }
             }
+            // messages rejected by the rules or not matching the search
+            // after the last fetched one
+            if (stat.uid_validity != 0 && sync.last_uid < highest_uid) {
+                sync.last_uid = highest_uid;
+                mailbox_state->update(folders, sync);
+            }
         }
         catch (mailio::message_error& exc)
         {
@@ -187,28 +364,73 @@ namespace remote_agent::mail {
             syslog(LOG_ERR, "Mail/getByFilter: %s", exc.what());
             err = parseError(exc.what());
         }
-        return std::make_pair(work_dir, err);
+        return std::make_pair(mail_dirs, err);
     }
 
-    std::optional<Error> Mail::send(const mailio::message &msg) {
-        std::optional<Error> mail_error;
+    std::optional<Error> Mail::send(const mailio::message& envelope, const std::string& body,
+      const std::list<File>& file_list) {
+        // mailio only builds the addressing headers, the content is encoded
+        // by codec, see writeContent
+        std::string headers;
+        std::ostringstream data;
         try {
-            std::string res;
-            if (_config.smtp.security == "ssl") {
-                mailio::smtps conn(_config.smtp.host , _config.smtp.port);
-                mail_error = authenticate(&conn);
-                res = conn.submit(msg);
-                syslog(LOG_INFO, "Mail/send: %s", res.c_str());
-            } else {
-                mailio::smtp conn(_config.smtp.host , _config.smtp.port);
-                mail_error = authenticate(&conn);
-                res = conn.submit(msg);
-                syslog(LOG_INFO, "Mail/send: %s", res.c_str());
-            }
+            std::string text;
+            envelope.format(text);
+            headers = splitContent(text).first;
+            if (file_list.empty())
+                writeContent(data, body, file_list);
         }
-        catch (mailio::smtp_error& exc) {
+        catch (const std::exception& exc) {
             syslog(LOG_ERR, "Mail/send: %s", exc.what());
+            return parseError(exc.what());
+        }
+        if (file_list.empty()) {
+            std::istringstream content(data.str());
+            return send(envelope, headers, content);
+        }
+        // attachments are encoded into a file first and read from there
+        // chunk by chunk while they are sent
+        std::filesystem::path content_file = std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) /
+                                             (".outgoing-" + std::to_string(outgoing_sequence++) + ".eml");
+        auto err = encodeContent(body, file_list, content_file.string());
+        if (!err.has_value()) {
+            std::ifstream fis(content_file, std::ios::binary);
+            if (fis.is_open())
+                err = send(envelope, headers, fis);
+            else
+                err = std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + content_file.string());
+        }
+        std::error_code ec;
+        std::filesystem::remove(content_file, ec);
+        return err;
+    }
+
+    std::optional<Error> Mail::send(const mailio::message& envelope, const std::string& headers, std::istream& content) {
+        return submit([&envelope, &headers, &content](SmtpSession& session) {
+            return session.submit(envelope, headers, content);
+        });
+    }
+
+    std::optional<Error> Mail::submit(const std::function<std::string(SmtpSession&)>& submission) {
+        auto [session, mail_error] = SessionPool::getInstance().borrowSmtp(_config);
+        if (mail_error.has_value()) {
+            // a refused greeting or AUTH (421, 454, ...) says nothing about
+            // this mail, only MAIL/RCPT/DATA/BDAT replies below can be final
+            if (mail_error.value().first == ErrorCode::REJECTION)
+                mail_error.value().first = ErrorCode::UNKNOWN;
+            return mail_error;
+        }
+        try {
+            std::string res = submission(*session);
+            syslog(LOG_INFO, "Mail/send: %s", res.c_str());
+        }
+        catch (mailio::smtp_error& exc) {
+            syslog(LOG_ERR, "Mail/send: %s %s", exc.what(), exc.details().c_str());
             mail_error = parseError(exc.what());
+            // only a 5xx reply is final, 4xx asks to try again later (RFC 5321 4.2.1)
+            if (mail_error.value().first == ErrorCode::REJECTION && !exc.details().empty() &&
+                exc.details()[0] != '5')
+                mail_error.value().first = ErrorCode::UNKNOWN;
         }
         catch (mailio::codec_error& exc) {
             syslog(LOG_ERR, "Mail/send: %s", exc.what());
@@ -222,9 +444,53 @@ namespace remote_agent::mail {
             syslog(LOG_ERR, "Mail/send: %s", exc.what());
             mail_error = parseError(exc.what());
         }
+        if (mail_error.has_value())
+            session.invalidate();
         return mail_error;
     }
 
+    std::pair<std::unique_ptr<SmtpSession>,std::optional<Error>> Mail::openSmtp(std::chrono::milliseconds timeout) {
+        std::optional<Error> err;
+        std::unique_ptr<SmtpSession> session;
+        const TlsConfig& tls = Config::getInstance().getGlobalConfig().tls;
+        try {
+            if (_config.smtp.security == "ssl" && tls.shared_context) {
+                auto context = TlsContext::forHost(_config.smtp.host, _config.smtp.port, tls.verify_peer);
+                auto conn = std::make_unique<SmtpClient<mailio::smtp>>(_config.smtp.host, _config.smtp.port, timeout);
+                std::string lower_auth = boost::to_lower_copy(_config.smtp.auth_method);
+                if (lower_auth.find("start_tls") != std::string::npos) {
+                    conn->startTls(context);
+                    // same as mailio::smtps with START_TLS: always AUTH LOGIN after the second EHLO
+                    conn->login(_config.credentials.username, _config.credentials.password, true);
+                    syslog(LOG_INFO, "authenticate(smtp): STARTTLS login done");
+                } else {
+                    conn->secure(context);
+                    err = authenticate(static_cast<mailio::smtp*>(conn.get()));
+                }
+                session = std::move(conn);
+            } else if (_config.smtp.security == "ssl") {
+                auto conn = std::make_unique<SmtpClient<mailio::smtps>>(_config.smtp.host, _config.smtp.port, timeout);
+                err = authenticate(static_cast<mailio::smtps*>(conn.get()));
+                session = std::move(conn);
+            } else {
+                auto conn = std::make_unique<SmtpClient<mailio::smtp>>(_config.smtp.host, _config.smtp.port, timeout);
+                err = authenticate(static_cast<mailio::smtp*>(conn.get()));
+                session = std::move(conn);
+            }
+        }
+        catch (const mailio::dialog_error& exc) {
+            syslog(LOG_ERR, "Mail/openSmtp: %s", exc.what());
+            err = parseError(exc.what());
+        }
+        catch (const std::exception& exc) {
+            syslog(LOG_ERR, "Mail/openSmtp: %s", exc.what());
+            err = parseError(exc.what());
+        }
+        if (err.has_value())
+            session.reset();
+        return std::make_pair(std::move(session), err);
+    }
+
     mailio::message Mail::prepareMessage(const Recipient &recipient, const std::string &subject, const std::string &body) {
         mailio::message msg;
 
@@ -303,43 +569,76 @@ namespace remote_agent::mail {
         return std::move(msg);
     }
 
-    std::list<std::tuple<std::shared_ptr<std::istream>, mailio::string_t, mailio::mime::content_type_t>> Mail::prepareAttachment(const std::list<File> &file_list) {
-        std::list<std::tuple<std::shared_ptr<std::istream>, mailio::string_t, mailio::mime::content_type_t>> attachment_list;
+    void Mail::writeContent(std::ostream& out, const std::string& body, const std::list<File>& file_list) {
+        const std::string text_headers =
+            "Content-Type: text/plain; charset=utf-8\r\nContent-Transfer-Encoding: quoted-printable\r\n\r\n";
+        out << "MIME-Version: 1.0\r\n";
+        if (file_list.empty()) {
+            out << text_headers << codec::encodeQuotedPrintable(body) << "\r\n";
+            return;
+        }
+        // "=_" cannot occur in base64 or quoted-printable text
+        std::random_device random;
+        std::ostringstream boundary;
+        boundary << "=_remote_agent_" << std::hex << random() << random() << random();
+        out << "Content-Type: multipart/mixed; boundary=\"" << boundary.str() << "\"\r\n\r\n";
+        out << "--" << boundary.str() << "\r\n" << text_headers << codec::encodeQuotedPrintable(body) << "\r\n";
+        prepareAttachment(out, file_list, boundary.str());
+        out << "--" << boundary.str() << "--\r\n";
+    }
+
+    void Mail::prepareAttachment(std::ostream& out, const std::list<File>& file_list, const std::string& boundary) {
+        // whole 76 character lines per chunk, so the chunks join seamlessly
+        const std::size_t chunk_size = 57 * 1024;
         for (const auto &file : file_list) {
-            mailio::message::content_type_t mime_type;
-            std::string lower_mime = boost::to_lower_copy(file.second);
-            auto separator_pos = lower_mime.find('/');
-
-            if (separator_pos != std::string::npos) {
-                std::string media_type_str = lower_mime.substr(0, separator_pos);
-                std::string media_subtype = lower_mime.substr(separator_pos + 1);
-                if (media_type_str == "text")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::TEXT, media_subtype);
-                else if (media_type_str == "image")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::IMAGE, media_subtype);
-                else if (media_type_str == "audio")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::AUDIO, media_subtype);
-                else if (media_type_str == "video")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::VIDEO, media_subtype);
-                else if (media_type_str == "application")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::APPLICATION, media_subtype);
-                else if (media_type_str == "multipart")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::MULTIPART, media_subtype);
-                else if (media_type_str == "message")
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::MESSAGE, media_subtype);
-                else
-                    mime_type = mailio::message::content_type_t(mailio::message::media_type_t::TEXT, "plain");
-            } else {
-                mime_type = mailio::message::content_type_t(mailio::message::media_type_t::TEXT, "plain");
+            std::string mime_type = boost::to_lower_copy(file.second);
+            auto separator_pos = mime_type.find('/');
+            static const std::vector<std::string> media_types{"text", "image", "audio", "video", "application",
+                                                              "multipart", "message"};
+            if (separator_pos == std::string::npos ||
+                std::find(media_types.begin(), media_types.end(), mime_type.substr(0, separator_pos)) == media_types.end())
+                mime_type = "text/plain";
+
+            std::ifstream ifs(file.first, std::ios::binary);
+            if (!ifs.is_open()) {
+                syslog(LOG_ERR, "Mail/prepareAttachment: cannot open %s", file.first.c_str());
+                throw std::runtime_error("cannot open " + file.first);
             }
-            std::shared_ptr<std::ifstream> ifs = std::make_shared<std::ifstream>(file.first, std::ios::binary);
-            attachment_list.push_back(std::make_tuple(
-                ifs,
-                mailio::string_t(std::filesystem::path(file.first).filename().string(), "ASCII", mailio::codec::codec_t::ASCII),
-                mime_type
-            ));
-        }
-        return std::move(attachment_list);
+            std::string name = std::filesystem::path(file.first).filename().string();
+            bool plain_name = std::all_of(name.begin(), name.end(), [](unsigned char c) {
+                return c >= 0x20 && c < 0x7f && c != '"' && c != '\\';
+            });
+            std::string name_param = "name=\"" + name + "\"";
+            std::string filename_param = "filename=\"" + name + "\"";
+            if (!plain_name) {
+                // RFC 2047 for the type parameter, RFC 2231 for the disposition
+                std::ostringstream encoded;
+                for (unsigned char c : name) {
+                    if (std::isalnum(c) || c == '.' || c == '-' || c == '_')
+                        encoded << c;
+                    else
+                        encoded << '%' << std::uppercase << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(c);
+                }
+                name_param = "name=\"=?UTF-8?B?" + codec::encodeBase64(name) + "?=\"";
+                filename_param = "filename*=utf-8''" + encoded.str();
+            }
+            out << "--" << boundary << "\r\n"
+                << "Content-Type: " << mime_type << "; " << name_param << "\r\n"
+                << "Content-Transfer-Encoding: base64\r\n"
+                << "Content-Disposition: attachment; " << filename_param << "\r\n\r\n";
+
+            std::string chunk(chunk_size, '\0');
+            bool empty = true;
+            while (ifs.read(&chunk[0], chunk_size) || ifs.gcount() > 0) {
+                chunk.resize(ifs.gcount());
+                out << codec::encodeBase64(chunk, 76);
+                chunk.resize(chunk_size);
+                empty = false;
+            }
+            // encoded lines end in CRLF already, the boundary needs one
+            if (empty)
+                out << "\r\n";
+        }
     }
 
     Error Mail::parseError(const std::string &error) { 
@@ -410,18 +709,217 @@ namespace remote_agent::mail {
         return mail_error;
     }
 
-    std::string Mail::generateTempFilename() {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<> dis(0, 15);
-        static const char* hex = "0123456789abcdef";
-        
-        std::string uuid;
-        for (int i = 0; i < 16; ++i) {
-            uuid += hex[dis(gen)];
+    std::list<unsigned long> Mail::matchRules(ImapSession& session, const std::list<unsigned long>& uids) {
+        // Only the headers of the candidates are downloaded, batched like
+        // fetchBatch, and checked locally; PEEK leaves the rejected ones unseen.
+        const auto& rules = *_config.imap_filter.rules;
+        const std::size_t batch_size = std::max(_config.imap_filter.fetch_batch_size, 1);
+        std::vector<unsigned long> pending(uids.begin(), uids.end());
+        std::set<unsigned long> matching;
+        for (std::size_t first = 0; first < pending.size(); first += batch_size) {
+            std::vector<unsigned long> batch(pending.begin() + first,
+                                             pending.begin() + std::min(first + batch_size, pending.size()));
+            std::set<unsigned long> checked;
+            for (const auto& response : session.uidFetch(uidSet(batch), "(UID BODY.PEEK[HEADER])")) {
+                auto items = parseFetchResponse(response);
+                auto uid = items.find("UID");
+                auto header = items.find("BODY[HEADER]");
+                if (uid == items.end() || header == items.end())
+                    continue;
+                checked.insert(std::stoul(uid->second.text));
+                if (rules.matches(header->second.text))
+                    matching.insert(std::stoul(uid->second.text));
+            }
+            // a header that never came is not a rejection, last_uid must not
+            // move past it
+            std::vector<unsigned long> missing;
+            for (unsigned long uid : batch) {
+                if (checked.count(uid) == 0)
+                    missing.push_back(uid);
+            }
+            if (!missing.empty())
+                throw mailio::imap_error("Fetching message failure.", uidSet(missing));
         }
-        
-        return std::filesystem::temp_directory_path() / ("temp-" + uuid + ".tmp");
+        syslog(LOG_INFO, "Mail/matchRules: %zu of %zu messages match the rules", matching.size(), uids.size());
+        std::list<unsigned long> matched;
+        for (unsigned long uid : uids) {
+            if (matching.count(uid) != 0)
+                matched.push_back(uid);
+        }
+        return matched;
+    }
+
+    std::map<unsigned long, std::string> Mail::fetchBatch(ImapSession& session, const std::vector<unsigned long>& uids,
+      const std::string& work_dir) {
+        // Message data goes through a MimeStream while it is read: the raw
+        // message and the decoded attachments reach the disk line by line, so
+        // memory does not grow with the message size. The UID may follow the
+        // message data, hence the staging directory renamed at the end.
+        std::map<unsigned long, std::string> stored;
+        std::unique_ptr<MimeStream> stream;
+        std::filesystem::path staging;
+
+        auto on_literal = [&](const char* data, std::size_t size) {
+            if (!stream) {
+                staging = std::filesystem::path(work_dir) / (".fetch-" + std::to_string(fetch_sequence++));
+                std::filesystem::create_directories(staging);
+                const std::string staging_dir = staging.string();
+                stream = std::make_unique<MimeStream>(
+                    staging_dir, [this, staging_dir](std::size_t index) { return partialPath(staging_dir, index); },
+                    [this, staging_dir](const std::filesystem::path& partial, const std::string& name, std::size_t index) {
+                        publishAttachment(partial, name, staging_dir, index);
+                    });
+            }
+            stream->write(data, size);
+        };
+        auto on_response = [&](std::string&& response) {
+            // e.g. a flag update of another message, it carries no body
+            if (!stream)
+                return;
+            std::unique_ptr<MimeStream> done = std::move(stream);
+            std::error_code ec;
+            try {
+                auto items = parseFetchResponse(response);
+                unsigned long uid = std::stoul(items["UID"].text);
+                if (!done->finish())
+                    throw std::runtime_error("cannot store message " + std::to_string(uid));
+                done.reset();
+                std::filesystem::path mail_dir = std::filesystem::path(work_dir) / std::to_string(uid);
+                // never replace a message directory another fetch produced
+                if (std::filesystem::exists(mail_dir, ec))
+                    throw std::runtime_error("message directory " + mail_dir.string() + " already exists");
+                std::filesystem::rename(staging, mail_dir);
+                syslog(LOG_INFO, "Mail content has written into: %s/mail.txt", mail_dir.c_str());
+                stored[uid] = mail_dir.string();
+            }
+            catch (const std::exception& exc) {
+                syslog(LOG_ERR, "Mail/fetchBatch: %s", exc.what());
+                done.reset();
+                std::filesystem::remove_all(staging, ec);
+            }
+        };
+
+        try {
+            session.uidFetch(uidSet(uids), "(UID BODY.PEEK[])", on_literal, on_response);
+        }
+        catch (...) {
+            if (stream) {
+                stream.reset();
+                std::error_code ec;
+                std::filesystem::remove_all(staging, ec);
+            }
+            throw;
+        }
+
+        if (!_config.imap_filter.read_only && !stored.empty()) {
+            std::vector<unsigned long> seen;
+            for (const auto& item : stored)
+                seen.push_back(item.first);
+            session.markSeen(uidSet(seen));
+        }
+        return stored;
+    }
+
+    std::string Mail::messageDirectory(const std::string& work_dir, unsigned long uid) {
+        // one directory per message so concurrent messages never share files
+        std::filesystem::path mail_dir = std::filesystem::path(work_dir) / std::to_string(uid);
+        if (std::filesystem::create_directories(mail_dir))
+            syslog(LOG_INFO, "Mail directory created: %s", mail_dir.c_str());
+        return mail_dir.string();
+    }
+
+    std::string Mail::uidSet(const std::vector<unsigned long>& uids) {
+        // sorted UIDs are collapsed into ranges, e.g. 3:7,9,12:13
+        std::string set;
+        for (std::size_t i = 0; i < uids.size();) {
+            std::size_t j = i;
+            while (j + 1 < uids.size() && uids[j + 1] == uids[j] + 1)
+                j++;
+            if (!set.empty())
+                set += ",";
+            set += std::to_string(uids[i]);
+            if (j > i)
+                set += ":" + std::to_string(uids[j]);
+            i = j + 1;
+        }
+        return set;
+    }
+
+    void Mail::fetchSelective(ImapSession& session, unsigned long uid, const std::string& work_dir) {
+        const std::string uid_str = std::to_string(uid);
+        auto responses = session.uidFetch(uid_str, "(BODYSTRUCTURE BODY.PEEK[HEADER])");
+        if (responses.empty())
+            throw mailio::imap_error("Fetching message failure.", uid_str);
+        auto items = parseFetchResponse(responses.front());
+
+        std::ofstream fos_text(std::filesystem::path(work_dir) / "mail.txt", std::ios::binary);
+        if (fos_text.is_open()) {
+            fos_text << items["BODY[HEADER]"].text;
+            fos_text.close();
+        }
+
+        std::size_t index = 0;
+        for (const auto& part : parseBodyStructure(items["BODYSTRUCTURE"])) {
+            index++;
+            if (!isWantedPart(part)) {
+                syslog(LOG_INFO, "Mail/fetchSelective: skipping part %s (%s/%s, %lu octets)", part.section.c_str(),
+                       part.type.c_str(), part.subtype.c_str(), part.size);
+                continue;
+            }
+            const std::string section = "BODY[" + part.section + "]";
+            auto part_responses = session.uidFetch(uid_str, "(BODY.PEEK[" + part.section + "])");
+            if (part_responses.empty())
+                throw mailio::imap_error("Fetching message part failure.", uid_str + " " + section);
+            auto part_items = parseFetchResponse(part_responses.front());
+
+            auto partial = partialPath(work_dir, index);
+            {
+                std::ofstream fos(partial, std::ios::binary | std::ios::trunc);
+                if (!fos.is_open()) {
+                    syslog(LOG_ERR, "Mail/fetchSelective: cannot open %s", partial.c_str());
+                    continue;
+                }
+                fos << codec::decodeTransfer(part_items[section].text, part.encoding);
+            }
+            publishAttachment(partial, part.filename, work_dir, index);
+        }
+        if (!_config.imap_filter.read_only)
+            session.markSeen(uid_str);
+    }
+
+    bool Mail::isWantedPart(const BodyPart& part) const {
+        const auto& filter = _config.imap_filter.attachments;
+        if (filter.max_size > 0 && part.size > filter.max_size)
+            return false;
+        if (part.filename.empty() && part.disposition != "attachment")
+            return false;
+        std::string extension = boost::to_lower_copy(std::filesystem::path(part.filename).extension().string());
+        if (!extension.empty() &&
+            std::find(filter.extensions.begin(), filter.extensions.end(), extension) != filter.extensions.end())
+            return true;
+        std::string mime = part.type + "/" + part.subtype;
+        return std::find(filter.mime_types.begin(), filter.mime_types.end(), mime) != filter.mime_types.end();
+    }
+
+    std::filesystem::path Mail::partialPath(const std::string& work_dir, std::size_t index) {
+        // Written next to its final name so the rename in publishAttachment
+        // stays on one filesystem and is atomic.
+        return std::filesystem::path(work_dir) / (".attachment-" + std::to_string(index) + ".partial");
+    }
+
+    void Mail::publishAttachment(const std::filesystem::path& partial, const std::string& name,
+      const std::string& work_dir, std::size_t index) {
+        std::string filename = std::filesystem::path(name).filename().string();
+        if (filename.empty() || filename == "." || filename == "..")
+            filename = "attachment-" + std::to_string(index);
+        std::filesystem::path target = std::filesystem::path(work_dir) / filename;
+        // rename() replaces silently: an equal name of another attachment, the
+        // raw message or a partial file still being written must survive
+        std::error_code ec;
+        if (filename == "mail.txt" || filename.rfind(".attachment-", 0) == 0 || std::filesystem::exists(target, ec))
+            target = std::filesystem::path(work_dir) / ("attachment-" + std::to_string(index) + "-" + filename);
+        std::filesystem::rename(partial, target);
+        syslog(LOG_INFO, "Mail attachment (%ld) has written into: %s", index, target.c_str());
     }
 
     std::string Mail::getCurrentTimeDirectoryName() {
@@ -0,0 +1,283 @@
+#include "mail_digest.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "file_utils.h"
+
+namespace remote_agent {
+
+    namespace {
+        // written next to its files, the result is only picked up again
+        // once this rename made it complete
+        bool writeDurably(const std::filesystem::path& path, const std::string& data) {
+            std::filesystem::path temp = path.string() + ".tmp";
+            int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0)
+                return false;
+            const char* next = data.data();
+            std::size_t size = data.size();
+            bool ok = true;
+            while (ok && size > 0) {
+                ssize_t written = ::write(fd, next, size);
+                if (written < 0) {
+                    ok = errno == EINTR;
+                    continue;
+                }
+                next += written;
+                size -= static_cast<std::size_t>(written);
+            }
+            ok = ok && ::fdatasync(fd) == 0;
+            ok = ::close(fd) == 0 && ok;
+            std::error_code ec;
+            if (ok)
+                std::filesystem::rename(temp, path, ec);
+            if (!ok || ec) {
+                std::filesystem::remove(temp, ec);
+                return false;
+            }
+            return true;
+        }
+    }
+
+    MailDigest::MailDigest(const DigestConfig& config, const std::string& work_dir, Emit emit)
+        : _config{config}, _digest_dir{std::filesystem::path(work_dir) / ".digest"}, _emit{std::move(emit)},
+          _sequence{static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count())} {
+        load();
+        _timer.startPeriodic(1000, [this]() { tick(); });
+    }
+
+    MailDigest::~MailDigest() {
+        stop();
+    }
+
+    void MailDigest::add(const MailTo& result) {
+        // the task run directory is removed once its result is handed over
+        MailTo kept = result;
+        std::string stored;
+        if (!store(kept, stored)) {
+            // the spool is durable on its own, better no digest than a lost result
+            syslog(LOG_ERR, "MailDigest/add: cannot keep result \"%s\", sending it alone",
+                   result.subject().c_str());
+            _emit(result);
+            return;
+        }
+        push(result.has_account_name() ? result.account_name() : "", std::move(kept), stored,
+             std::chrono::steady_clock::now() + std::chrono::seconds(_config.window_sec));
+    }
+
+    void MailDigest::push(const std::string& account, MailTo result, const std::string& stored,
+                          std::chrono::steady_clock::time_point deadline) {
+        Batch full;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto& batch = _batches[account];
+            if (batch.results.empty())
+                batch.deadline = deadline;
+            batch.results.push_back(std::move(result));
+            batch.stored.push_back(stored);
+            if (batch.results.size() < static_cast<std::size_t>(_config.max_results))
+                return;
+            full = std::move(batch);
+            _batches.erase(account);
+        }
+        flush(account, std::move(full));
+    }
+
+    bool MailDigest::store(MailTo& result, std::string& stored) {
+        std::filesystem::path dir = std::filesystem::path(_digest_dir) / "open" / std::to_string(_sequence++);
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        for (int i = 0; !ec && i < result.file_list_size(); i++) {
+            auto* file = result.mutable_file_list(i);
+            std::filesystem::path source = file->local_filepath();
+            std::filesystem::path target = dir / (std::to_string(i) + "_" + source.filename().string());
+            std::filesystem::create_hard_link(source, target, ec);
+            if (ec)
+                std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing, ec);
+            if (!ec)
+                file->set_local_filepath(target.string());
+        }
+        if (ec || !writeDurably(dir / "result.pb", result.SerializeAsString())) {
+            std::filesystem::remove_all(dir, ec);
+            return false;
+        }
+        stored = dir.string();
+        return true;
+    }
+
+    void MailDigest::load() {
+        std::filesystem::path open = std::filesystem::path(_digest_dir) / "open";
+        std::error_code ec;
+        if (!std::filesystem::is_directory(open, ec))
+            return;
+        // results of the last run already waited their window
+        auto now = std::chrono::steady_clock::now();
+        std::size_t restored = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(open, ec)) {
+            std::ifstream in(entry.path() / "result.pb", std::ios::binary);
+            MailTo result;
+            if (!in || !result.ParseFromIstream(&in)) {
+                // left incomplete by a crash while the result was stored
+                std::error_code ignored;
+                std::filesystem::remove_all(entry.path(), ignored);
+                continue;
+            }
+            push(result.has_account_name() ? result.account_name() : "", std::move(result),
+                 entry.path().string(), now);
+            restored++;
+        }
+        if (restored > 0)
+            syslog(LOG_INFO, "MailDigest/load: %zu result(s) waiting from the last run", restored);
+    }
+
+    void MailDigest::flushAll() {
+        std::map<std::string, Batch> batches;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            batches.swap(_batches);
+        }
+        for (auto& [account, batch] : batches)
+            flush(account, std::move(batch));
+    }
+
+    void MailDigest::stop() {
+        _timer.stop();
+        flushAll();
+    }
+
+    void MailDigest::tick() {
+        auto now = std::chrono::steady_clock::now();
+        std::map<std::string, Batch> due;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto it = _batches.begin(); it != _batches.end();) {
+                if (it->second.deadline <= now) {
+                    due.insert(std::move(*it));
+                    it = _batches.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+        for (auto& [account, batch] : due)
+            flush(account, std::move(batch));
+    }
+
+    void MailDigest::flush(const std::string& account, Batch batch) {
+        const auto& results = batch.results;
+        if (results.empty())
+            return;
+        // a result leaves open/ only once the spool holds the mail carrying it
+        auto release = [&batch]() {
+            std::error_code ec;
+            for (const auto& stored : batch.stored)
+                std::filesystem::remove_all(stored, ec);
+        };
+        if (results.size() == 1) {
+            if (_emit(results.front()))
+                release();
+            else
+                syslog(LOG_ERR, "MailDigest/flush: result \"%s\" was not spooled, keeping it",
+                       results.front().subject().c_str());
+            return;
+        }
+
+        // attachments are renamed <result>_<name> so equal file names of
+        // different tasks do not collide inside the bundle
+        uint64_t sequence = _sequence++;
+        std::filesystem::path staging = std::filesystem::path(_digest_dir) / std::to_string(sequence);
+        std::filesystem::path bundle = std::filesystem::path(_digest_dir) / ("digest_" + std::to_string(sequence) + ".zip");
+        std::vector<std::string> files;
+        std::ostringstream body;
+        body << results.size() << " task results" << std::endl << std::endl;
+        std::error_code ec;
+        std::filesystem::create_directories(staging, ec);
+        for (std::size_t i = 0; i < results.size(); i++) {
+            const auto& result = results[i];
+            body << i + 1 << ". " << result.subject() << std::endl << result.body() << std::endl;
+            for (const auto& file : result.file_list()) {
+                char prefix[16];
+                std::snprintf(prefix, sizeof(prefix), "%03zu_", i + 1);
+                std::filesystem::path source = file.local_filepath();
+                std::filesystem::path target = staging / (prefix + source.filename().string());
+                ec.clear();
+                std::filesystem::create_hard_link(source, target, ec);
+                if (ec)
+                    std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing, ec);
+                if (ec) {
+                    syslog(LOG_WARNING, "MailDigest/flush: skipping %s: %s", source.c_str(), ec.message().c_str());
+                    continue;
+                }
+                files.push_back(target.string());
+                body << "   " << target.filename().string() << std::endl;
+            }
+            body << std::endl;
+        }
+
+        MailTo digest;
+        if (!account.empty())
+            digest.set_account_name(account);
+        digest.set_subject("Digest: " + std::to_string(results.size()) + " task results");
+        digest.set_body(body.str());
+        std::vector<std::string> parts;
+        bool bundled = true;
+        if (!files.empty()) {
+            const auto& global = Config::getInstance().getGlobalConfig();
+            Zip zip(global.zip);
+            // split like a single task output, no part exceeds what one mail may carry
+            zip.setSegmentSize(global.result_archive.max_attachment_size);
+            zip.setCompressMethod(global.result_archive.compress_method);
+            zip.setCompressLevel(global.result_archive.compress_level);
+            auto err = zip.compress(files, bundle.string());
+            if (err.has_value()) {
+                syslog(LOG_ERR, "MailDigest/flush: %s", err.value().second.c_str());
+                for (const auto& part : Zip::segments(bundle.string()))
+                    std::filesystem::remove(part, ec);
+                bundled = false;
+            } else {
+                parts = Zip::segments(bundle.string());
+            }
+        }
+        // the bundle holds everything staged, no mail refers to the staging copies
+        std::filesystem::remove_all(staging, ec);
+        bool spooled = true;
+        if (!bundled) {
+            // never lose results because the bundle could not be built
+            for (const auto& result : results)
+                spooled = _emit(result) && spooled;
+        } else if (parts.empty()) {
+            spooled = _emit(digest);
+        }
+        for (std::size_t i = 0; i < parts.size(); i++) {
+            MailTo mail = digest;
+            if (parts.size() > 1) {
+                std::string part = std::to_string(i + 1) + "/" + std::to_string(parts.size());
+                mail.set_subject(digest.subject() + " (" + part + ")");
+                mail.set_body(digest.body() + "\nBundle part " + part +
+                              ". Save all parts into one directory and open the .zip part to extract it.\n");
+            }
+            auto* attachment = mail.add_file_list();
+            attachment->set_local_filepath(parts[i]);
+            attachment->set_mime_type(i + 1 == parts.size() ? "application/zip" : "application/octet-stream");
+            spooled = _emit(mail) && spooled;
+        }
+        // the spool keeps its own links once a mail is queued; if it refused
+        // one, the results stay in open/ and are batched again on next start
+        for (const auto& part : parts)
+            std::filesystem::remove(part, ec);
+        if (!spooled) {
+            syslog(LOG_ERR, "MailDigest/flush: digest of %zu results was not fully spooled, keeping them",
+                   results.size());
+            return;
+        }
+        release();
+    }
+};
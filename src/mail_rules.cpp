@@ -0,0 +1,127 @@
+#include "mail_rules.h"
+#include "codec.h"
+
+#include <boost/algorithm/string.hpp>
+#include <syslog.h>
+
+namespace remote_agent::mail {
+
+    namespace {
+        // std::regex recurses per character, a crafted subject of some
+        // megabytes would exhaust the stack; RFC 5322 lines end at 998 anyway
+        constexpr std::size_t MAX_SUBJECT_LENGTH = 998;
+
+        // Address part of a From value, e.g. `"Doe, J" <j@example.com>` or
+        // `j@example.com (J Doe)`, lower case.
+        std::string senderAddress(const std::string& value) {
+            std::string address;
+            auto open = value.rfind('<');
+            auto close = open == std::string::npos ? open : value.find('>', open);
+            if (close != std::string::npos) {
+                address = value.substr(open + 1, close - open - 1);
+            } else {
+                address = value.substr(0, value.find_first_of("(,"));
+            }
+            boost::trim(address);
+            boost::to_lower(address);
+            return address;
+        }
+    }
+
+    MailRules::MailRules(const Spec& spec) : _valid(true) {
+        try {
+            if (!spec.subject.empty())
+                _subject.emplace(spec.subject, std::regex::ECMAScript | std::regex::icase | std::regex::optimize);
+        }
+        catch (const std::regex_error& exc) {
+            // fail closed: a broken rule must not let every mail through
+            syslog(LOG_ERR, "MailRules: invalid subject regex \"%s\": %s", spec.subject.c_str(), exc.what());
+            _valid = false;
+        }
+        for (const auto& sender : spec.senders) {
+            std::string value = boost::trim_copy(boost::to_lower_copy(sender));
+            if (value.empty())
+                continue;
+            if (value[0] == '@')
+                _domains.insert(value.substr(1));
+            else
+                _addresses.insert(value);
+        }
+        for (const auto& header : spec.headers)
+            _headers.push_back(boost::to_lower_copy(header));
+    }
+
+    bool MailRules::matches(const std::string& header) const {
+        if (!_valid)
+            return false;
+
+        std::string subject;
+        std::string from;
+        std::vector<bool> present(_headers.size(), false);
+        std::string name;
+        std::string value;
+        auto endField = [&]() {
+            if (name.empty())
+                return;
+            if (name == "subject")
+                subject = value;
+            else if (name == "from" && from.empty())
+                from = value;
+            for (std::size_t i = 0; i < _headers.size(); i++) {
+                if (_headers[i] == name)
+                    present[i] = true;
+            }
+            name.clear();
+            value.clear();
+        };
+
+        std::size_t pos = 0;
+        while (pos < header.size()) {
+            std::size_t end = header.find('\n', pos);
+            if (end == std::string::npos)
+                end = header.size();
+            std::size_t line_end = end > pos && header[end - 1] == '\r' ? end - 1 : end;
+            std::string line = header.substr(pos, line_end - pos);
+            pos = end + 1;
+            if (line.empty())
+                break;
+            // folded continuation of the previous field
+            if (line[0] == ' ' || line[0] == '\t') {
+                if (!name.empty())
+                    value += line;
+                continue;
+            }
+            endField();
+            auto colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            name = boost::to_lower_copy(boost::trim_copy(line.substr(0, colon)));
+            value = line.substr(colon + 1);
+        }
+        endField();
+
+        for (bool found : present) {
+            if (!found)
+                return false;
+        }
+        if (!_addresses.empty() || !_domains.empty()) {
+            if (!senderAllowed(senderAddress(from)))
+                return false;
+        }
+        if (_subject.has_value()) {
+            std::string decoded = codec::decodeEncodedWords(boost::trim_copy(subject.substr(0, 4 * MAX_SUBJECT_LENGTH)));
+            if (decoded.size() > MAX_SUBJECT_LENGTH)
+                decoded.resize(MAX_SUBJECT_LENGTH);
+            if (!std::regex_search(decoded, _subject.value()))
+                return false;
+        }
+        return true;
+    }
+
+    bool MailRules::senderAllowed(const std::string& from) const {
+        if (_addresses.find(from) != _addresses.end())
+            return true;
+        auto at = from.rfind('@');
+        return at != std::string::npos && _domains.find(from.substr(at + 1)) != _domains.end();
+    }
+};
@@ -0,0 +1,397 @@
+#include "mail_spool.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace remote_agent {
+
+    namespace {
+        // index.log is left alone below this many superseded records
+        constexpr uint64_t COMPACT_MIN_RECORDS = 1024;
+
+        std::optional<Error> writeAll(int fd, const char* data, std::size_t size, const std::string& path) {
+            while (size > 0) {
+                ssize_t written = ::write(fd, data, size);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return std::make_pair(ErrorCode::FILE_CREATE_FAILED, "writing " + path + " failed");
+                }
+                data += written;
+                size -= static_cast<std::size_t>(written);
+            }
+            if (::fdatasync(fd) != 0)
+                return std::make_pair(ErrorCode::FILE_CLOSE_FAILED, "syncing " + path + " failed");
+            return std::nullopt;
+        }
+    }
+
+    MailSpool::MailSpool(const SpoolConfig& config, const std::string& work_dir)
+        : _config{config}, _spool_dir{std::filesystem::path(work_dir) / ".spool"}, _running{false},
+          _next_id{1}, _segment{0}, _segment_offset{0}, _dead_records{0}, _segment_fd{-1}, _index_fd{-1} {
+        load();
+    }
+
+    MailSpool::~MailSpool() {
+        stop();
+        if (_segment_fd >= 0)
+            ::close(_segment_fd);
+        if (_index_fd >= 0)
+            ::close(_index_fd);
+    }
+
+    std::optional<Error> MailSpool::enqueue(const MailTo& mail) {
+        if (!mail.has_account_name())
+            return std::make_pair(ErrorCode::BAD_CONFIG, "spooled mail has no account");
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t id = _next_id++;
+
+        // the task run directory may be gone by the time a retry succeeds,
+        // and callers remove their files once the job is queued, so a job
+        // is only accepted when it holds its own link or copy of each file
+        MailTo stored = mail;
+        std::filesystem::path files_dir = filesPath(id);
+        std::error_code ec;
+        auto keep = [&files_dir, &ec](std::string& path, const std::string& name) {
+            std::filesystem::path source = path;
+            std::filesystem::path target = files_dir / name;
+            std::filesystem::create_directories(files_dir, ec);
+            std::filesystem::create_hard_link(source, target, ec);
+            if (ec)
+                std::filesystem::copy_file(source, target, std::filesystem::copy_options::overwrite_existing, ec);
+            if (ec)
+                return false;
+            path = target.string();
+            return true;
+        };
+        bool kept = true;
+        for (int i = 0; kept && i < stored.file_list_size(); i++) {
+            auto* file = stored.mutable_file_list(i);
+            std::string path = file->local_filepath();
+            kept = keep(path, std::to_string(i) + "_" + std::filesystem::path(path).filename().string());
+            if (kept)
+                file->set_local_filepath(path);
+            else
+                syslog(LOG_ERR, "MailSpool/enqueue: cannot keep %s: %s", path.c_str(), ec.message().c_str());
+        }
+        if (kept && stored.has_content_file()) {
+            std::string path = stored.content_file();
+            kept = keep(path, "content.eml");
+            if (kept)
+                stored.set_content_file(path);
+            else
+                syslog(LOG_ERR, "MailSpool/enqueue: cannot keep %s: %s", path.c_str(), ec.message().c_str());
+        }
+        if (!kept) {
+            std::error_code ignored;
+            std::filesystem::remove_all(files_dir, ignored);
+            return std::make_pair(ErrorCode::FILE_CREATE_FAILED, "cannot keep files of spooled mail: " + ec.message());
+        }
+
+        std::string payload = stored.SerializeAsString();
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        std::string frame(reinterpret_cast<const char*>(&size), sizeof(size));
+        frame += payload;
+
+        if (_segment_offset > 0 && _segment_offset + frame.size() > _config.segment_size) {
+            auto err = openSegment(_segment + 1);
+            if (err.has_value()) {
+                std::filesystem::remove_all(files_dir, ec);
+                return err;
+            }
+        }
+        if (_segment_fd < 0) {
+            std::filesystem::remove_all(files_dir, ec);
+            return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "no spool segment open");
+        }
+        auto err = writeAll(_segment_fd, frame.data(), frame.size(), segmentPath(_segment));
+        if (err.has_value()) {
+            syslog(LOG_ERR, "MailSpool/enqueue: %s", err.value().second.c_str());
+            std::filesystem::remove_all(files_dir, ec);
+            return err;
+        }
+        IndexRecord record{id, _segment, _segment_offset + sizeof(size), size, 0,
+                           static_cast<int64_t>(std::time(nullptr)), static_cast<uint32_t>(JobState::PENDING), 0};
+        _segment_offset += frame.size();
+        err = appendIndex(record);
+        if (err.has_value())
+            return err;
+        _jobs[id] = Job{record, stored.account_name(), false};
+        _cv.notify_one();
+        return std::nullopt;
+    }
+
+    void MailSpool::start(Sender sender) {
+        if (_running)
+            return;
+        _sender = std::move(sender);
+        _running = true;
+        for (int i = 0; i < _config.workers; i++)
+            _workers.emplace_back(&MailSpool::work, this);
+    }
+
+    void MailSpool::stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+        _cv.notify_all();
+        for (auto& worker : _workers) {
+            if (worker.joinable())
+                worker.join();
+        }
+        _workers.clear();
+    }
+
+    std::size_t MailSpool::pending() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _jobs.size();
+    }
+
+    void MailSpool::load() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(_spool_dir) / "segments", ec);
+        std::filesystem::create_directories(std::filesystem::path(_spool_dir) / "files", ec);
+        if (ec) {
+            syslog(LOG_ERR, "MailSpool/load: %s: %s", _spool_dir.c_str(), ec.message().c_str());
+            return;
+        }
+
+        std::map<uint64_t, IndexRecord> latest;
+        std::ifstream index(std::filesystem::path(_spool_dir) / "index.log", std::ios::binary);
+        IndexRecord record;
+        while (index.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            latest[record.id] = record;
+            _next_id = std::max(_next_id, record.id + 1);
+        }
+        index.close();
+
+        for (const auto& [id, item] : latest) {
+            if (item.state != static_cast<uint32_t>(JobState::PENDING))
+                continue;
+            auto mail = readPayload(item);
+            if (!mail.has_value()) {
+                syslog(LOG_ERR, "MailSpool/load: dropping unreadable mail %lu", static_cast<unsigned long>(id));
+                continue;
+            }
+            _jobs[id] = Job{item, mail->account_name(), false};
+        }
+
+        uint64_t last_segment = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(std::filesystem::path(_spool_dir) / "segments", ec)) {
+            try {
+                last_segment = std::max<uint64_t>(last_segment, std::stoull(entry.path().stem().string()));
+            }
+            catch (const std::exception&) {
+            }
+        }
+        // a fresh segment after every start, so a torn tail is never extended
+        _segment = last_segment + 1;
+        compact();
+        openSegment(_segment);
+        if (!_jobs.empty())
+            syslog(LOG_INFO, "MailSpool/load: %lu mails waiting", static_cast<unsigned long>(_jobs.size()));
+    }
+
+    void MailSpool::work() {
+        while (_running) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto now = std::time(nullptr);
+            Job* next = nullptr;
+            std::time_t wake = 0;
+            for (auto& [id, job] : _jobs) {
+                if (job.in_flight || _in_flight[job.account] >= _config.max_per_account)
+                    continue;
+                if (job.record.next_attempt <= now) {
+                    next = &job;
+                    break;
+                }
+                if (wake == 0 || job.record.next_attempt < wake)
+                    wake = job.record.next_attempt;
+            }
+            if (next == nullptr) {
+                if (!_running)
+                    break;
+                if (wake == 0)
+                    _cv.wait(lock);
+                else
+                    _cv.wait_until(lock, std::chrono::system_clock::from_time_t(wake));
+                continue;
+            }
+
+            next->in_flight = true;
+            _in_flight[next->account]++;
+            IndexRecord record = next->record;
+            std::string account = next->account;
+            lock.unlock();
+
+            std::optional<Error> err;
+            auto mail = readPayload(record);
+            if (mail.has_value())
+                err = _sender(mail.value());
+            else
+                err = std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot read spooled mail");
+
+            lock.lock();
+            _in_flight[account]--;
+            auto job = _jobs.find(record.id);
+            if (job != _jobs.end())
+                finish(job->second, err, !mail.has_value() || (err.has_value() && isPermanent(err.value())));
+            // a freed account slot may unblock another worker
+            _cv.notify_all();
+        }
+    }
+
+    void MailSpool::finish(Job& job, const std::optional<Error>& err, bool permanent) {
+        auto& record = job.record;
+        job.in_flight = false;
+        if (!err.has_value()) {
+            record.state = static_cast<uint32_t>(JobState::DONE);
+            syslog(LOG_INFO, "MailSpool/finish: mail %lu sent via %s", static_cast<unsigned long>(record.id),
+                   job.account.c_str());
+        } else {
+            record.attempts++;
+            if (permanent ||
+                (_config.max_attempts > 0 && record.attempts >= static_cast<uint32_t>(_config.max_attempts))) {
+                record.state = static_cast<uint32_t>(JobState::FAILED);
+                syslog(LOG_ERR, "MailSpool/finish: giving up on mail %lu after %u attempts: %s",
+                       static_cast<unsigned long>(record.id), record.attempts, err.value().second.c_str());
+            } else {
+                record.next_attempt = static_cast<int64_t>(std::time(nullptr) + retryDelay(record.attempts));
+                syslog(LOG_WARNING, "MailSpool/finish: mail %lu failed (%s), retry %u in %ld s",
+                       static_cast<unsigned long>(record.id), err.value().second.c_str(), record.attempts,
+                       static_cast<long>(retryDelay(record.attempts)));
+            }
+        }
+        appendIndex(record);
+        // the previous record of this job is dead now, a finished job's own as well
+        _dead_records++;
+        if (record.state != static_cast<uint32_t>(JobState::PENDING)) {
+            std::error_code ec;
+            std::filesystem::remove_all(filesPath(record.id), ec);
+            _jobs.erase(record.id);
+            _dead_records++;
+        }
+        if (_jobs.empty() || (_dead_records >= COMPACT_MIN_RECORDS && _dead_records > _jobs.size()))
+            compact();
+    }
+
+    bool MailSpool::isPermanent(const Error& err) {
+        return err.first == ErrorCode::REJECTION || err.first == ErrorCode::BAD_CONFIG;
+    }
+
+    std::optional<MailTo> MailSpool::readPayload(const IndexRecord& record) const {
+        std::ifstream fis(segmentPath(record.segment), std::ios::binary);
+        if (!fis.is_open())
+            return std::nullopt;
+        std::string payload(record.size, '\0');
+        fis.seekg(static_cast<std::streamoff>(record.offset));
+        if (!fis.read(payload.data(), record.size))
+            return std::nullopt;
+        MailTo mail;
+        if (!mail.ParseFromString(payload))
+            return std::nullopt;
+        return mail;
+    }
+
+    std::optional<Error> MailSpool::appendIndex(const IndexRecord& record) {
+        std::string path = std::filesystem::path(_spool_dir) / "index.log";
+        if (_index_fd < 0)
+            _index_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (_index_fd < 0) {
+            syslog(LOG_ERR, "MailSpool/appendIndex: cannot open %s", path.c_str());
+            return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + path);
+        }
+        auto err = writeAll(_index_fd, reinterpret_cast<const char*>(&record), sizeof(record), path);
+        if (err.has_value())
+            syslog(LOG_ERR, "MailSpool/appendIndex: %s", err.value().second.c_str());
+        return err;
+    }
+
+    std::optional<Error> MailSpool::openSegment(uint64_t segment) {
+        if (_segment_fd >= 0)
+            ::close(_segment_fd);
+        std::string path = segmentPath(segment);
+        _segment_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (_segment_fd < 0) {
+            syslog(LOG_ERR, "MailSpool/openSegment: cannot open %s", path.c_str());
+            return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + path);
+        }
+        _segment = segment;
+        _segment_offset = static_cast<uint64_t>(::lseek(_segment_fd, 0, SEEK_END));
+        return std::nullopt;
+    }
+
+    std::optional<Error> MailSpool::compact() {
+        // rewrite the index with live jobs only, then drop what they no
+        // longer reference
+        std::filesystem::path spool_dir(_spool_dir);
+        std::string path = spool_dir / "index.log";
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream fos(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!fos.is_open()) {
+                syslog(LOG_ERR, "MailSpool/compact: cannot open %s", tmp_path.c_str());
+                return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + tmp_path);
+            }
+            for (const auto& [id, job] : _jobs)
+                fos.write(reinterpret_cast<const char*>(&job.record), sizeof(job.record));
+        }
+        if (_index_fd >= 0)
+            ::close(_index_fd);
+        _index_fd = -1;
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, path, ec);
+        if (ec) {
+            syslog(LOG_ERR, "MailSpool/compact: %s", ec.message().c_str());
+            return std::make_pair(ErrorCode::FILE_CREATE_FAILED, ec.message());
+        }
+        _dead_records = 0;
+
+        std::map<uint64_t, bool> live_segments;
+        for (const auto& [id, job] : _jobs)
+            live_segments[job.record.segment] = true;
+        for (const auto& entry : std::filesystem::directory_iterator(spool_dir / "segments", ec)) {
+            try {
+                uint64_t segment = std::stoull(entry.path().stem().string());
+                if (segment != _segment && live_segments.count(segment) == 0)
+                    std::filesystem::remove(entry.path(), ec);
+            }
+            catch (const std::exception&) {
+            }
+        }
+        for (const auto& entry : std::filesystem::directory_iterator(spool_dir / "files", ec)) {
+            try {
+                if (_jobs.count(std::stoull(entry.path().filename().string())) == 0)
+                    std::filesystem::remove_all(entry.path(), ec);
+            }
+            catch (const std::exception&) {
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::string MailSpool::segmentPath(uint64_t segment) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%08lu.seg", static_cast<unsigned long>(segment));
+        return std::filesystem::path(_spool_dir) / "segments" / name;
+    }
+
+    std::string MailSpool::filesPath(uint64_t id) const {
+        return std::filesystem::path(_spool_dir) / "files" / std::to_string(id);
+    }
+
+    std::time_t MailSpool::retryDelay(uint32_t attempts) const {
+        std::time_t delay = _config.retry_base_sec;
+        for (uint32_t i = 1; i < attempts && delay < _config.retry_max_sec; i++)
+            delay *= 2;
+        return std::min<std::time_t>(delay, _config.retry_max_sec);
+    }
+};
@@ -0,0 +1,120 @@
+#include "mailbox_state.h"
+
+#include <filesystem>
+#include <fstream>
+#include <syslog.h>
+
+#include <yaml-cpp/yaml.h>
+
+namespace remote_agent::mail {
+
+    std::mutex MailboxState::_file_mutex;
+
+    namespace {
+        std::mutex states_mutex;
+        std::map<std::string, std::shared_ptr<MailboxState>> states;
+    }
+
+    std::shared_ptr<MailboxState> MailboxState::forAccount(const std::string& account) {
+        std::lock_guard<std::mutex> lock(states_mutex);
+        auto& state = states[account];
+        if (!state)
+            state = std::make_shared<MailboxState>(account);
+        return state;
+    }
+
+    MailboxState::MailboxState(const std::string& account)
+        : _path{std::filesystem::path(Config::getInstance().getGlobalConfig().work_dir) / ".sync" / (account + ".yaml")} {
+        load();
+    }
+
+    std::optional<SyncState> MailboxState::get(const std::string& folder) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _folders.find(folder);
+        if (it == _folders.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    std::optional<Error> MailboxState::update(const std::string& folder, const SyncState& state) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto& delivered = _delivered[folder];
+        auto previous = _folders.find(folder);
+        if (previous != _folders.end() && previous->second.uid_validity != state.uid_validity)
+            delivered.clear();
+        delivered.erase(delivered.begin(), delivered.upper_bound(state.last_uid));
+        _folders[folder] = state;
+        return save();
+    }
+
+    std::set<unsigned long> MailboxState::delivered(const std::string& folder) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _delivered.find(folder);
+        if (it == _delivered.end())
+            return {};
+        return it->second;
+    }
+
+    void MailboxState::markDelivered(const std::string& folder, unsigned long uid) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _delivered[folder].insert(uid);
+    }
+
+    unsigned int MailboxState::fetchFailed(const std::string& folder, unsigned long uid) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto& failure = _failures[folder];
+        if (failure.first != uid)
+            failure = std::make_pair(uid, 0u);
+        return ++failure.second;
+    }
+
+    std::mutex& MailboxState::fetchMutex() {
+        return _fetch_mutex;
+    }
+
+    void MailboxState::load() {
+        std::lock_guard<std::mutex> lock(_file_mutex);
+        if (!std::filesystem::exists(_path))
+            return;
+        try {
+            YAML::Node root = YAML::LoadFile(_path);
+            for (const auto& item : root) {
+                SyncState state;
+                state.uid_validity = item.second["uid_validity"].as<unsigned long>(0);
+                state.last_uid = item.second["last_uid"].as<unsigned long>(0);
+                _folders[item.first.as<std::string>()] = state;
+            }
+        }
+        catch (const YAML::Exception& exc) {
+            // a broken state file only costs one full rescan
+            syslog(LOG_ERR, "MailboxState/load: %s: %s", _path.c_str(), exc.what());
+            _folders.clear();
+        }
+    }
+
+    std::optional<Error> MailboxState::save() {
+        std::lock_guard<std::mutex> lock(_file_mutex);
+        YAML::Node root;
+        for (const auto& [folder, state] : _folders) {
+            root[folder]["uid_validity"] = state.uid_validity;
+            root[folder]["last_uid"] = state.last_uid;
+        }
+        try {
+            std::filesystem::create_directories(std::filesystem::path(_path).parent_path());
+            std::string tmp_path = _path + ".tmp";
+            std::ofstream fos(tmp_path, std::ios::trunc);
+            if (!fos.is_open()) {
+                syslog(LOG_ERR, "MailboxState/save: cannot open %s", tmp_path.c_str());
+                return std::make_pair(ErrorCode::FILE_OPEN_FAILED, "cannot open " + tmp_path);
+            }
+            fos << root;
+            fos.close();
+            std::filesystem::rename(tmp_path, _path);
+        }
+        catch (const std::filesystem::filesystem_error& exc) {
+            syslog(LOG_ERR, "MailboxState/save: %s", exc.what());
+            return std::make_pair(ErrorCode::FILE_CREATE_FAILED, exc.what());
+        }
+        return std::nullopt;
+    }
+};
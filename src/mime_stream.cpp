@@ -0,0 +1,321 @@
+#include "mime_stream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <syslog.h>
+
+namespace remote_agent::mail {
+
+    namespace {
+        std::string trim(const std::string& str) {
+            auto first = str.find_first_not_of(" \t\r\n");
+            if (first == std::string::npos)
+                return "";
+            auto last = str.find_last_not_of(" \t\r\n");
+            return str.substr(first, last - first + 1);
+        }
+
+        std::string toLower(std::string str) {
+            std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+            return str;
+        }
+
+        int hexValue(char c) {
+            if (c >= '0' && c <= '9')
+                return c - '0';
+            if (c >= 'A' && c <= 'F')
+                return c - 'A' + 10;
+            if (c >= 'a' && c <= 'f')
+                return c - 'a' + 10;
+            return -1;
+        }
+
+        std::string percentDecode(const std::string& text) {
+            std::string decoded;
+            for (std::size_t i = 0; i < text.size(); i++) {
+                int high = (text[i] == '%' && i + 2 < text.size()) ? hexValue(text[i + 1]) : -1;
+                int low = high >= 0 ? hexValue(text[i + 2]) : -1;
+                if (low < 0) {
+                    decoded += text[i];
+                    continue;
+                }
+                decoded += static_cast<char>((high << 4) | low);
+                i += 2;
+            }
+            return decoded;
+        }
+
+        // Parameters of a Content-Type or Content-Disposition value by lower
+        // case name, with RFC 2231 continuations and charsets resolved.
+        std::map<std::string, std::string> parseParams(const std::string& value) {
+            std::map<std::string, std::string> params;
+            std::map<std::string, std::map<int, std::pair<bool, std::string>>> sections;
+            std::size_t pos = value.find(';');
+            while (pos != std::string::npos && pos < value.size()) {
+                pos++;
+                auto eq = value.find('=', pos);
+                if (eq == std::string::npos)
+                    break;
+                std::string name = toLower(trim(value.substr(pos, eq - pos)));
+                std::string text;
+                pos = eq + 1;
+                while (pos < value.size() && std::isspace(static_cast<unsigned char>(value[pos])))
+                    pos++;
+                if (pos < value.size() && value[pos] == '"') {
+                    for (pos++; pos < value.size() && value[pos] != '"'; pos++) {
+                        if (value[pos] == '\\' && pos + 1 < value.size())
+                            pos++;
+                        text += value[pos];
+                    }
+                    pos = value.find(';', pos);
+                } else {
+                    auto end = value.find(';', pos);
+                    text = trim(value.substr(pos, end == std::string::npos ? end : end - pos));
+                    pos = end;
+                }
+
+                auto star = name.find('*');
+                if (star == std::string::npos) {
+                    params[name] = text;
+                    continue;
+                }
+                std::string section = name.substr(star + 1);
+                bool extended = section.empty() || section.back() == '*';
+                if (!section.empty() && section.back() == '*')
+                    section.pop_back();
+                if (!section.empty() && !std::all_of(section.begin(), section.end(),
+                                                     [](unsigned char c) { return std::isdigit(c); }))
+                    continue;
+                sections[name.substr(0, star)][section.empty() ? 0 : std::stoi(section)] = {extended, text};
+            }
+            for (const auto& [name, parts] : sections) {
+                std::string joined;
+                for (const auto& [index, part] : parts) {
+                    std::string text = part.second;
+                    if (part.first) {
+                        // charset'language'value, only the first section has the prefix
+                        auto quote = text.find('\'');
+                        if (index == 0 && quote != std::string::npos && text.find('\'', quote + 1) != std::string::npos)
+                            text = text.substr(text.find('\'', quote + 1) + 1);
+                        text = percentDecode(text);
+                    }
+                    joined += text;
+                }
+                params[name] = joined;
+            }
+            return params;
+        }
+    }
+
+    MimeStream::MimeStream(const std::string& mail_dir, PartialPath partial_path, Publish publish)
+        : _partial_path{std::move(partial_path)}, _publish{std::move(publish)},
+          _raw{std::filesystem::path(mail_dir) / "mail.txt", std::ios::binary | std::ios::trunc},
+          _continued{false}, _state{State::HEADER}, _keep_field{false}, _index{0} {
+        if (!_raw.is_open())
+            syslog(LOG_ERR, "MimeStream: cannot open %s/mail.txt", mail_dir.c_str());
+    }
+
+    MimeStream::~MimeStream() {
+        if (_out.is_open()) {
+            _out.close();
+            std::error_code ec;
+            std::filesystem::remove(_partial, ec);
+        }
+    }
+
+    void MimeStream::write(const char* data, std::size_t size) {
+        if (_raw.is_open())
+            _raw.write(data, size);
+        std::size_t pos = 0;
+        while (pos < size) {
+            const char* start = data + pos;
+            const char* newline = static_cast<const char*>(std::memchr(start, '\n', size - pos));
+            if (newline == nullptr) {
+                _line.append(start, size - pos);
+                if (_line.size() > MAX_LINE) {
+                    // a line this long cannot be a boundary; the last two
+                    // octets wait in case they are a CR, and quoted-printable
+                    // keeps back a trailing =XX escape from its '='
+                    std::size_t keep = 2;
+                    if (_state == State::BODY && _entity.encoding == "quoted-printable") {
+                        std::size_t escape = _line.find('=', _line.size() - 3);
+                        if (escape != std::string::npos)
+                            keep = std::max(keep, _line.size() - escape);
+                    }
+                    std::string fragment = _line.substr(0, _line.size() - keep);
+                    _line.erase(0, _line.size() - keep);
+                    line(fragment, "", false);
+                    _continued = true;
+                }
+                return;
+            }
+            std::size_t length = newline - start + 1;
+            _line.append(start, length);
+            pos += length;
+            std::size_t eol_size = (_line.size() >= 2 && _line[_line.size() - 2] == '\r') ? 2 : 1;
+            line(_line.substr(0, _line.size() - eol_size), _line.substr(_line.size() - eol_size), true);
+            _line.clear();
+            _continued = false;
+        }
+    }
+
+    bool MimeStream::finish() {
+        if (!_line.empty())
+            line(_line, "", true);
+        _line.clear();
+        endPart();
+        if (!_raw.is_open())
+            return false;
+        _raw.flush();
+        bool written = _raw.good();
+        _raw.close();
+        return written;
+    }
+
+    void MimeStream::line(const std::string& content, const std::string& eol, bool complete) {
+        if (complete && !_continued && boundaryLine(content))
+            return;
+        switch (_state) {
+            case State::HEADER:
+                // the rest of an overlong header line is dropped
+                if (complete && !_continued)
+                    headerLine(content);
+                break;
+            case State::BODY:
+                bodyData(content, eol);
+                break;
+            case State::SKIP:
+                break;
+        }
+    }
+
+    bool MimeStream::boundaryLine(const std::string& content) {
+        if (_boundaries.empty() || content.size() < 2 || content[0] != '-' || content[1] != '-')
+            return false;
+        // an outer boundary also ends every part nested inside it
+        for (std::size_t level = _boundaries.size(); level-- > 0;) {
+            const std::string& boundary = _boundaries[level];
+            if (content.compare(2, boundary.size(), boundary) != 0)
+                continue;
+            std::string rest = trim(content.substr(2 + boundary.size()));
+            if (!rest.empty() && rest != "--")
+                continue;
+            endPart();
+            if (rest.empty()) {
+                _boundaries.resize(level + 1);
+                _state = State::HEADER;
+            } else {
+                _boundaries.resize(level);
+                _state = State::SKIP;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void MimeStream::headerLine(const std::string& content) {
+        if (content.empty()) {
+            beginBody();
+            return;
+        }
+        if (content[0] == ' ' || content[0] == '\t') {
+            if (_keep_field && !_fields.empty() && _fields.back().size() < MAX_HEADER)
+                _fields.back() += content;
+            return;
+        }
+        // only the Content-* fields matter for the structure
+        _keep_field = content.size() > 8 && toLower(content.substr(0, 8)) == "content-";
+        if (_keep_field)
+            _fields.push_back(content.substr(0, MAX_HEADER));
+    }
+
+    void MimeStream::beginBody() {
+        _entity = Entity{};
+        _entity.type = "text/plain";
+        std::string name;
+        for (const auto& field : _fields) {
+            auto colon = field.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string key = toLower(trim(field.substr(0, colon)));
+            std::string value = field.substr(colon + 1);
+            std::string token = toLower(trim(value.substr(0, value.find(';'))));
+            if (key == "content-type") {
+                auto params = parseParams(value);
+                _entity.type = token;
+                _entity.boundary = params["boundary"];
+                name = params["name"];
+            } else if (key == "content-transfer-encoding") {
+                _entity.encoding = token;
+            } else if (key == "content-disposition") {
+                _entity.disposition = token;
+                _entity.filename = parseParams(value)["filename"];
+            }
+        }
+        _fields.clear();
+        _keep_field = false;
+        if (_entity.filename.empty())
+            _entity.filename = name;
+        _entity.filename = codec::decodeEncodedWords(_entity.filename);
+
+        if (_entity.type.rfind("multipart/", 0) == 0 && !_entity.boundary.empty()) {
+            // the preamble up to the first boundary is skipped
+            _boundaries.push_back(_entity.boundary);
+            _state = State::SKIP;
+            return;
+        }
+        _state = State::BODY;
+        _pending_eol.clear();
+        _base64 = codec::Base64Decoder();
+        if (_entity.filename.empty() && _entity.disposition != "attachment")
+            return;
+        _index++;
+        _partial = _partial_path(_index);
+        _out.open(_partial, std::ios::binary | std::ios::trunc);
+        if (!_out.is_open())
+            syslog(LOG_ERR, "MimeStream: cannot open %s", _partial.c_str());
+    }
+
+    void MimeStream::bodyData(const std::string& content, const std::string& eol) {
+        if (!_out.is_open())
+            return;
+        // the line break before a boundary belongs to the boundary, so
+        // every line break is held back until more body data follows
+        if (_entity.encoding == "base64") {
+            std::string decoded;
+            _base64.decode(content.data(), content.size(), decoded);
+            emit(decoded);
+        } else if (_entity.encoding == "quoted-printable") {
+            bool soft_break = !eol.empty() && !content.empty() && content.back() == '=';
+            emit(_pending_eol + codec::decodeQuotedPrintable(soft_break ? content.substr(0, content.size() - 1) : content));
+            _pending_eol = soft_break ? "" : eol;
+        } else {
+            emit(_pending_eol + content);
+            _pending_eol = eol;
+        }
+    }
+
+    void MimeStream::endPart() {
+        _state = State::SKIP;
+        _pending_eol.clear();
+        if (!_out.is_open())
+            return;
+        _out.flush();
+        bool written = _out.good();
+        _out.close();
+        if (!written) {
+            syslog(LOG_ERR, "MimeStream: write failed for %s", _partial.c_str());
+            std::error_code ec;
+            std::filesystem::remove(_partial, ec);
+            return;
+        }
+        _publish(_partial, _entity.filename, _index);
+    }
+
+    void MimeStream::emit(const std::string& data) {
+        if (!data.empty())
+            _out.write(data.data(), data.size());
+    }
+};
@@ -111,6 +111,10 @@ void Runner::createOutputName() {
       temp_dir / (_task_name + "_" + std::to_string(generator()) + ".txt");
 }
 
+void Runner::setBeforeStep(std::function<bool(const Step &)> before_step) {
+  _before_step = std::move(before_step);
+}
+
 std::string Runner::getOutputfile() { return _output_file; }
 
 Task Runner::parseTasks(const std::string &yaml_file) {
@@ -172,6 +176,10 @@ int Runner::execute(const Task &task, std::optional<std::string> error) {
   register_log_file(_output_file);
   for (const auto & step : task.steps) {
     BOOST_LOG_TRIVIAL(info) << "-- Executing step: " << step.name;
+    if (_before_step && !_before_step(step)) {
+      BOOST_LOG_TRIVIAL(fatal) << "Preparing step " << step.name << " failed";
+      return -1;
+    }
     // Set up the environment for the step commands
     for (const auto &env : step.environments) {
       std::cout << "Setting environment variable: " << env.first
@@ -0,0 +1,171 @@
+#include "session_pool.h"
+
+#include <algorithm>
+#include <syslog.h>
+#include <vector>
+
+#include "mail.h"
+
+namespace remote_agent::mail {
+
+    SessionPool& SessionPool::getInstance() {
+        static SessionPool instance;
+        return instance;
+    }
+
+    SessionPool::SessionPool()
+        : _pool_config{Config::getInstance().getGlobalConfig().session_pool},
+          _timeout{std::chrono::seconds(std::max(Config::getInstance().getGlobalConfig().default_timeout, 1))} {
+        _maintenance_timer.startPeriodic(std::max(_pool_config.keepalive_interval_sec, 1) * 1000,
+                                         [this]() { maintain(); });
+    }
+
+    SessionPool::~SessionPool() {
+        // no keep-alive may run while the sessions are logged out
+        _maintenance_timer.stop();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _imap.clear();
+        _smtp.clear();
+    }
+
+    std::pair<ImapLease,std::optional<Error>> SessionPool::borrowImap(const AccountConfig& config) {
+        return borrow(_imap, config.name, [this, &config]() {
+            return Mail(config).openImap(_timeout);
+        });
+    }
+
+    std::pair<SmtpLease,std::optional<Error>> SessionPool::borrowSmtp(const AccountConfig& config) {
+        return borrow(_smtp, config.name, [this, &config]() {
+            return Mail(config).openSmtp(_timeout);
+        });
+    }
+
+    template <typename Session, typename Open>
+    std::pair<SessionLease<Session>,std::optional<Error>> SessionPool::borrow(Slots<Session>& slots,
+      const std::string& account, Open open) {
+        const auto max_sessions = static_cast<std::size_t>(std::max(_pool_config.max_per_account, 1));
+        const auto keepalive = std::chrono::seconds(_pool_config.keepalive_interval_sec);
+        auto release = [this, &slots, account](std::unique_ptr<Session> session, bool healthy) {
+            giveBack(slots, account, std::move(session), healthy);
+        };
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        // unordered_map keeps references to its elements stable on insertion
+        auto& slot = slots[account];
+        while (true) {
+            if (!slot.idle.empty()) {
+                IdleSession<Session> item = std::move(slot.idle.back());
+                slot.idle.pop_back();
+                slot.in_use++;
+                lock.unlock();
+                if (std::chrono::steady_clock::now() - item.last_checked < keepalive)
+                    return std::make_pair(SessionLease<Session>(std::move(item.session), release), std::nullopt);
+                try {
+                    item.session->noop();
+                    return std::make_pair(SessionLease<Session>(std::move(item.session), release), std::nullopt);
+                }
+                catch (const std::exception& exc) {
+                    syslog(LOG_INFO, "SessionPool/borrow(%s): dropping stale session: %s", account.c_str(), exc.what());
+                }
+                item.session.reset();
+                lock.lock();
+                slot.in_use--;
+                continue;
+            }
+            if (slot.in_use < max_sessions)
+                break;
+            if (!_cv.wait_for(lock, _timeout, [&slot, max_sessions]() {
+                    return !slot.idle.empty() || slot.in_use < max_sessions;
+                })) {
+                syslog(LOG_ERR, "SessionPool/borrow(%s): no session available", account.c_str());
+                return std::make_pair(SessionLease<Session>(),
+                                      std::make_pair(ErrorCode::NETWORK, "Session pool exhausted for " + account));
+            }
+        }
+        slot.in_use++;
+        lock.unlock();
+
+        auto [session, err] = open();
+        if (err.has_value() || !session) {
+            lock.lock();
+            slot.in_use--;
+            _cv.notify_all();
+            return std::make_pair(SessionLease<Session>(), err);
+        }
+        return std::make_pair(SessionLease<Session>(std::move(session), release), std::nullopt);
+    }
+
+    template <typename Session>
+    void SessionPool::giveBack(Slots<Session>& slots, const std::string& account, std::unique_ptr<Session> session,
+      bool healthy) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto& slot = slots[account];
+            slot.in_use--;
+            if (healthy) {
+                auto now = std::chrono::steady_clock::now();
+                slot.idle.push_back(IdleSession<Session>{std::move(session), now, now});
+            }
+            _cv.notify_all();
+        }
+        // broken sessions are logged out outside of the lock
+        session.reset();
+    }
+
+    template <typename Session>
+    void SessionPool::maintain(Slots<Session>& slots) {
+        const auto idle_timeout = std::chrono::seconds(_pool_config.idle_timeout_sec);
+        const auto keepalive = std::chrono::seconds(_pool_config.keepalive_interval_sec);
+        std::vector<std::unique_ptr<Session>> evicted;
+        std::vector<std::pair<std::string, IdleSession<Session>>> to_check;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto now = std::chrono::steady_clock::now();
+            for (auto& [account, slot] : slots) {
+                for (auto it = slot.idle.begin(); it != slot.idle.end();) {
+                    if (now - it->last_used >= idle_timeout) {
+                        evicted.push_back(std::move(it->session));
+                        it = slot.idle.erase(it);
+                    } else if (now - it->last_checked >= keepalive) {
+                        slot.in_use++;
+                        to_check.emplace_back(account, std::move(*it));
+                        it = slot.idle.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+        }
+        evicted.clear();
+
+        for (auto& [account, item] : to_check) {
+            bool healthy = true;
+            try {
+                item.session->noop();
+            }
+            catch (const std::exception& exc) {
+                syslog(LOG_INFO, "SessionPool/maintain(%s): keep-alive failed: %s", account.c_str(), exc.what());
+                healthy = false;
+            }
+            std::unique_ptr<Session> broken;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto& slot = slots[account];
+                slot.in_use--;
+                if (healthy) {
+                    item.last_checked = std::chrono::steady_clock::now();
+                    slot.idle.push_back(std::move(item));
+                } else {
+                    broken = std::move(item.session);
+                }
+                _cv.notify_all();
+            }
+        }
+    }
+
+    void SessionPool::maintain() {
+        maintain(_imap);
+        maintain(_smtp);
+    }
+};
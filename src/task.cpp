@@ -11,50 +11,70 @@ TaskParser::TaskParser() {}
 bool TaskParser::parseYaml(std::string filename) {
   _error = std::nullopt;
   try {
-    YAML::Node config = YAML::LoadFile(filename);
-    if (!config["name"]) {
-      _task.name = "Unnamed_task";
-      throw std::runtime_error("Missing 'name' field in YAML file.");
-    }
-    _task.name = config["name"].as<std::string>();
+    load(YAML::LoadFile(filename));
+  } catch (const std::exception &e) {
+    _error = "Error parsing YAML file: " + std::string(e.what());
+    return false;
+  }
+  return true;
+}
+
+bool TaskParser::parseYamlBuffer(const std::string &content) {
+  _error = std::nullopt;
+  try {
+    load(YAML::Load(content));
+  } catch (const std::exception &e) {
+    _error = "Error parsing YAML file: " + std::string(e.what());
+    return false;
+  }
+  return true;
+}
 
-    if (!config["steps"] || !config["steps"].IsSequence()) {
+void TaskParser::load(const YAML::Node &config) {
+  if (!config["name"]) {
+    _task.name = "Unnamed_task";
+    throw std::runtime_error("Missing 'name' field in YAML file.");
+  }
+  _task.name = config["name"].as<std::string>();
+
+  if (!config["steps"] || !config["steps"].IsSequence()) {
+    throw std::runtime_error(
+        "'steps' field is missing or not a sequence in YAML file.");
+  }
+  for (const auto &step : config["steps"]) {
+    if (!step["name"]) {
       throw std::runtime_error(
-          "'steps' field is missing or not a sequence in YAML file.");
+          "A step is missing the 'name' field in YAML file.");
     }
-    for (const auto &step : config["steps"]) {
-      if (!step["name"]) {
-        throw std::runtime_error(
-            "A step is missing the 'name' field in YAML file.");
-      }
-      Step step_obj;
-      step_obj.name = step["name"].as<std::string>();
+    Step step_obj;
+    step_obj.name = step["name"].as<std::string>();
 
-      if (!step["commands"] || !step["commands"].IsSequence()) {
-        throw std::runtime_error(
-            "The 'commands' field is missing or not a sequence in a step.");
-      }
-      for (const auto &command : step["commands"]) {
-        step_obj.commands.push_back(command.as<std::string>());
-      }
+    if (!step["commands"] || !step["commands"].IsSequence()) {
+      throw std::runtime_error(
+          "The 'commands' field is missing or not a sequence in a step.");
+    }
+    for (const auto &command : step["commands"]) {
+      step_obj.commands.push_back(command.as<std::string>());
+    }
 
-      if (step["environments"] && step["environments"].IsSequence()) {
-        for (const auto &env : step["environments"]) {
-          if (env.IsMap()) {
-            for (const auto &env_pair : env) {
-              step_obj.environments[env_pair.first.as<std::string>()] =
-                  env_pair.second.as<std::string>();
-            }
+    if (step["environments"] && step["environments"].IsSequence()) {
+      for (const auto &env : step["environments"]) {
+        if (env.IsMap()) {
+          for (const auto &env_pair : env) {
+            step_obj.environments[env_pair.first.as<std::string>()] =
+                env_pair.second.as<std::string>();
           }
         }
       }
-      _task.steps.push_back(step_obj);
     }
-  } catch (const std::exception &e) {
-    _error = "Error parsing YAML file: " + std::string(e.what());
-    return false;
+
+    if (step["payload"] && step["payload"].IsSequence()) {
+      for (const auto &entry : step["payload"]) {
+        step_obj.payload.push_back(entry.as<std::string>());
+      }
+    }
+    _task.steps.push_back(step_obj);
   }
-  return true;
 }
 
 TaskParser::~TaskParser() {}
@@ -0,0 +1,118 @@
+#include "tls_context.h"
+
+#include <syslog.h>
+
+namespace remote_agent::mail {
+
+    namespace {
+        std::mutex contexts_mutex;
+        std::map<std::string, std::shared_ptr<TlsContext>> contexts;
+    }
+
+    std::shared_ptr<TlsContext> TlsContext::forHost(const std::string& host, unsigned port, bool verify_peer) {
+        std::string key = host + ":" + std::to_string(port) + (verify_peer ? "" : "/noverify");
+        std::lock_guard<std::mutex> lock(contexts_mutex);
+        auto& context = contexts[key];
+        if (!context)
+            context = std::make_shared<TlsContext>(host, verify_peer);
+        return context;
+    }
+
+    TlsContext::TlsContext(const std::string& host, bool verify_peer)
+        : _host{host}, _verify_peer{verify_peer}, _context{boost::asio::ssl::context::tls_client},
+          _session{nullptr}, _handshakes{0}, _resumed{0} {
+        // loading the CA bundle is the expensive part of a context, do it once
+        _context.set_default_verify_paths();
+        _context.set_verify_mode(verify_peer ? boost::asio::ssl::verify_peer : boost::asio::ssl::verify_none);
+        SSL_CTX* ctx = _context.native_handle();
+        SSL_CTX_set_app_data(ctx, this);
+        // clients only resume what they offer themselves; the new session
+        // callback also catches TLS 1.3 tickets that arrive after the handshake
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, &TlsContext::onNewSession);
+    }
+
+    TlsContext::~TlsContext() {
+        if (_session != nullptr)
+            SSL_SESSION_free(_session);
+    }
+
+    boost::asio::ssl::context& TlsContext::context() {
+        return _context;
+    }
+
+    const std::string& TlsContext::host() const {
+        return _host;
+    }
+
+    bool TlsContext::verifyPeer() const {
+        return _verify_peer;
+    }
+
+    void TlsContext::prepare(SSL* ssl) {
+        SSL_set_tlsext_host_name(ssl, _host.c_str());
+        if (_verify_peer)
+            SSL_set1_host(ssl, _host.c_str());
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_session != nullptr)
+            SSL_set_session(ssl, _session);
+    }
+
+    void TlsContext::handshakeDone(bool resumed) {
+        unsigned long handshakes = ++_handshakes;
+        unsigned long resumptions = resumed ? ++_resumed : _resumed.load();
+        syslog(LOG_DEBUG, "TlsContext(%s): %s handshake, %lu of %lu resumed", _host.c_str(),
+               resumed ? "abbreviated" : "full", resumptions, handshakes);
+    }
+
+    int TlsContext::onNewSession(SSL* ssl, SSL_SESSION* session) {
+        auto* self = static_cast<TlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+        if (self == nullptr)
+            return 0;
+        std::lock_guard<std::mutex> lock(self->_mutex);
+        if (self->_session != nullptr)
+            SSL_SESSION_free(self->_session);
+        // returning 1 hands our reference of session over to the cache
+        self->_session = session;
+        return 1;
+    }
+
+    TlsDialog::TlsDialog(const mailio::dialog& other, std::shared_ptr<TlsContext> context)
+        : mailio::dialog(other), _context{std::move(context)},
+          _stream{std::make_shared<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>>(*socket_,
+                                                                                            _context->context())} {
+        _context->prepare(_stream->native_handle());
+        try {
+            _stream->handshake(boost::asio::ssl::stream_base::client);
+        }
+        catch (const boost::system::system_error& exc) {
+            if (_context->verifyPeer())
+                syslog(LOG_ERR, "TlsDialog(%s): handshake failed with tls.verify_peer enabled: %s", _context->host().c_str(),
+                       exc.what());
+            throw mailio::dialog_error("Switching to TLS failed.", exc.what());
+        }
+        _context->handshakeDone(SSL_session_reused(_stream->native_handle()) == 1);
+    }
+
+    void TlsDialog::send(const std::string& line) {
+        if (timeout_.count() == 0)
+            send_sync(*_stream, line);
+        else
+            send_async(*_stream, line);
+    }
+
+    std::string TlsDialog::receive(bool raw) {
+        if (timeout_.count() == 0)
+            return receive_sync(*_stream, raw);
+        return receive_async(*_stream, raw);
+    }
+
+    boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>& TlsDialog::stream() {
+        return *_stream;
+    }
+
+    bool TlsDialog::pending() {
+        SSL* ssl = _stream->native_handle();
+        return SSL_pending(ssl) > 0 || SSL_has_pending(ssl) == 1 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+    }
+};